@@ -0,0 +1,386 @@
+// Shell benchmark: drives ./fat over a pipe and times its commands
+//
+// usage: bench [-f fat_binary] [-n repeats] [-s write_bytes] [-S startups] image
+//
+// Every command is sent on its own and timed until the shell prints its next
+// prompt. Syscall and byte counts come from /proc/<pid>/io of the shell, so
+// they include the shell reading the command and printing its output; the
+// "noop" row ("cd .") shows that fixed share. write/del modify the image but
+// leave it as it was found, tail and peek read 64 bytes at the end and in
+// the middle of the written file in between, append doubles it and truncate
+// cuts it back; extract copies the whole tree into the scratch
+// directory. "startup" times a plain start of the shell, "startup_verbose"
+// one with -v. Results are JSON lines on stdout, one per command.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <ftw.h>
+
+#define MAX_OPS 16
+#define TIMEOUT_MS 120000
+
+typedef struct {
+    unsigned long rchar, wchar, syscr, syscw;
+} IoCounts;
+
+typedef struct {
+    const char *name;
+    double *samples;
+    int count;
+    unsigned long bytes;
+    IoCounts io;
+    int errors;
+} Op;
+
+typedef struct {
+    pid_t pid;
+    int to_shell, from_shell;
+    char *output;
+    size_t length, capacity;
+} Shell;
+
+Op ops[MAX_OPS];
+int op_count = 0;
+int repeats = 20;
+int sample_capacity;            // samples one op can hold
+
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+Op *get_op(const char *name)
+{
+    for (int i = 0; i < op_count; i++)
+        if (strcmp(ops[i].name, name) == 0)
+            return &ops[i];
+
+    Op *op = &ops[op_count++];
+    memset(op, 0, sizeof(*op));
+    op->name = name;
+    op->samples = malloc(sizeof(double) * sample_capacity);
+    return op;
+}
+
+int read_io(pid_t pid, IoCounts *io)
+{
+    char path[64], key[32];
+    unsigned long value;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+
+    memset(io, 0, sizeof(*io));
+    while (fscanf(f, "%31[^:]: %lu\n", key, &value) == 2)
+    {
+        if (strcmp(key, "rchar") == 0) io->rchar = value;
+        else if (strcmp(key, "wchar") == 0) io->wchar = value;
+        else if (strcmp(key, "syscr") == 0) io->syscr = value;
+        else if (strcmp(key, "syscw") == 0) io->syscw = value;
+    }
+    fclose(f);
+    return 0;
+}
+
+// The shell is idle once its output ends in a prompt line ("Groot...>")
+bool at_prompt(const Shell *sh)
+{
+    if (sh->length == 0 || sh->output[sh->length - 1] != '>')
+        return false;
+    size_t line = sh->length - 1;
+    while (line > 0 && sh->output[line - 1] != '\n')
+        line--;
+    return sh->length - line >= 6 && strncmp(sh->output + line, "Groot", 5) == 0;
+}
+
+// Collect output until the next prompt; returns -1 if the shell went away
+int wait_prompt(Shell *sh)
+{
+    sh->length = 0;
+    while (!at_prompt(sh))
+    {
+        struct pollfd pfd = {sh->from_shell, POLLIN, 0};
+        if (poll(&pfd, 1, TIMEOUT_MS) <= 0)
+            return -1;
+        if (sh->length + 65536 + 1 > sh->capacity)
+        {
+            sh->capacity = (sh->length + 65536 + 1) * 2;
+            sh->output = realloc(sh->output, sh->capacity);
+        }
+        ssize_t n = read(sh->from_shell, sh->output + sh->length, 65536);
+        if (n <= 0)
+            return -1;
+        sh->length += n;
+    }
+    sh->output[sh->length] = '\0';
+    return 0;
+}
+
+int shell_start(Shell *sh, const char *fat_binary, const char *image, bool verbose)
+{
+    int in[2], out[2];
+    if (pipe(in) != 0 || pipe(out) != 0)
+        return -1;
+
+    memset(sh, 0, sizeof(*sh));
+    sh->pid = fork();
+    if (sh->pid < 0)
+        return -1;
+    if (sh->pid == 0)
+    {
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        dup2(out[1], 2);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        if (verbose)
+            execl(fat_binary, fat_binary, "-v", "-i", image, (char *)NULL);
+        else
+            execl(fat_binary, fat_binary, "-i", image, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    sh->to_shell = in[1];
+    sh->from_shell = out[0];
+    return 0;
+}
+
+void shell_stop(Shell *sh)
+{
+    if (write(sh->to_shell, "exit\n", 5) != 5)
+        kill(sh->pid, SIGTERM);
+    close(sh->to_shell);
+    waitpid(sh->pid, NULL, 0);
+    close(sh->from_shell);
+    free(sh->output);
+}
+
+// Send one command and record its latency and I/O under op_name
+int run(Shell *sh, const char *op_name, const char *command)
+{
+    Op *op = get_op(op_name);
+    IoCounts before, after;
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%s\n", command);
+
+    read_io(sh->pid, &before);
+    double started = now_ms();
+    if (write(sh->to_shell, line, len) != len || wait_prompt(sh) != 0)
+    {
+        fprintf(stderr, "bench: shell stopped during \"%s\"\n", command);
+        return -1;
+    }
+    double elapsed = now_ms() - started;
+    read_io(sh->pid, &after);
+
+    op->samples[op->count++] = elapsed;
+    op->io.rchar += after.rchar - before.rchar;
+    op->io.wchar += after.wchar - before.wchar;
+    op->io.syscr += after.syscr - before.syscr;
+    op->io.syscw += after.syscw - before.syscw;
+    if (strstr(sh->output, "Error") != NULL)
+        op->errors++;
+
+    // Bytes moved by the data commands, as the shell reports them
+    const char *total = strstr(sh->output, "Total bytes read: ");
+    if (total != NULL)
+        op->bytes += strtoul(total + 18, NULL, 10);
+    const char *extracted = strstr(sh->output, "Extracted ");
+    if (extracted != NULL && (total = strstr(extracted, "Transferred ")) != NULL)
+        op->bytes += strtoul(total + 12, NULL, 10);
+    return 0;
+}
+
+int remove_path(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(const double *sorted, int count, int p)
+{
+    int rank = (p * count + 99) / 100; // nearest rank
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void report(const Op *op)
+{
+    if (op->count == 0)
+        return;
+
+    double *sorted = malloc(sizeof(double) * op->count);
+    double total = 0;
+    memcpy(sorted, op->samples, sizeof(double) * op->count);
+    qsort(sorted, op->count, sizeof(double), compare_double);
+    for (int i = 0; i < op->count; i++)
+        total += sorted[i];
+
+    printf("{\"op\":\"%s\",\"samples\":%d,\"errors\":%d,\"mean_ms\":%.4f,\"p50_ms\":%.4f,\"p90_ms\":%.4f,"
+           "\"p99_ms\":%.4f,\"max_ms\":%.4f,\"bytes\":%lu,\"mib_s\":%.2f,"
+           "\"syscr\":%.1f,\"syscw\":%.1f,\"rchar\":%.0f,\"wchar\":%.0f}\n",
+           op->name, op->count, op->errors, total / op->count,
+           percentile(sorted, op->count, 50), percentile(sorted, op->count, 90),
+           percentile(sorted, op->count, 99), sorted[op->count - 1],
+           op->bytes, total > 0 ? op->bytes / (1024.0 * 1024.0) / (total / 1000.0) : 0.0,
+           (double)op->io.syscr / op->count, (double)op->io.syscw / op->count,
+           (double)op->io.rchar / op->count, (double)op->io.wchar / op->count);
+    free(sorted);
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: bench [-f fat_binary] [-n repeats] [-s write_bytes] [-S startups] image\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *fat_binary = "./fat";
+    unsigned long write_bytes = 1024 * 1024;
+    int startups = 5;
+    const char *image = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-')
+        {
+            image = argv[i];
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char *value = argv[++i];
+        switch (argv[i - 1][1])
+        {
+        case 'f': fat_binary = value; break;
+        case 'n': repeats = atoi(value); break;
+        case 's': write_bytes = strtoul(value, NULL, 10); break;
+        case 'S': startups = atoi(value); break;
+        default: usage(); return 1;
+        }
+    }
+    if (image == NULL || repeats <= 0 || startups <= 0)
+    {
+        usage();
+        return 1;
+    }
+
+    // cd runs twice per repeat
+    sample_capacity = (repeats > startups ? repeats : startups) * 2;
+
+    // Work in a scratch directory, the shell drops output_<file> next to it
+    char *fat_path = realpath(fat_binary, NULL);
+    char *image_path = realpath(image, NULL);
+    char scratch[] = "/tmp/fatbench.XXXXXX";
+    if (fat_path == NULL || image_path == NULL || mkdtemp(scratch) == NULL || chdir(scratch) != 0)
+    {
+        fprintf(stderr, "bench: could not set up %s with %s\n", image, fat_binary);
+        return 1;
+    }
+
+    FILE *payload = fopen("bench.bin", "wb");
+    for (unsigned long i = 0; payload != NULL && i < write_bytes; i++)
+        fputc((int)(i * 131 >> 3), payload);
+    if (payload == NULL || fclose(payload) != 0)
+    {
+        fprintf(stderr, "bench: could not create the write payload\n");
+        return 1;
+    }
+
+    printf("{\"bench\":\"fat\",\"image\":\"%s\",\"repeats\":%d,\"startups\":%d,\"write_bytes\":%lu}\n",
+           image_path, repeats, startups, write_bytes);
+
+    Shell sh;
+    int status = 0;
+
+    // Startup: spawn to first prompt, I/O counted from process start. The
+    // verbose runs (-v, listing the root) go first, the last plain shell is
+    // kept for the commands below.
+    for (int s = 0; s < startups * 2 && status == 0; s++)
+    {
+        bool verbose = s < startups;
+        Op *op = get_op(verbose ? "startup_verbose" : "startup");
+        IoCounts io;
+        double started = now_ms();
+        if (shell_start(&sh, fat_path, image_path, verbose) != 0 || wait_prompt(&sh) != 0)
+        {
+            fprintf(stderr, "bench: could not start %s\n", fat_path);
+            return 1;
+        }
+        op->samples[op->count++] = now_ms() - started;
+        if (read_io(sh.pid, &io) == 0)
+        {
+            op->io.rchar += io.rchar;
+            op->io.wchar += io.wchar;
+            op->io.syscr += io.syscr;
+            op->io.syscw += io.syscw;
+        }
+        if (s + 1 < startups * 2)
+            shell_stop(&sh);
+    }
+
+    // Random access into the middle of the written file
+    char peek[64];
+    snprintf(peek, sizeof(peek), "peek bench.bin %lu 64", write_bytes / 2);
+
+    // The written file grows by its own size and is cut back again
+    char truncate[64];
+    snprintf(truncate, sizeof(truncate), "truncate bench.bin %lu", write_bytes);
+
+    for (int r = 0; r < repeats && status == 0; r++)
+    {
+        status |= run(&sh, "noop", "cd .");
+        status |= run(&sh, "ls", "ls");
+        status |= run(&sh, "tree", "tree");
+        status |= run(&sh, "cd", "cd DIR1");
+        status |= run(&sh, "cd", "cd ..");
+        status |= run(&sh, "read", "read F0000000.DAT");
+        status |= run(&sh, "extract", "extract / tree");
+        status |= run(&sh, "write", "write bench.bin");
+        get_op("write")->bytes += write_bytes;
+        status |= run(&sh, "tail", "tail bench.bin 64");
+        status |= run(&sh, "peek", peek);
+        status |= run(&sh, "append", "append bench.bin bench.bin");
+        get_op("append")->bytes += write_bytes;
+        status |= run(&sh, "truncate", truncate);
+        status |= run(&sh, "del", "del bench.bin");
+    }
+    shell_stop(&sh);
+
+    for (int i = 0; i < op_count; i++)
+        report(&ops[i]);
+
+    // Leave nothing behind in the scratch directory
+    unlink("bench.bin");
+    unlink("output_F0000000.DAT");
+    nftw("tree", remove_path, 16, FTW_DEPTH | FTW_PHYS);
+    if (chdir("/") == 0)
+        rmdir(scratch);
+    free(fat_path);
+    free(image_path);
+    return status == 0 ? 0 : 1;
+}
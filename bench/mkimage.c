@@ -0,0 +1,403 @@
+// Synthetic FAT16 image generator for the benchmarks
+//
+// usage: mkimage [-o image] [-m size_mib] [-c cluster_bytes] [-d depth]
+//                [-n files] [-s file_bytes] [-f frag_percent] [-r seed]
+//
+// Builds an MBR disk with one FAT16 partition. The directories form a chain
+// DIR1/DIR2/.../DIR<depth> under the root and files F0000000.DAT, F0000001.DAT...
+// are dealt out round-robin over the root and that chain, so F0000000.DAT is
+// always in the root. Once the fixed root fills up the chain takes the rest. File sizes vary between half and one and a half times
+// file_bytes.
+//
+// Fragmentation is made the way a real volume gets it: while a file is written,
+// each of its clusters is followed by a cluster of a temporary file with
+// probability frag_percent. The temporary files are deleted at the end, which
+// leaves the files interleaved with one cluster holes and the directories
+// with deleted (0xE5) entries.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "../fat.h"
+
+#define SECTOR_SIZE 512
+#define PARTITION_START 63
+#define ROOT_ENTRIES 512
+#define MAX_DEPTH 64
+
+typedef struct {
+    unsigned int cluster;       // first cluster, 0 for the root
+    unsigned int entries;       // slots in use, including "." and ".."
+    unsigned int capacity;      // slots available
+    Fat16Entry *slots;
+} Dir;
+
+unsigned short *fat;
+unsigned int cluster_count;     // highest valid cluster + 1
+unsigned int next_cluster = 2;
+unsigned long data_offset;
+unsigned int cluster_size;
+unsigned int seed = 1;
+
+unsigned int next_random()
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) & 0x7FFF;
+}
+
+int alloc_cluster()
+{
+    if (next_cluster >= cluster_count)
+    {
+        printf("Error: Image is too small for the requested files\n");
+        exit(1);
+    }
+    return next_cluster++;
+}
+
+void make_entry(Fat16Entry *entry, const char *name, const char *ext, unsigned char attributes,
+                unsigned int cluster, unsigned int size)
+{
+    memset(entry, 0, sizeof(*entry));
+    memset(entry->filename, ' ', 8);
+    memset(entry->ext, ' ', 3);
+    memcpy(entry->filename, name, strlen(name));
+    memcpy(entry->ext, ext, strlen(ext));
+    entry->attributes = attributes;
+    entry->modify_time = (12 << 11);                      // 12:00:00
+    entry->modify_date = ((2024 - 1980) << 9) | (1 << 5) | 1; // 2024-01-01
+    entry->starting_cluster = cluster;
+    entry->file_size = size;
+}
+
+Fat16Entry *add_entry(Dir *dir)
+{
+    if (dir->entries >= dir->capacity)
+    {
+        printf("Error: Directory is out of entries\n");
+        exit(1);
+    }
+    return &dir->slots[dir->entries++];
+}
+
+void write_at(FILE *out, unsigned long offset, const void *data, size_t len)
+{
+    fseek(out, offset, SEEK_SET);
+    if (fwrite(data, 1, len, out) != len)
+    {
+        printf("Error: Could not write image\n");
+        exit(1);
+    }
+}
+
+void usage()
+{
+    printf("usage: mkimage [-o image] [-m size_mib] [-c cluster_bytes] [-d depth]\n"
+           "               [-n files] [-s file_bytes] [-f frag_percent] [-r seed]\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = "sd.img";
+    unsigned int size_mib = 64, cluster_bytes = 4096, depth = 4, files = 1000, file_bytes = 16384, frag = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (argv[i][0] != '-' || argv[i][1] == '\0' || argv[i][2] != '\0' || i + 1 >= argc)
+        {
+            usage();
+            return 1;
+        }
+        const char *value = argv[++i];
+        switch (argv[i - 1][1])
+        {
+        case 'o': path = value; break;
+        case 'm': size_mib = strtoul(value, NULL, 10); break;
+        case 'c': cluster_bytes = strtoul(value, NULL, 10); break;
+        case 'd': depth = strtoul(value, NULL, 10); break;
+        case 'n': files = strtoul(value, NULL, 10); break;
+        case 's': file_bytes = strtoul(value, NULL, 10); break;
+        case 'f': frag = strtoul(value, NULL, 10); break;
+        case 'r': seed = strtoul(value, NULL, 10); break;
+        default: usage(); return 1;
+        }
+    }
+
+    if (cluster_bytes < SECTOR_SIZE || cluster_bytes > 64 * 1024 || (cluster_bytes & (cluster_bytes - 1)) != 0)
+    {
+        printf("Error: Cluster size must be a power of two between 512 and 65536 bytes\n");
+        return 1;
+    }
+    if (depth > MAX_DEPTH || frag > 100 || files > 10000000)
+    {
+        printf("Error: Depth is limited to %d, fragmentation to 100 and files to 10000000\n", MAX_DEPTH);
+        return 1;
+    }
+
+    // Volume layout: boot sector, two FATs, fixed root directory, data
+    unsigned int sectors_per_cluster = cluster_bytes / SECTOR_SIZE;
+    unsigned long total_sectors = (unsigned long)size_mib * 1024 * 1024 / SECTOR_SIZE - PARTITION_START;
+    unsigned int root_sectors = ROOT_ENTRIES * 32 / SECTOR_SIZE;
+    unsigned int fat_sectors = 1;
+    unsigned long clusters;
+    while (true)
+    {
+        unsigned long data_sectors = total_sectors - 1 - 2 * fat_sectors - root_sectors;
+        clusters = data_sectors / sectors_per_cluster;
+        if ((clusters + 2) * 2 <= (unsigned long)fat_sectors * SECTOR_SIZE)
+            break;
+        fat_sectors++;
+    }
+    if (clusters < 4085 || clusters > 65524)
+    {
+        printf("Error: %lu clusters is not a FAT16 volume, change the size or cluster size\n", clusters);
+        return 1;
+    }
+
+    cluster_count = clusters + 2;
+    cluster_size = cluster_bytes;
+    unsigned long part_offset = (unsigned long)PARTITION_START * SECTOR_SIZE;
+    unsigned long fat_offset = part_offset + SECTOR_SIZE;
+    unsigned long root_offset = fat_offset + 2UL * fat_sectors * SECTOR_SIZE;
+    data_offset = root_offset + (unsigned long)root_sectors * SECTOR_SIZE;
+
+    fat = calloc(cluster_count, sizeof(unsigned short));
+    unsigned int *dir_of = malloc(sizeof(unsigned int) * (files ? files : 1));
+    unsigned int *size_of = malloc(sizeof(unsigned int) * (files ? files : 1));
+    unsigned int *fillers_of = malloc(sizeof(unsigned int) * (files ? files : 1));
+    unsigned char *fill = malloc(cluster_size);
+    if (fat == NULL || dir_of == NULL || size_of == NULL || fillers_of == NULL || fill == NULL)
+    {
+        printf("Error: Could not allocate memory\n");
+        return 1;
+    }
+    fat[0] = 0xFFF8;
+    fat[1] = 0xFFFF;
+
+    // Plan the files first so every directory can be sized before allocation
+    Dir dirs[MAX_DEPTH + 1];
+    memset(dirs, 0, sizeof(dirs));
+    unsigned int wanted[MAX_DEPTH + 1] = {0};
+    for (unsigned int d = 0; d <= depth; d++)
+        wanted[d] = d == 0 ? 1 : 2;   // volume label, or "." and ".."
+    for (unsigned int d = 0; d < depth; d++)
+        wanted[d]++;                  // the next directory of the chain
+
+    unsigned long planned_clusters = 0;
+    for (unsigned int f = 0; f < files; f++)
+    {
+        dir_of[f] = f % (depth + 1);
+        if (dir_of[f] == 0 && depth > 0 && wanted[0] + 2 > ROOT_ENTRIES)
+            dir_of[f] = f % depth + 1;  // the fixed root is full
+        size_of[f] = file_bytes ? file_bytes / 2 + (unsigned int)((unsigned long long)next_random() * (file_bytes + 1) / 0x8000) : 0;
+        unsigned int needed = (size_of[f] + cluster_size - 1) / cluster_size;
+        fillers_of[f] = 0;
+        for (unsigned int c = 1; c < needed; c++)
+        {
+            if (next_random() % 100 < frag)
+                fillers_of[f]++;
+        }
+        wanted[dir_of[f]] += fillers_of[f] ? 2 : 1;
+        planned_clusters += needed + fillers_of[f];
+    }
+
+    unsigned int dir_clusters[MAX_DEPTH + 1] = {0};
+    for (unsigned int d = 0; d <= depth; d++)
+    {
+        if (d == 0)
+        {
+            dirs[d].capacity = ROOT_ENTRIES;
+        }
+        else
+        {
+            dir_clusters[d] = (wanted[d] * 32 + cluster_size - 1) / cluster_size;
+            dirs[d].capacity = dir_clusters[d] * cluster_size / 32;
+            planned_clusters += dir_clusters[d];
+        }
+        if (wanted[d] > dirs[d].capacity)
+        {
+            printf("Error: Root directory holds %d entries, use more depth or fewer files\n", ROOT_ENTRIES);
+            return 1;
+        }
+        dirs[d].slots = calloc(dirs[d].capacity, sizeof(Fat16Entry));
+        if (dirs[d].slots == NULL)
+        {
+            printf("Error: Could not allocate memory\n");
+            return 1;
+        }
+    }
+    if (planned_clusters > clusters)
+    {
+        printf("Error: Files need %lu clusters but the volume has %lu\n", planned_clusters, clusters);
+        return 1;
+    }
+
+    FILE *out = fopen(path, "wb+");
+    if (out == NULL)
+    {
+        printf("Error: Could not create %s\n", path);
+        return 1;
+    }
+
+    // Directories are allocated up front, so only file data is fragmented
+    make_entry(add_entry(&dirs[0]), "BENCHVOL", "   ", 0x08, 0, 0);
+    for (unsigned int d = 1; d <= depth; d++)
+    {
+        dirs[d].cluster = next_cluster;
+        for (unsigned int c = 0; c < dir_clusters[d]; c++)
+        {
+            unsigned int cluster = alloc_cluster();
+            fat[cluster] = c + 1 < dir_clusters[d] ? cluster + 1 : 0xFFFF;
+        }
+        char name[12];
+        snprintf(name, sizeof(name), "DIR%u", d);
+        make_entry(add_entry(&dirs[d - 1]), name, "", 0x10, dirs[d].cluster, 0);
+        make_entry(add_entry(&dirs[d]), ".", "", 0x10, dirs[d].cluster, 0);
+        make_entry(add_entry(&dirs[d]), "..", "", 0x10, dirs[d - 1].cluster, 0);
+    }
+
+    unsigned int fragmented = 0;
+    for (unsigned int f = 0; f < files; f++)
+    {
+        Dir *dir = &dirs[dir_of[f]];
+        unsigned int needed = (size_of[f] + cluster_size - 1) / cluster_size;
+        unsigned int first = 0, previous = 0, filler_first = 0, filler_previous = 0;
+
+        for (unsigned int c = 0; c < needed; c++)
+        {
+            unsigned int cluster = alloc_cluster();
+            if (previous)
+                fat[previous] = cluster;
+            else
+                first = cluster;
+            previous = cluster;
+
+            // Stamp every cluster with its file and position
+            for (unsigned int b = 0; b < cluster_size; b++)
+                fill[b] = (unsigned char)(f * 31 + c * 7 + b);
+            unsigned int bytes = size_of[f] - c * cluster_size;
+            write_at(out, data_offset + (unsigned long)(cluster - 2) * cluster_size,
+                     fill, bytes < cluster_size ? bytes : cluster_size);
+
+            // Spread the filler clusters evenly over the gaps between this file's clusters
+            if (c + 1 < needed && (c + 1) * fillers_of[f] / (needed - 1) != c * fillers_of[f] / (needed - 1))
+            {
+                unsigned int filler = alloc_cluster();
+                if (filler_previous)
+                    fat[filler_previous] = filler;
+                else
+                    filler_first = filler;
+                filler_previous = filler;
+            }
+        }
+        if (previous)
+            fat[previous] = 0xFFFF;
+        if (filler_previous)
+            fat[filler_previous] = 0xFFFF;
+
+        char name[12];
+        snprintf(name, sizeof(name), "F%07u", f);
+        make_entry(add_entry(dir), name, "DAT", 0x20, first, size_of[f]);
+        if (filler_first)
+        {
+            snprintf(name, sizeof(name), "T%07u", f);
+            make_entry(add_entry(dir), name, "TMP", 0x20, filler_first, fillers_of[f] * cluster_size);
+            fragmented++;
+        }
+    }
+
+    // Delete the temporary files: free their chains and mark the entries
+    unsigned long freed = 0;
+    for (unsigned int d = 0; d <= depth; d++)
+    {
+        for (unsigned int e = 0; e < dirs[d].entries; e++)
+        {
+            Fat16Entry *entry = &dirs[d].slots[e];
+            if (entry->filename[0] != 'T' || memcmp(entry->ext, "TMP", 3) != 0)
+                continue;
+            unsigned int cluster = entry->starting_cluster;
+            while (cluster >= 2 && cluster < 0xFFF8)
+            {
+                unsigned int next = fat[cluster];
+                fat[cluster] = 0;
+                freed++;
+                cluster = next;
+            }
+            entry->filename[0] = 0xE5;
+        }
+    }
+
+    // Directory contents
+    write_at(out, root_offset, dirs[0].slots, (unsigned long)dirs[0].capacity * 32);
+    for (unsigned int d = 1; d <= depth; d++)
+        write_at(out, data_offset + (unsigned long)(dirs[d].cluster - 2) * cluster_size,
+                 dirs[d].slots, (unsigned long)dirs[d].capacity * 32);
+
+    // Both FAT copies
+    for (int copy = 0; copy < 2; copy++)
+        write_at(out, fat_offset + (unsigned long)copy * fat_sectors * SECTOR_SIZE, fat, cluster_count * 2);
+
+    // Boot sector
+    Fat16BootSector bs;
+    memset(&bs, 0, sizeof(bs));
+    memcpy(bs.jmp, "\xEB\x3C\x90", 3);
+    memcpy(bs.oem, "MKIMAGE ", 8);
+    bs.sector_size = SECTOR_SIZE;
+    bs.sectors_per_cluster = sectors_per_cluster;
+    bs.reserved_sectors = 1;
+    bs.number_of_fats = 2;
+    bs.root_dir_entries = ROOT_ENTRIES;
+    if (total_sectors < 65536)
+        bs.total_sectors_short = total_sectors;
+    else
+        bs.total_sectors_int = total_sectors;
+    bs.media_descriptor = 0xF8;
+    bs.fat_size_sectors = fat_sectors;
+    bs.sectors_per_track = 63;
+    bs.number_of_heads = 255;
+    bs.hidden_sectors = PARTITION_START;
+    bs.drive_number = 0x80;
+    bs.boot_signature = 0x29;
+    bs.volume_id = seed;
+    memcpy(bs.volume_label, "BENCHVOL   ", 11);
+    memcpy(bs.fs_type, "FAT16   ", 8);
+    bs.boot_sector_signature = 0xAA55;
+    write_at(out, part_offset, &bs, sizeof(bs));
+
+    // Partition table, and make the file span the whole disk
+    unsigned char mbr[SECTOR_SIZE];
+    memset(mbr, 0, sizeof(mbr));
+    PartitionTable pt;
+    memset(&pt, 0, sizeof(pt));
+    pt.partition_type = total_sectors < 65536 ? 0x04 : 0x06;
+    pt.start_sector = PARTITION_START;
+    pt.length_sectors = total_sectors;
+    memcpy(mbr + 0x1BE, &pt, sizeof(pt));
+    mbr[510] = 0x55;
+    mbr[511] = 0xAA;
+    write_at(out, 0, mbr, sizeof(mbr));
+    unsigned char last = 0;
+    write_at(out, (unsigned long)size_mib * 1024 * 1024 - 1, &last, 1);
+
+    if (fclose(out) != 0)
+    {
+        printf("Error: Could not write image\n");
+        return 1;
+    }
+
+    printf("{\"image\":\"%s\",\"size_mib\":%u,\"cluster_bytes\":%u,\"clusters\":%lu,\"depth\":%u,"
+           "\"files\":%u,\"file_bytes\":%u,\"frag_percent\":%u,\"fragmented_files\":%u,"
+           "\"used_clusters\":%lu,\"free_holes\":%lu}\n",
+           path, size_mib, cluster_bytes, clusters, depth, files, file_bytes, frag, fragmented,
+           next_cluster - 2 - freed, freed);
+
+    for (unsigned int d = 0; d <= depth; d++)
+        free(dirs[d].slots);
+    free(fill);
+    free(fillers_of);
+    free(size_of);
+    free(dir_of);
+    free(fat);
+    return 0;
+}
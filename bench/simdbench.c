@@ -0,0 +1,247 @@
+// Microbenchmark of the SIMD kernels in simd.c
+//
+// usage: simdbench [-c clusters] [-e dir_entries] [-f free_percent] [-n repeats]
+//
+// Runs the FAT zero scan (16 and 32-bit tables) and the 8.3 name scan at
+// every level the CPU supports, on the same synthetic data, and checks that
+// all levels agree with the scalar one. The name sits in the last entry so
+// the whole directory is scanned, past deleted entries and a volume label.
+// The FAT compare runs on the 32-bit table and a copy of it with one byte
+// changed near the end.
+// Results are JSON lines on stdout, one per kernel and level.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../simd.h"
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+unsigned int clusters = 1 << 20;
+unsigned int dir_entries = 4096;
+int free_percent = 30;
+int repeats = 50;
+
+double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void report(const char *kernel, SimdLevel level, double best_ns, unsigned long items, unsigned long bytes,
+            long result, long expected)
+{
+    printf("{\"kernel\":\"%s\",\"level\":\"%s\",\"items\":%lu,\"ns\":%.0f,\"ns_per_item\":%.3f,"
+           "\"gb_per_s\":%.2f,\"result\":%ld,\"ok\":%s}\n",
+           kernel, simd_level_name(level), items, best_ns, best_ns / items, bytes / best_ns, result,
+           result == expected ? "true" : "false");
+}
+
+// Fastest of the repeats, each scan starts from a cleared bitmap
+int bench_zero(const char *kernel, const void *table, unsigned long entry_bytes, unsigned long *bits,
+               unsigned long *expected_bits, long *expected)
+{
+    unsigned long words = (clusters + WORD_BITS - 1) / WORD_BITS;
+    int failed = 0;
+
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX2; level++)
+    {
+        simd_set_level(level);
+        if ((int)simd_level() != level)
+            break;
+
+        double best = 0;
+        long found = 0;
+        for (int r = 0; r < repeats; r++)
+        {
+            memset(bits, 0, words * sizeof(unsigned long));
+            double start = now_ns();
+            if (entry_bytes == 2)
+                found = simd_zero_bits16(table, clusters, bits);
+            else
+                found = simd_zero_bits32(table, clusters, bits);
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        if (level == SIMD_SCALAR)
+        {
+            memcpy(expected_bits, bits, words * sizeof(unsigned long));
+            *expected = found;
+        }
+        else if (memcmp(expected_bits, bits, words * sizeof(unsigned long)) != 0)
+        {
+            found = -1;
+        }
+        report(kernel, level, best, clusters, clusters * entry_bytes, found, *expected);
+        failed |= found != *expected;
+    }
+    return failed;
+}
+
+int bench_name(const Fat16Entry *entries, const unsigned char name[11])
+{
+    long expected = 0;
+    int failed = 0;
+
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX2; level++)
+    {
+        simd_set_level(level);
+        if ((int)simd_level() != level)
+            break;
+
+        double best = 0;
+        long found = 0;
+        bool end;
+        for (int r = 0; r < repeats; r++)
+        {
+            double start = now_ns();
+            found = simd_find_name(entries, dir_entries, name, &end);
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        if (level == SIMD_SCALAR)
+            expected = found;
+        report("find_name", level, best, dir_entries, (unsigned long)dir_entries * sizeof(Fat16Entry), found,
+               expected);
+        failed |= found != expected;
+    }
+    return failed;
+}
+
+// Two copies of the FAT that only differ near the end, as the FAT mirror
+// check sees them
+int bench_mismatch(const unsigned char *a, const unsigned char *b, unsigned long length)
+{
+    long expected = 0;
+    int failed = 0;
+
+    for (int level = SIMD_SCALAR; level <= SIMD_AVX2; level++)
+    {
+        simd_set_level(level);
+        if ((int)simd_level() != level)
+            break;
+
+        double best = 0;
+        long found = 0;
+        for (int r = 0; r < repeats; r++)
+        {
+            double start = now_ns();
+            found = simd_mismatch(a, b, length);
+            double elapsed = now_ns() - start;
+            if (r == 0 || elapsed < best)
+                best = elapsed;
+        }
+
+        if (level == SIMD_SCALAR)
+            expected = found;
+        report("mismatch", level, best, length, length * 2, found, expected);
+        failed |= found != expected;
+    }
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "usage: %s [-c clusters] [-e dir_entries] [-f free_percent] [-n repeats]\n", argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-c") == 0)
+            clusters = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-e") == 0)
+            dir_entries = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-f") == 0)
+            free_percent = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-n") == 0)
+            repeats = atoi(argv[++i]);
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (clusters < 2 || dir_entries < 2 || repeats < 1)
+    {
+        fprintf(stderr, "Need at least 2 clusters, 2 entries and 1 repeat\n");
+        return 1;
+    }
+
+    // FAT16 entries are clipped to 16 bits; FAT32 entries get random reserved
+    // top bits, which the kernel has to ignore
+    unsigned short *fat16 = malloc(clusters * sizeof(unsigned short));
+    unsigned int *fat32 = malloc(clusters * sizeof(unsigned int));
+    unsigned long words = (clusters + WORD_BITS - 1) / WORD_BITS;
+    unsigned long *bits = malloc(words * sizeof(unsigned long));
+    unsigned long *expected_bits = malloc(words * sizeof(unsigned long));
+    if (fat16 == NULL || fat32 == NULL || bits == NULL || expected_bits == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    srand(1);
+    for (unsigned int i = 0; i < clusters; i++)
+    {
+        unsigned int next = rand() % 100 < free_percent ? 0 : i + 1;
+        fat16[i] = next ? next % 0xFFF0 + 2 : 0;
+        fat32[i] = (unsigned int)(rand() & 0xF) << 28 | next;
+    }
+
+    // Directory of regular files, every eighth deleted, a volume label up
+    // front carrying the name being looked for
+    unsigned char name[11];
+    memcpy(name, "TARGET  DAT", 11);
+    Fat16Entry *entries = calloc(dir_entries, sizeof(Fat16Entry));
+    if (entries == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    for (unsigned int i = 0; i < dir_entries; i++)
+    {
+        char base[12];
+        snprintf(base, sizeof(base), "F%07uDAT", i % 10000000);
+        memcpy(entries[i].filename, base, 8);
+        memcpy(entries[i].ext, base + 8, 3);
+        entries[i].attributes = 0x20;
+        if (i % 8 == 7)
+            entries[i].filename[0] = 0xE5;
+    }
+    memcpy(entries[0].filename, name, 11);
+    entries[0].attributes = 0x08;
+    memcpy(entries[dir_entries - 1].filename, name, 11);
+
+    int failed = 0;
+    long expected;
+    failed |= bench_zero("zero_bits16", fat16, 2, bits, expected_bits, &expected);
+    failed |= bench_zero("zero_bits32", fat32, 4, bits, expected_bits, &expected);
+    failed |= bench_name(entries, name);
+
+    unsigned long fat_bytes = clusters * sizeof(unsigned int);
+    unsigned char *mirror = malloc(fat_bytes);
+    if (mirror == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memcpy(mirror, fat32, fat_bytes);
+    mirror[fat_bytes - 3] ^= 1;
+    failed |= bench_mismatch((const unsigned char *)fat32, mirror, fat_bytes);
+    free(mirror);
+
+    free(fat16);
+    free(fat32);
+    free(bits);
+    free(expected_bits);
+    free(entries);
+    return failed;
+}
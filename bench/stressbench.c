@@ -0,0 +1,309 @@
+// Multi-threaded stress benchmark of one mounted volume, through libfat
+//
+// usage: stressbench [-t max_threads] [-m phase_ms] [-n files] [-s write_bytes] image
+//
+// Mounts the image once and runs timed phases against that single handle.
+// Each phase has 1, 2, 4... up to max_threads reader threads, every one of
+// them opening, reading and closing its own share of the files over and over.
+// Every read is checked against a checksum taken single-threaded up front.
+// Each thread count runs twice: readers alone, then readers next to a writer
+// thread that keeps writing a file to the root, reading it back and
+// deleting it again. At the end every file is closed, so the free cluster
+// count has to be back where it started.
+//
+// Results are JSON lines on stdout, one per phase. Read throughput with
+// more threads only scales as far as the machine has CPUs (and the image
+// page cache can serve them); "ok" is false if any read or write went wrong.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../libfat.h"
+
+#define MAX_THREADS 64
+#define READ_BUFFER (64 * 1024)
+
+typedef struct {
+    char path[64];
+    unsigned int size;
+    unsigned long checksum;
+} StressFile;
+
+typedef struct {
+    int id;
+    int threads;
+    unsigned long bytes;
+    unsigned long files;
+    unsigned long errors;
+} Reader;
+
+typedef struct {
+    unsigned long writes;
+    unsigned long bytes;
+    unsigned long errors;
+} Writer;
+
+int max_threads = 8;
+int phase_ms = 500;
+int max_files = 256;
+unsigned long write_bytes = 256 * 1024;
+
+FatVolume *vol;
+StressFile *files;
+int file_count;
+bool stop;
+
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// FNV-1a, folded over consecutive buffers
+unsigned long checksum(unsigned long hash, const unsigned char *data, unsigned long length)
+{
+    for (unsigned long i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 1099511628211UL;
+    return hash;
+}
+
+// Checksum of a whole file read through a fresh handle, 0 on error
+unsigned long read_file(const char *path, unsigned char *buffer, unsigned long *bytes)
+{
+    FatFile *file;
+    if (fat_open(vol, 0, path, &file) != FAT_OK)
+        return 0;
+
+    FatDirent info;
+    fat_file_info(file, &info);
+    unsigned long hash = 14695981039346656037UL, offset = 0;
+    while (offset < info.size)
+    {
+        long n = fat_read(file, buffer, READ_BUFFER, offset);
+        if (n <= 0)
+            break;
+        hash = checksum(hash, buffer, n);
+        offset += n;
+    }
+    fat_close(file);
+    *bytes = offset;
+    return offset == info.size ? hash : 0;
+}
+
+void collect(const WalkNode *node, const char *prefix)
+{
+    for (int i = 0; i < node->child_count && file_count < max_files; i++)
+    {
+        const WalkNode *child = &node->children[i];
+        char name[13], path[64];
+        fat_format_name(child->name, name);
+        if (name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s%s", prefix, name);
+        if (child->is_dir)
+        {
+            strcat(path, "/");
+            collect(child, path);
+        }
+        else if (child->file_size > 0)
+        {
+            strcpy(files[file_count].path, path);
+            files[file_count].size = child->file_size;
+            file_count++;
+        }
+    }
+}
+
+void *reader_main(void *arg)
+{
+    Reader *r = arg;
+    unsigned char *buffer = malloc(READ_BUFFER);
+    int i = r->id;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED) && buffer != NULL)
+    {
+        unsigned long bytes;
+        if (read_file(files[i].path, buffer, &bytes) != files[i].checksum)
+            r->errors++;
+        r->bytes += bytes;
+        r->files++;
+        i = (i + r->threads) % file_count;
+    }
+    free(buffer);
+    return NULL;
+}
+
+void *writer_main(void *arg)
+{
+    Writer *w = arg;
+    unsigned char *data = malloc(write_bytes), *buffer = malloc(READ_BUFFER);
+    FILE *source = tmpfile();
+    if (data == NULL || buffer == NULL || source == NULL)
+    {
+        w->errors++;
+        __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    }
+
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        // Different content and size every round
+        unsigned long size = write_bytes / 2 + (w->writes * 7919) % (write_bytes / 2 + 1);
+        for (unsigned long b = 0; b < size; b++)
+            data[b] = (unsigned char)(b * 13 + w->writes);
+        rewind(source);
+        if (ftruncate(fileno(source), 0) != 0 || fwrite(data, 1, size, source) != size || fflush(source) != 0)
+        {
+            w->errors++;
+            break;
+        }
+
+        char name[13];
+        FatWriteReport report;
+        unsigned long bytes;
+        snprintf(name, sizeof(name), "STRESS%02lu.TMP", w->writes % 100);
+        if (fat_write(vol, 0, name, source, &report) != FAT_OK ||
+            read_file(name, buffer, &bytes) != checksum(14695981039346656037UL, data, size) ||
+            fat_unlink(vol, 0, name) != FAT_OK)
+            w->errors++;
+        w->writes++;
+        w->bytes += size;
+    }
+    if (source != NULL)
+        fclose(source);
+    free(data);
+    free(buffer);
+    return NULL;
+}
+
+// One timed phase, returns read MB/s
+double run_phase(int threads, bool with_writer, double baseline, bool *ok)
+{
+    pthread_t tids[MAX_THREADS], writer_tid;
+    Reader readers[MAX_THREADS];
+    Writer writer = {0, 0, 0};
+
+    stop = false;
+    double start = now_ms();
+    for (int t = 0; t < threads; t++)
+    {
+        readers[t] = (Reader){t % file_count, threads, 0, 0, 0};
+        pthread_create(&tids[t], NULL, reader_main, &readers[t]);
+    }
+    if (with_writer)
+        pthread_create(&writer_tid, NULL, writer_main, &writer);
+
+    usleep(phase_ms * 1000);
+    __atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+    unsigned long bytes = 0, reads = 0, errors = 0;
+    for (int t = 0; t < threads; t++)
+    {
+        pthread_join(tids[t], NULL);
+        bytes += readers[t].bytes;
+        reads += readers[t].files;
+        errors += readers[t].errors;
+    }
+    if (with_writer)
+        pthread_join(writer_tid, NULL);
+    double elapsed = now_ms() - start;
+
+    double mb_per_s = bytes / 1e6 / (elapsed / 1e3);
+    printf("{\"phase\":\"%s\",\"threads\":%d,\"ms\":%.0f,\"reads\":%lu,\"read_mb_per_s\":%.1f,"
+           "\"speedup\":%.2f,\"writes\":%lu,\"write_mb_per_s\":%.1f,\"errors\":%lu,\"ok\":%s}\n",
+           with_writer ? "read+write" : "read", threads, elapsed, reads, mb_per_s,
+           baseline > 0 ? mb_per_s / baseline : 1.0, writer.writes, writer.bytes / 1e6 / (elapsed / 1e3),
+           errors + writer.errors, errors + writer.errors == 0 ? "true" : "false");
+    fflush(stdout);
+    *ok &= errors + writer.errors == 0;
+    return mb_per_s;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: stressbench [-t max_threads] [-m phase_ms] [-n files] [-s write_bytes] image\n");
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "t:m:n:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't': max_threads = atoi(optarg); break;
+        case 'm': phase_ms = atoi(optarg); break;
+        case 'n': max_files = atoi(optarg); break;
+        case 's': write_bytes = strtoul(optarg, NULL, 10); break;
+        default: usage(); return 1;
+        }
+    }
+    if (optind != argc - 1 || max_threads < 1 || max_threads > MAX_THREADS || max_files < 1 || write_bytes == 0)
+    {
+        usage();
+        return 1;
+    }
+
+    int status = fat_mount(argv[optind], FAT_MOUNT_READ_WRITE, &vol);
+    if (status != FAT_OK)
+    {
+        fprintf(stderr, "stressbench: %s: %s\n", argv[optind], fat_strerror(status));
+        return 1;
+    }
+
+    // Reference checksums, read with nothing else running
+    files = calloc(max_files, sizeof(StressFile));
+    WalkNode *root = fat_walk(vol, 0);
+    unsigned char *buffer = malloc(READ_BUFFER);
+    if (files == NULL || root == NULL || buffer == NULL)
+    {
+        fprintf(stderr, "stressbench: out of memory\n");
+        return 1;
+    }
+    collect(root, "");
+    fat_walk_free(root);
+    unsigned long total = 0;
+    for (int i = 0; i < file_count; i++)
+    {
+        unsigned long bytes;
+        files[i].checksum = read_file(files[i].path, buffer, &bytes);
+        total += bytes;
+    }
+    free(buffer);
+    if (file_count == 0)
+    {
+        fprintf(stderr, "stressbench: no files to read on %s\n", argv[optind]);
+        return 1;
+    }
+
+    FatVolumeInfo info;
+    fat_volume_info(vol, &info);
+    long free_before = fat_free_clusters(vol);
+    printf("{\"bench\":\"stress\",\"image\":\"%s\",\"files\":%d,\"bytes\":%lu,\"max_threads\":%d,\"phase_ms\":%d,"
+           "\"write_bytes\":%lu,\"cpus\":%ld,\"mapped\":%s}\n",
+           argv[optind], file_count, total, max_threads, phase_ms, write_bytes, sysconf(_SC_NPROCESSORS_ONLN),
+           info.mapped ? "true" : "false");
+
+    bool ok = true;
+    double baseline = 0;
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double mb_per_s = run_phase(threads, false, baseline, &ok);
+        if (threads == 1)
+            baseline = mb_per_s;
+        run_phase(threads, true, baseline, &ok);
+    }
+
+    // Everything is closed, clusters freed under open files are back
+    long free_after = fat_free_clusters(vol);
+    printf("{\"check\":\"free_clusters\",\"before\":%ld,\"after\":%ld,\"ok\":%s}\n", free_before, free_after,
+           free_before == free_after ? "true" : "false");
+    ok &= free_before == free_after;
+
+    if (fat_unmount(vol) != FAT_OK)
+        ok = false;
+    free(files);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,329 @@
+#include "cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned int bucket_of(unsigned long offset)
+{
+    return (offset ^ (offset >> 12) ^ (offset >> 24)) % CACHE_BUCKETS;
+}
+
+void cache_init(Cache *cache, Image *img, CacheGeometry geometry, void *geometry_ctx, unsigned long budget)
+{
+    memset(cache, 0, sizeof(Cache));
+    cache->img = img;
+    cache->geometry = geometry;
+    cache->geometry_ctx = geometry_ctx;
+    cache->budget = budget;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+static CacheBlock *lookup(Cache *cache, unsigned long block_start)
+{
+    for (CacheBlock *b = cache->buckets[bucket_of(block_start)]; b != NULL; b = b->hash_next)
+    {
+        if (b->offset == block_start)
+            return b;
+    }
+    return NULL;
+}
+
+static void lru_unlink(Cache *cache, CacheBlock *b)
+{
+    if (b->newer) b->newer->older = b->older;
+    else cache->newest = b->older;
+    if (b->older) b->older->newer = b->newer;
+    else cache->oldest = b->newer;
+    b->newer = b->older = NULL;
+}
+
+static void lru_push(Cache *cache, CacheBlock *b)
+{
+    b->older = cache->newest;
+    b->newer = NULL;
+    if (cache->newest) cache->newest->newer = b;
+    cache->newest = b;
+    if (cache->oldest == NULL) cache->oldest = b;
+}
+
+static int write_back(Cache *cache, CacheBlock *b)
+{
+    if (!b->dirty)
+        return 0;
+    if (image_write(cache->img, b->offset, b->data, b->length) != b->length)
+        return -1;
+    b->dirty = false;
+    cache->writebacks++;
+    return 0;
+}
+
+static void drop(Cache *cache, CacheBlock *b)
+{
+    CacheBlock **link = &cache->buckets[bucket_of(b->offset)];
+    while (*link != b)
+        link = &(*link)->hash_next;
+    *link = b->hash_next;
+
+    lru_unlink(cache, b);
+    cache->used -= b->length;
+    cache->blocks--;
+    free(b->data);
+    free(b);
+}
+
+// Evict least recently used blocks until extra more bytes fit the budget.
+// Pinned blocks stay, so the budget can be exceeded while they are held.
+// So do dirty blocks that fail to write back: they keep their data and the
+// next cache_flush() reports the failure.
+static void make_room(Cache *cache, unsigned long extra)
+{
+    CacheBlock *b = cache->oldest;
+    while (b != NULL && cache->used + extra > cache->budget)
+    {
+        CacheBlock *newer = b->newer;
+        if (b->pins == 0 && write_back(cache, b) == 0)
+        {
+            drop(cache, b);
+            cache->evictions++;
+        }
+        b = newer;
+    }
+}
+
+// Cached block starting at block_start, loaded from the image on a miss
+static CacheBlock *get_block(Cache *cache, unsigned long block_start, unsigned int block_length)
+{
+    CacheBlock *b = lookup(cache, block_start);
+    if (b != NULL)
+    {
+        cache->hits++;
+        lru_unlink(cache, b);
+        lru_push(cache, b);
+        return b;
+    }
+
+    cache->misses++;
+    make_room(cache, block_length);
+
+    b = calloc(1, sizeof(CacheBlock));
+    if (b == NULL)
+        return NULL;
+    b->data = malloc(block_length);
+    if (b->data == NULL)
+    {
+        free(b);
+        return NULL;
+    }
+    b->offset = block_start;
+    b->length = block_length;
+
+    if (image_read(cache->img, block_start, b->data, block_length) != block_length)
+    {
+        free(b->data);
+        free(b);
+        return NULL;
+    }
+
+    b->hash_next = cache->buckets[bucket_of(block_start)];
+    cache->buckets[bucket_of(block_start)] = b;
+    lru_push(cache, b);
+    cache->used += block_length;
+    cache->blocks++;
+    return b;
+}
+
+void cache_destroy(Cache *cache)
+{
+    cache_flush(cache);
+    while (cache->oldest != NULL)
+        drop(cache, cache->oldest);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void cache_set_budget(Cache *cache, unsigned long budget)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->budget = budget;
+    make_room(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int cache_flush(Cache *cache)
+{
+    int status = 0;
+    pthread_mutex_lock(&cache->lock);
+    for (CacheBlock *b = cache->oldest; b != NULL; b = b->newer)
+    {
+        if (write_back(cache, b) != 0)
+            status = -1;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+const void *cache_get(Cache *cache, unsigned long offset, size_t len)
+{
+    unsigned long block_start;
+    unsigned int block_length;
+    cache->geometry(cache->geometry_ctx, offset, &block_start, &block_length);
+    if (offset + len > block_start + block_length)
+        return NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    CacheBlock *b = get_block(cache, block_start, block_length);
+    if (b != NULL)
+        b->pins++;
+    pthread_mutex_unlock(&cache->lock);
+    return b != NULL ? b->data + (offset - block_start) : NULL;
+}
+
+void cache_put(Cache *cache, unsigned long offset)
+{
+    unsigned long block_start;
+    unsigned int block_length;
+    cache->geometry(cache->geometry_ctx, offset, &block_start, &block_length);
+
+    pthread_mutex_lock(&cache->lock);
+    CacheBlock *b = lookup(cache, block_start);
+    if (b != NULL && b->pins > 0)
+        b->pins--;
+
+    // Blocks pinned while the cache was full may have pushed it over budget
+    if (cache->used > cache->budget)
+        make_room(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+size_t cache_read(Cache *cache, unsigned long offset, void *buf, size_t len)
+{
+    size_t done = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (done < len)
+    {
+        unsigned long block_start;
+        unsigned int block_length;
+        cache->geometry(cache->geometry_ctx, offset + done, &block_start, &block_length);
+
+        size_t skip = offset + done - block_start;
+        size_t n = block_length - skip;
+        if (n > len - done)
+            n = len - done;
+
+        CacheBlock *b = lookup(cache, block_start);
+        if (b == NULL && n == block_length)
+        {
+            // Whole block that isn't cached, don't pull it in
+            if (image_read(cache->img, offset + done, (unsigned char *)buf + done, n) != n)
+                break;
+        }
+        else
+        {
+            b = get_block(cache, block_start, block_length);
+            if (b == NULL)
+                break;
+            memcpy((unsigned char *)buf + done, b->data + skip, n);
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return done;
+}
+
+size_t cache_write(Cache *cache, unsigned long offset, const void *buf, size_t len)
+{
+    if (cache->img->mode != IMAGE_READ_WRITE)
+        return 0;
+
+    size_t done = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (done < len)
+    {
+        unsigned long block_start;
+        unsigned int block_length;
+        cache->geometry(cache->geometry_ctx, offset + done, &block_start, &block_length);
+
+        size_t skip = offset + done - block_start;
+        size_t n = block_length - skip;
+        if (n > len - done)
+            n = len - done;
+
+        CacheBlock *b = lookup(cache, block_start);
+        if (b == NULL && n == block_length)
+        {
+            // Whole block that isn't cached, write it through
+            if (image_write(cache->img, offset + done, (const unsigned char *)buf + done, n) != n)
+                break;
+        }
+        else
+        {
+            b = get_block(cache, block_start, block_length);
+            if (b == NULL)
+                break;
+            memcpy(b->data + skip, (const unsigned char *)buf + done, n);
+            b->dirty = true;
+        }
+        done += n;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return done;
+}
+
+int cache_sync_range(Cache *cache, unsigned long offset, size_t len)
+{
+    unsigned long pos = offset;
+    int status = 0;
+    pthread_mutex_lock(&cache->lock);
+    while (pos < offset + len)
+    {
+        unsigned long block_start;
+        unsigned int block_length;
+        cache->geometry(cache->geometry_ctx, pos, &block_start, &block_length);
+
+        CacheBlock *b = lookup(cache, block_start);
+        if (b != NULL && write_back(cache, b) != 0)
+            status = -1;
+        pos = block_start + block_length;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return status;
+}
+
+const void *cache_acquire(Cache *cache, unsigned long offset, size_t len)
+{
+    if (cache_sync_range(cache, offset, len) != 0)
+        return NULL;
+    return image_acquire(cache->img, offset, len);
+}
+
+void cache_release(Cache *cache, const void *ptr)
+{
+    image_release(cache->img, ptr);
+}
+
+size_t cache_readv(Cache *cache, unsigned long offset, const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    if (cache_sync_range(cache, offset, len) != 0)
+        return 0;
+    return image_readv(cache->img, offset, iov, iovcnt);
+}
+
+void cache_invalidate_range(Cache *cache, unsigned long offset, size_t len)
+{
+    unsigned long pos = offset;
+    pthread_mutex_lock(&cache->lock);
+    while (pos < offset + len)
+    {
+        unsigned long block_start;
+        unsigned int block_length;
+        cache->geometry(cache->geometry_ctx, pos, &block_start, &block_length);
+
+        CacheBlock *b = lookup(cache, block_start);
+        if (b != NULL && b->pins == 0)
+            drop(cache, b);
+        pos = block_start + block_length;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,83 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "image.h"
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+// Block cache in front of an Image. Blocks are whatever unit the geometry
+// callback reports for an offset (sectors of the reserved and FAT area, the
+// fixed root directory, data clusters). Metadata is kept in the cache with
+// LRU eviction inside a byte budget and dirty blocks are written back on
+// eviction, cache_flush() and cache_destroy(). A block whose write-back
+// fails stays cached and dirty until a later one succeeds. Bulk transfers of whole
+// blocks go around the cache but stay coherent with it.
+//
+// Every call takes the cache's mutex, so threads can share one cache. A
+// pointer from cache_get() stays valid while pinned, but its bytes are only
+// stable while the caller keeps other writers of that block away.
+
+typedef void (*CacheGeometry)(void *ctx, unsigned long offset, unsigned long *block_start,
+                              unsigned int *block_length);
+
+typedef struct CacheBlock {
+    unsigned long offset;
+    unsigned int length;
+    unsigned char *data;
+    bool dirty;
+    int pins;
+    struct CacheBlock *newer, *older;   // LRU list
+    struct CacheBlock *hash_next;
+} CacheBlock;
+
+#define CACHE_BUCKETS 4096
+#define CACHE_DEFAULT_BUDGET (1024 * 1024)
+
+typedef struct {
+    pthread_mutex_t lock;
+    Image *img;
+    CacheGeometry geometry;
+    void *geometry_ctx;
+    unsigned long budget;
+    unsigned long used;
+    CacheBlock *buckets[CACHE_BUCKETS];
+    CacheBlock *newest, *oldest;
+
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+    unsigned long blocks;
+} Cache;
+
+void cache_init(Cache *cache, Image *img, CacheGeometry geometry, void *geometry_ctx, unsigned long budget);
+void cache_destroy(Cache *cache);
+void cache_set_budget(Cache *cache, unsigned long budget);
+
+// Write every dirty block back to the image, returns -1 if a write failed
+int cache_flush(Cache *cache);
+
+// Pin the block holding [offset, offset + len) and return a pointer to those
+// bytes. The range must not cross a block boundary. Unpin with cache_put().
+const void *cache_get(Cache *cache, unsigned long offset, size_t len);
+void cache_put(Cache *cache, unsigned long offset);
+
+// Byte-range access. Partial blocks are served from and written into the
+// cache; whole blocks that aren't cached go straight to the image.
+size_t cache_read(Cache *cache, unsigned long offset, void *buf, size_t len);
+size_t cache_write(Cache *cache, unsigned long offset, const void *buf, size_t len);
+
+// Streaming access for file data. Dirty cached blocks in the range are
+// written back first, then the image is read directly (zero-copy when mapped).
+const void *cache_acquire(Cache *cache, unsigned long offset, size_t len);
+void cache_release(Cache *cache, const void *ptr);
+size_t cache_readv(Cache *cache, unsigned long offset, const struct iovec *iov, int iovcnt);
+
+// For I/O issued on the image fd outside the cache: write back dirty blocks
+// before reading a range (-1 if one failed, the image is then stale), drop
+// cached blocks after overwriting one
+int cache_sync_range(Cache *cache, unsigned long offset, size_t len);
+void cache_invalidate_range(Cache *cache, unsigned long offset, size_t len);
+
+#endif
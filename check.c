@@ -0,0 +1,491 @@
+#include "volume.h"
+#include "simd.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+#define CHECK_CHUNK (1024 * 1024)   // bytes of a FAT copy compared at a time
+
+// A directory found by the check. Paths are only needed for problems, so
+// they are rebuilt from the parents then instead of kept for every entry.
+typedef struct {
+    unsigned int cluster;       // 0 for the root
+    unsigned int clusters;      // length of its chain that belongs to it alone
+    int parent;
+    unsigned char name[11];
+} CheckDir;
+
+// A file whose chain goes on past what its size needs. The rest of the
+// chain is only followed once the tree is walked, so clusters it runs into
+// go to their rightful owner and the tail is the one cut short.
+typedef struct {
+    Fat16Entry entry;
+    unsigned long offset;
+    int dir;
+} CheckTail;
+
+typedef enum {
+    CHAIN_END,                  // end-of-chain marker
+    CHAIN_MORE,                 // as long as asked for and not at its end
+    CHAIN_BROKEN,               // free, reserved, bad or out of range cluster
+    CHAIN_CROSSED               // ran into a cluster another chain holds
+} ChainEnd;
+
+typedef struct {
+    FatVolume *vol;
+    bool repair;
+    unsigned long *visited;     // one bit per cluster reached from the root
+    CheckDir *dirs;             // breadth first, also the queue of the walk
+    int dir_count, dir_capacity;
+    CheckTail *tails;
+    int tail_count, tail_capacity;
+    Extent freed;               // run of clusters repair freed, released in one go
+    FatCheckFn problem_fn;
+    void *ctx;
+    FatCheckReport *report;
+} Check;
+
+static inline bool check_visited(const Check *c, unsigned int cluster)
+{
+    return c->visited[cluster / WORD_BITS] >> (cluster % WORD_BITS) & 1;
+}
+
+static void check_problem(Check *c, FatProblem kind, int dir, const unsigned char *name, unsigned int cluster,
+                          unsigned long expected, unsigned long found)
+{
+    FatCheckReport *report = c->report;
+    report->problems++;
+    report->repaired += c->repair;
+    switch (kind) {
+    case FAT_PROBLEM_CROSS_LINKED: report->cross_linked++; break;
+    case FAT_PROBLEM_BROKEN_CHAIN: report->broken_chains++; break;
+    case FAT_PROBLEM_CHAIN_LONGER: report->chains_longer++; break;
+    case FAT_PROBLEM_CHAIN_SHORTER: report->chains_shorter++; break;
+    case FAT_PROBLEM_LOST_CLUSTERS: report->lost_clusters += found; break;
+    case FAT_PROBLEM_FAT_MISMATCH: report->mismatched_sectors += found; break;
+    }
+    if (c->problem_fn == NULL)
+        return;
+
+    // Names from the leaf up, written from the end of the buffer backwards
+    char path[512];
+    char *p = path + sizeof(path) - 1;
+    *p = '\0';
+    const unsigned char *part = name;
+    while (part != NULL && p > path + 14) {
+        char formatted[13];
+        fat_format_name(part, formatted);
+        size_t length = strlen(formatted);
+        p -= length;
+        memcpy(p, formatted, length);
+        *--p = '/';
+        part = dir > 0 ? c->dirs[dir].name : NULL;
+        dir = dir > 0 ? c->dirs[dir].parent : -1;
+    }
+
+    FatCheckProblem problem = {kind, name != NULL ? p : NULL, cluster, expected, found, c->repair};
+    c->problem_fn(c->ctx, &problem);
+}
+
+// Give a cluster repair took out of a chain back, merged with its neighbours
+static void check_release(Check *c, unsigned int cluster)
+{
+    if (c->freed.length > 0 && c->freed.start + c->freed.length == cluster) {
+        c->freed.length++;
+        return;
+    }
+    if (c->freed.length > 0)
+        release_clusters(c->vol, &c->freed, 1);
+    c->freed = (Extent){cluster, 1};
+}
+
+// Follow a chain for at most max clusters and mark them visited, up to the
+// end marker or the first cluster that can't be part of it. A cluster
+// another chain already holds, or this one passed before, stops it too, so
+// a loop ends as a cross link. Returns the clusters marked, *stop is the
+// value or cluster the walk stopped at.
+static unsigned int check_chain(Check *c, unsigned int start, unsigned int max, ChainEnd *end, unsigned int *stop)
+{
+    FatVolume *vol = c->vol;
+    const FatTable *fat = &vol->fat;
+    unsigned int count = 0, cluster = start;
+
+    for (;;) {
+        if (count == max) {
+            *end = CHAIN_MORE;
+            break;
+        }
+        if (cluster < 2 || cluster >= vol->cluster_count || fat->ops->get(fat, cluster) == 0) {
+            *end = CHAIN_BROKEN;
+            break;
+        }
+        if (check_visited(c, cluster)) {
+            *end = CHAIN_CROSSED;
+            break;
+        }
+        c->visited[cluster / WORD_BITS] |= 1UL << (cluster % WORD_BITS);
+        count++;
+
+        unsigned int next = fat->ops->get(fat, cluster);
+        if (next >= (fat->eoc & ~7u)) {
+            *end = CHAIN_END;
+            cluster = next;
+            break;
+        }
+        if (!fat_is_next(fat, next)) {
+            *end = CHAIN_BROKEN;
+            cluster = next;
+            break;
+        }
+        cluster = next;
+    }
+    *stop = cluster;
+    c->report->clusters += count;
+    return count;
+}
+
+// Cut a chain after keep clusters: the rest goes back to the free clusters,
+// the last one kept gets the end marker
+static void check_trim(Check *c, unsigned int start, unsigned int keep, unsigned int count)
+{
+    FatVolume *vol = c->vol;
+    unsigned int cluster = start;
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned int next = get_fat_entry(vol, cluster);
+        if (i + 1 == keep) {
+            set_fat_entry(vol, cluster, vol->fat.eoc);
+        } else if (i >= keep) {
+            set_fat_entry(vol, cluster, 0);
+            c->visited[cluster / WORD_BITS] &= ~(1UL << (cluster % WORD_BITS));
+            check_release(c, cluster);
+        }
+        cluster = next;
+    }
+    c->report->clusters -= count - keep;
+}
+
+// Write an entry repair changed and drop its directory's name index
+static int check_write_entry(Check *c, int dir, const Fat16Entry *entry, unsigned long offset)
+{
+    FatVolume *vol = c->vol;
+    if (cache_write(&vol->cache, offset, entry, sizeof(Fat16Entry)) != sizeof(Fat16Entry))
+        return FAT_ERR_IO;
+    pthread_mutex_lock(&vol->index_lock);
+    dirindex_invalidate(&vol->dir_indexes, c->dirs[dir].cluster);
+    pthread_mutex_unlock(&vol->index_lock);
+    return FAT_OK;
+}
+
+static int check_add_tail(Check *c, int dir, const Fat16Entry *entry, unsigned long offset)
+{
+    if (c->tail_count == c->tail_capacity) {
+        int capacity = c->tail_capacity ? c->tail_capacity * 2 : 16;
+        CheckTail *grown = realloc(c->tails, capacity * sizeof(CheckTail));
+        if (grown == NULL)
+            return FAT_ERR_NO_MEMORY;
+        c->tails = grown;
+        c->tail_capacity = capacity;
+    }
+    c->tails[c->tail_count++] = (CheckTail){*entry, offset, dir};
+    return FAT_OK;
+}
+
+static int check_add_dir(Check *c, unsigned int cluster, unsigned int clusters, int parent, const unsigned char *name)
+{
+    if (c->dir_count == c->dir_capacity) {
+        int capacity = c->dir_capacity ? c->dir_capacity * 2 : 64;
+        CheckDir *grown = realloc(c->dirs, capacity * sizeof(CheckDir));
+        if (grown == NULL)
+            return FAT_ERR_NO_MEMORY;
+        c->dirs = grown;
+        c->dir_capacity = capacity;
+    }
+    CheckDir *d = &c->dirs[c->dir_count++];
+    d->cluster = cluster;
+    d->clusters = clusters;
+    d->parent = parent;
+    memcpy(d->name, name, 11);
+    return FAT_OK;
+}
+
+// Check one entry of directory dir and its chain. Files are followed as far
+// as their size needs, longer chains are left for check_tail(); directories
+// are queued for the walk.
+static int check_entry(Check *c, int dir, const Fat16Entry *entry, unsigned long entry_offset)
+{
+    FatVolume *vol = c->vol;
+    bool is_dir = entry->attributes & FAT_ATTR_DIRECTORY;
+    unsigned int start = fat_entry_cluster(&vol->fat, entry);
+    unsigned int needed = ((unsigned long)entry->file_size + vol->cluster_size - 1) / vol->cluster_size;
+    unsigned char name[11];
+    memcpy(name, entry->filename, 8);
+    memcpy(name + 8, entry->ext, 3);
+
+    if (is_dir)
+        c->report->dirs++;
+    else
+        c->report->files++;
+    if (start == 0 && !is_dir && needed == 0)
+        return FAT_OK;
+
+    ChainEnd end;
+    unsigned int stop;
+    unsigned int count = check_chain(c, start, is_dir ? vol->cluster_count : needed, &end, &stop);
+    if (end == CHAIN_MORE)
+        return check_add_tail(c, dir, entry, entry_offset);
+
+    if (end == CHAIN_CROSSED)
+        check_problem(c, FAT_PROBLEM_CROSS_LINKED, dir, name, stop, needed, count);
+    else if (end == CHAIN_BROKEN && (start != 0 || is_dir))
+        check_problem(c, FAT_PROBLEM_BROKEN_CHAIN, dir, name, stop, needed, count);
+    else if (!is_dir && count < needed)
+        check_problem(c, FAT_PROBLEM_CHAIN_SHORTER, dir, name, start, needed, count);
+    else
+        return is_dir ? check_add_dir(c, start, count, dir, name) : FAT_OK;
+
+    // Files keep what their chain still holds, a directory without a single
+    // cluster of its own is dropped
+    if (c->repair) {
+        Fat16Entry fixed = *entry;
+        if (end != CHAIN_END && count > 0)
+            check_trim(c, start, count, count);
+        if (count == 0 && is_dir)
+            fixed.filename[0] = 0xE5;
+        if (count == 0)
+            fat_set_entry_cluster(&fixed, 0);
+        if (!is_dir)
+            fixed.file_size = count * vol->cluster_size;
+        if (memcmp(&fixed, entry, sizeof(Fat16Entry)) != 0 &&
+            check_write_entry(c, dir, &fixed, entry_offset) != FAT_OK)
+            return FAT_ERR_IO;
+    }
+    if (is_dir && count > 0)
+        return check_add_dir(c, start, count, dir, name);
+    return FAT_OK;
+}
+
+// The rest of a chain longer than its file needs, as far as no other chain
+// holds it. Repair ends the chain where the size does and frees the rest;
+// a tail that runs into another chain is reported as the cross link.
+static int check_tail(Check *c, const CheckTail *tail)
+{
+    FatVolume *vol = c->vol;
+    unsigned int start = fat_entry_cluster(&vol->fat, &tail->entry);
+    unsigned int needed = ((unsigned long)tail->entry.file_size + vol->cluster_size - 1) / vol->cluster_size;
+    unsigned char name[11];
+    memcpy(name, tail->entry.filename, 8);
+    memcpy(name + 8, tail->entry.ext, 3);
+
+    // Where the first pass stopped
+    unsigned int cluster = start;
+    for (unsigned int i = 0; i < needed; i++)
+        cluster = get_fat_entry(vol, cluster);
+
+    ChainEnd end;
+    unsigned int stop;
+    unsigned int extra = check_chain(c, cluster, vol->cluster_count, &end, &stop);
+    if (end == CHAIN_CROSSED)
+        check_problem(c, FAT_PROBLEM_CROSS_LINKED, tail->dir, name, stop, needed, needed + extra);
+    else
+        check_problem(c, FAT_PROBLEM_CHAIN_LONGER, tail->dir, name, cluster, needed, needed + extra);
+
+    if (c->repair) {
+        check_trim(c, start, needed, needed + extra);
+        if (needed == 0) {
+            Fat16Entry fixed = tail->entry;
+            fat_set_entry_cluster(&fixed, 0);
+            return check_write_entry(c, tail->dir, &fixed, tail->offset);
+        }
+    }
+    return FAT_OK;
+}
+
+// Every entry of one queued directory, reading no further along its chain
+// than the clusters that belong to it
+static int check_dir(Check *c, int dir)
+{
+    DirIter it;
+    const Fat16Entry *entry;
+    unsigned long entry_offset;
+    int status = dir_iter_open(&it, c->vol, c->dirs[dir].cluster);
+    if (status != FAT_OK)
+        return status;
+    if (c->dirs[dir].cluster != 0 || c->vol->root_cluster != 0)
+        it.clusters_left = c->dirs[dir].clusters;
+
+    while (status == FAT_OK && (entry = dir_iter_next(&it, &entry_offset)) != NULL) {
+        if (entry->filename[0] == 0x00)
+            break;
+        if (entry->filename[0] == 0xE5 || entry->filename[0] == '.' || (entry->attributes & FAT_ATTR_VOLUME_LABEL))
+            continue;
+        Fat16Entry copy = *entry;
+        status = check_entry(c, dir, &copy, entry_offset);
+    }
+    dir_iter_close(&it);
+    return status;
+}
+
+// Compare every other FAT copy on the image with the table in memory, which
+// is the first copy. Repair marks the differing sectors dirty so the next
+// flush writes the first copy over them.
+static int check_copies(Check *c)
+{
+    FatVolume *vol = c->vol;
+    unsigned int sector_size = vol->bs.sector_size;
+    unsigned long fat_bytes = vol->fat.bytes;
+    unsigned char *buffer = malloc(CHECK_CHUNK);
+    if (buffer == NULL)
+        return FAT_ERR_NO_MEMORY;
+
+    c->report->fat_copies = vol->fat_copies;
+    for (unsigned int copy = 1; copy < vol->fat_copies; copy++) {
+        unsigned long sectors = 0;
+        for (unsigned long chunk = 0; chunk < fat_bytes; chunk += CHECK_CHUNK) {
+            unsigned long length = fat_bytes - chunk < CHECK_CHUNK ? fat_bytes - chunk : CHECK_CHUNK;
+            if (cache_read(&vol->cache, vol->fat_offset + copy * fat_bytes + chunk, buffer, length) != length) {
+                free(buffer);
+                return FAT_ERR_IO;
+            }
+
+            // Skip to the next difference, count its sector and go on after it
+            unsigned long at = 0;
+            while ((at += simd_mismatch(buffer + at, vol->fat.data + chunk + at, length - at)) < length) {
+                unsigned long sector = (chunk + at) / sector_size;
+                if (c->repair)
+                    vol->fat_dirty[sector] = 1;
+                sectors++;
+                at = (sector + 1) * sector_size - chunk;
+            }
+        }
+        if (sectors > 0)
+            check_problem(c, FAT_PROBLEM_FAT_MISMATCH, -1, NULL, copy, 0, sectors);
+    }
+    free(buffer);
+    return FAT_OK;
+}
+
+// Clusters in use by the FAT that no chain from the root reached. The free
+// scan gives the zero entries, so each bitmap word of candidates is one OR
+// away; bad cluster marks are neither free nor lost.
+static int check_lost(Check *c)
+{
+    FatVolume *vol = c->vol;
+    unsigned long words = (vol->cluster_count + WORD_BITS - 1) / WORD_BITS;
+    unsigned long *free_bits = calloc(words, sizeof(unsigned long));
+    if (free_bits == NULL)
+        return FAT_ERR_NO_MEMORY;
+    vol->fat.ops->find_free(&vol->fat, free_bits);
+
+    unsigned int bad = vol->fat.eoc - 8, lost = 0, first = 0;
+    for (unsigned long w = 0; w < words; w++) {
+        unsigned long candidates = ~(free_bits[w] | c->visited[w]);
+        if (w == 0)
+            candidates &= ~3UL;
+        if (w == words - 1 && vol->cluster_count % WORD_BITS != 0)
+            candidates &= (1UL << (vol->cluster_count % WORD_BITS)) - 1;
+        c->report->free_clusters += __builtin_popcountl(free_bits[w]);
+
+        while (candidates != 0) {
+            unsigned int cluster = w * WORD_BITS + __builtin_ctzl(candidates);
+            candidates &= candidates - 1;
+            if (get_fat_entry(vol, cluster) == bad) {
+                c->report->bad_clusters++;
+                continue;
+            }
+            if (lost++ == 0)
+                first = cluster;
+            if (c->repair) {
+                set_fat_entry(vol, cluster, 0);
+                check_release(c, cluster);
+                c->report->free_clusters++;
+            }
+        }
+    }
+    free(free_bits);
+    if (lost > 0)
+        check_problem(c, FAT_PROBLEM_LOST_CLUSTERS, -1, NULL, first, 0, lost);
+    return FAT_OK;
+}
+
+int fat_check(FatVolume *vol, bool repair, FatCheckFn problem, void *ctx, FatCheckReport *report)
+{
+    Check c;
+    memset(&c, 0, sizeof(Check));
+    memset(report, 0, sizeof(FatCheckReport));
+    c.vol = vol;
+    c.repair = repair;
+    c.problem_fn = problem;
+    c.ctx = ctx;
+    c.report = report;
+
+    if (repair && !volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    // One consistent pass: entries only change with the FAT held
+    // exclusively, so holding it keeps every writer out. Readers of a fixed
+    // root region go without the FAT lock, so repair takes the root's
+    // directory lock as well.
+    int status;
+    if (repair) {
+        pthread_rwlock_wrlock(dir_lock(vol, 0));
+        if ((status = lock_fat(vol, true)) != FAT_OK) {
+            pthread_rwlock_unlock(dir_lock(vol, 0));
+            return status;
+        }
+    } else if ((status = lock_fat(vol, false)) != FAT_OK) {
+        return status;
+    }
+
+    c.visited = calloc((vol->cluster_count + WORD_BITS - 1) / WORD_BITS, sizeof(unsigned long));
+    if (c.visited == NULL) {
+        status = FAT_ERR_NO_MEMORY;
+        goto done;
+    }
+
+    // Copies first, so what repair changes below is not counted against them
+    if ((status = check_copies(&c)) != FAT_OK)
+        goto done;
+
+    // A FAT32 root is a chain like any other directory
+    unsigned char root_name[11];
+    memset(root_name, ' ', 11);
+    unsigned int root_clusters = 0;
+    if (vol->root_cluster != 0) {
+        ChainEnd end;
+        unsigned int stop;
+        root_clusters = check_chain(&c, vol->root_cluster, vol->cluster_count, &end, &stop);
+        if (end != CHAIN_END) {
+            check_problem(&c, end == CHAIN_CROSSED ? FAT_PROBLEM_CROSS_LINKED : FAT_PROBLEM_BROKEN_CHAIN, -1,
+                          root_name, stop, 0, root_clusters);
+            if (repair && root_clusters > 0)
+                check_trim(&c, vol->root_cluster, root_clusters, root_clusters);
+        }
+    }
+    if (vol->root_cluster == 0 || root_clusters > 0)
+        status = check_add_dir(&c, 0, root_clusters, -1, root_name);
+
+    for (int d = 0; d < c.dir_count && status == FAT_OK; d++)
+        status = check_dir(&c, d);
+    for (int t = 0; t < c.tail_count && status == FAT_OK; t++)
+        status = check_tail(&c, &c.tails[t]);
+
+    // Lost clusters are only known once the whole tree is walked
+    if (status == FAT_OK)
+        status = check_lost(&c);
+
+    if (repair) {
+        if (c.freed.length > 0)
+            release_clusters(vol, &c.freed, 1);
+        if ((flush_fat(vol) != FAT_OK || cache_flush(&vol->cache) != 0) && status == FAT_OK)
+            status = FAT_ERR_IO;
+    }
+
+done:
+    unlock_fat(vol);
+    if (repair)
+        pthread_rwlock_unlock(dir_lock(vol, 0));
+    free(c.visited);
+    free(c.dirs);
+    free(c.tails);
+    return status;
+}
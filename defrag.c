@@ -0,0 +1,377 @@
+#include "volume.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define DEFRAG_CHUNK (1024 * 1024)  // most bytes defrag moves per copy
+#define DEFRAG_BATCH 64             // files relocated between two FAT flushes
+
+// A file found by defrag and where its directory entry lives
+typedef struct {
+    Fat16Entry entry;
+    unsigned long offset;
+    unsigned int dir_cluster;
+} DefragFile;
+
+typedef struct {
+    FatVolume *vol;
+    DefragFile *files;
+    int count, capacity;
+    bool dry_run;
+    unsigned char *buffer;
+    // Old clusters of relocated files. They only become free after the batch
+    // is flushed, so until then the FAT on disk still points at intact data.
+    Extent *pending;
+    int pending_count, pending_capacity;
+    // What a dry run took from the free map and gave back to it, undone at the end
+    Extent *borrowed, *returned;
+    int borrowed_count, borrowed_capacity, returned_count, returned_capacity;
+    int batch;
+    FatDefragFn moved_fn;
+    void *ctx;
+    FatDefragReport *report;
+    int status;
+} Defrag;
+
+static int defrag_add_file(Defrag *d, const Fat16Entry *entry, unsigned long offset, unsigned int dir_cluster)
+{
+    if (d->count == d->capacity) {
+        int capacity = d->capacity ? d->capacity * 2 : 64;
+        DefragFile *grown = realloc(d->files, capacity * sizeof(DefragFile));
+        if (grown == NULL)
+            return FAT_ERR_NO_MEMORY;
+        d->files = grown;
+        d->capacity = capacity;
+    }
+    d->files[d->count++] = (DefragFile){*entry, offset, dir_cluster};
+    return FAT_OK;
+}
+
+static int append_extents(Extent **list, int *count, int *capacity, const Extent *extents, int extent_count)
+{
+    if (*count + extent_count > *capacity) {
+        int grown_capacity = (*count + extent_count) * 2;
+        Extent *grown = realloc(*list, grown_capacity * sizeof(Extent));
+        if (grown == NULL)
+            return FAT_ERR_NO_MEMORY;
+        *list = grown;
+        *capacity = grown_capacity;
+    }
+    memcpy(*list + *count, extents, extent_count * sizeof(Extent));
+    *count += extent_count;
+    return FAT_OK;
+}
+
+// Every file in the directory and below it, one directory at a time from a
+// queue that grows as subdirectories are found
+static int defrag_collect(Defrag *d, unsigned int start)
+{
+    FatVolume *vol = d->vol;
+    unsigned int *queue = malloc(64 * sizeof(unsigned int));
+    int queue_count = 1, queue_capacity = 64;
+    // Directories already queued, so a damaged one that points back up the
+    // tree is not walked again
+    unsigned char *queued = calloc((vol->cluster_count + 7) / 8, 1);
+    if (queue == NULL || queued == NULL) {
+        free(queue);
+        free(queued);
+        return FAT_ERR_NO_MEMORY;
+    }
+    queue[0] = start;
+    queued[start / 8] |= 1 << (start % 8);
+
+    int status = FAT_OK;
+    for (int q = 0; status == FAT_OK && q < queue_count; q++) {
+        unsigned int dir_cluster = queue[q];
+        DirIter it;
+        const Fat16Entry *entry;
+        unsigned long entry_offset;
+
+        if ((status = lock_dir_shared(vol, dir_cluster)) != FAT_OK)
+            break;
+        if ((status = dir_iter_open(&it, vol, dir_cluster)) != FAT_OK) {
+            unlock_dir_shared(vol, dir_cluster);
+            break;
+        }
+        while (status == FAT_OK && (entry = dir_iter_next(&it, &entry_offset)) != NULL) {
+            if (entry->filename[0] == 0x00)
+                break;
+            if (entry->filename[0] == 0xE5 || entry->filename[0] == '.' || (entry->attributes & 0x08))
+                continue;
+
+            unsigned int cluster = fat_entry_cluster(&vol->fat, entry);
+            if (!(entry->attributes & 0x10)) {
+                if (cluster != 0)
+                    status = defrag_add_file(d, entry, entry_offset, dir_cluster);
+                continue;
+            }
+            if (cluster >= vol->cluster_count || (queued[cluster / 8] & (1 << (cluster % 8))))
+                continue;
+            if (queue_count == queue_capacity) {
+                unsigned int *grown = realloc(queue, queue_capacity * 2 * sizeof(unsigned int));
+                if (grown == NULL) {
+                    status = FAT_ERR_NO_MEMORY;
+                    break;
+                }
+                queue = grown;
+                queue_capacity *= 2;
+            }
+            queue[queue_count++] = cluster;
+            queued[cluster / 8] |= 1 << (cluster % 8);
+        }
+        dir_iter_close(&it);
+        unlock_dir_shared(vol, dir_cluster);
+    }
+    free(queue);
+    free(queued);
+    return status;
+}
+
+// Copy a chain's clusters from the old extents into the new ones, in pieces
+// as long as both sides stay contiguous
+static int defrag_copy(Defrag *d, const Extent *from, int from_count, const Extent *to, int to_count)
+{
+    FatVolume *vol = d->vol;
+    unsigned int chunk_clusters = DEFRAG_CHUNK / vol->cluster_size;
+    unsigned int from_done = 0, to_done = 0;
+    int f = 0, t = 0;
+
+    if (chunk_clusters == 0)
+        chunk_clusters = 1;
+    while (f < from_count && t < to_count) {
+        unsigned int clusters = from[f].length - from_done;
+        if (clusters > to[t].length - to_done)
+            clusters = to[t].length - to_done;
+        if (clusters > chunk_clusters)
+            clusters = chunk_clusters;
+
+        unsigned long bytes = (unsigned long)clusters * vol->cluster_size;
+        if (cache_read(&vol->cache, cluster_offset(vol, from[f].start + from_done), d->buffer, bytes) != bytes ||
+            cache_write(&vol->cache, cluster_offset(vol, to[t].start + to_done), d->buffer, bytes) != bytes)
+            return FAT_ERR_IO;
+
+        from_done += clusters;
+        to_done += clusters;
+        if (from_done == from[f].length) {
+            f++;
+            from_done = 0;
+        }
+        if (to_done == to[t].length) {
+            t++;
+            to_done = 0;
+        }
+    }
+    return FAT_OK;
+}
+
+// Write out the FAT and directory changes of the current batch, then let
+// the clusters the files left behind be allocated again. Runs with the FAT
+// locked exclusively.
+static void defrag_commit(Defrag *d)
+{
+    if (d->dry_run) {
+        // Kept in use if there is no room to remember them for the undo
+        if (append_extents(&d->returned, &d->returned_count, &d->returned_capacity, d->pending,
+                           d->pending_count) == FAT_OK)
+            freemap_release_extents(&d->vol->free_clusters, d->pending, d->pending_count);
+    } else {
+        if (flush_fat(d->vol) != FAT_OK || cache_flush(&d->vol->cache) != 0)
+            d->status = FAT_ERR_IO;
+        release_clusters(d->vol, d->pending, d->pending_count);
+    }
+    d->pending_count = 0;
+    d->batch = 0;
+}
+
+// Move one file into fewer extents if the free space allows it. Runs with
+// the FAT locked exclusively and, unless it is a dry run, the file's
+// directory too.
+static int defrag_file(Defrag *d, DefragFile *file)
+{
+    FatVolume *vol = d->vol;
+    FatDefragReport *report = d->report;
+    Extent *old;
+    int old_count = build_extents(vol, fat_entry_cluster(&vol->fat, &file->entry), vol->cluster_count, &old);
+    if (old_count < 0)
+        return FAT_ERR_NO_MEMORY;
+    report->extents_before += old_count;
+
+    if (old_count <= 1) {
+        report->extents_after += old_count;
+        free(old);
+        return FAT_OK;
+    }
+    report->fragmented++;
+
+    unsigned int clusters = 0;
+    for (int e = 0; e < old_count; e++)
+        clusters += old[e].length;
+
+    Extent *new;
+    int new_count = freemap_alloc_extents(&vol->free_clusters, clusters, &new);
+    if (new_count < 0 || new_count >= old_count) {
+        if (new_count >= 0)
+            freemap_release_extents(&vol->free_clusters, new, new_count);
+        report->extents_after += old_count;
+        free(new);
+        free(old);
+        return FAT_OK;
+    }
+    if (d->dry_run &&
+        append_extents(&d->borrowed, &d->borrowed_count, &d->borrowed_capacity, new, new_count) != FAT_OK) {
+        freemap_release_extents(&vol->free_clusters, new, new_count);
+        report->extents_after += old_count;
+        free(new);
+        free(old);
+        return FAT_ERR_NO_MEMORY;
+    }
+
+    if (!d->dry_run) {
+        int status = defrag_copy(d, old, old_count, new, new_count);
+        if (status != FAT_OK) {
+            freemap_release_extents(&vol->free_clusters, new, new_count);
+            report->extents_after += old_count;
+            free(new);
+            free(old);
+            return status;
+        }
+        link_extents(vol, new, new_count);
+        for (int e = 0; e < old_count; e++) {
+            for (unsigned int c = 0; c < old[e].length; c++)
+                set_fat_entry(vol, old[e].start + c, 0);
+        }
+        fat_set_entry_cluster(&file->entry, new[0].start);
+        if (cache_write(&vol->cache, file->offset, &file->entry, sizeof(Fat16Entry)) != sizeof(Fat16Entry)) {
+            // The entry still points at the old chain, put the chain back
+            link_extents(vol, old, old_count);
+            for (int e = 0; e < new_count; e++) {
+                for (unsigned int c = 0; c < new[e].length; c++)
+                    set_fat_entry(vol, new[e].start + c, 0);
+            }
+            fat_set_entry_cluster(&file->entry, old[0].start);
+            freemap_release_extents(&vol->free_clusters, new, new_count);
+            report->extents_after += old_count;
+            free(new);
+            free(old);
+            return FAT_ERR_IO;
+        }
+        pthread_mutex_lock(&vol->index_lock);
+        dirindex_invalidate(&vol->dir_indexes, file->dir_cluster);
+        pthread_mutex_unlock(&vol->index_lock);
+    }
+
+    if (append_extents(&d->pending, &d->pending_count, &d->pending_capacity, old, old_count) != FAT_OK) {
+        free(new);
+        free(old);
+        return FAT_ERR_NO_MEMORY;
+    }
+
+    if (d->moved_fn != NULL) {
+        char name[13];
+        unsigned char raw[11];
+        memcpy(raw, file->entry.filename, 8);
+        memcpy(raw + 8, file->entry.ext, 3);
+        fat_format_name(raw, name);
+        d->moved_fn(d->ctx, name, old_count, new_count, clusters, new[0].start);
+    }
+
+    report->moved++;
+    report->clusters_moved += clusters;
+    report->extents_after += new_count;
+    free(new);
+    free(old);
+
+    if (++d->batch == DEFRAG_BATCH)
+        defrag_commit(d);
+    return FAT_OK;
+}
+
+int fat_defrag(FatVolume *vol, unsigned int dir, const char *path, bool dry_run, FatDefragFn moved, void *ctx,
+               FatDefragReport *report)
+{
+    Defrag d;
+    memset(&d, 0, sizeof(Defrag));
+    memset(report, 0, sizeof(FatDefragReport));
+    d.vol = vol;
+    d.dry_run = dry_run;
+    d.moved_fn = moved;
+    d.ctx = ctx;
+    d.report = report;
+
+    if (!dry_run && !volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    unsigned int dir_cluster;
+    Fat16Entry entry;
+    unsigned long entry_offset;
+    int status;
+    int kind = resolve_path(vol, dir, path, &dir_cluster, &entry, &entry_offset);
+    if (kind < 0)
+        return kind;
+    if (kind == 0)
+        status = defrag_add_file(&d, &entry, entry_offset, dir_cluster);
+    else
+        status = defrag_collect(&d, dir_cluster);
+
+    d.buffer = malloc(DEFRAG_CHUNK > vol->cluster_size ? DEFRAG_CHUNK : vol->cluster_size);
+    if (status == FAT_OK && d.buffer == NULL)
+        status = FAT_ERR_NO_MEMORY;
+    if (status != FAT_OK) {
+        free(d.files);
+        free(d.buffer);
+        return status;
+    }
+
+    report->files = d.count;
+
+    // A dry run holds the FAT for the whole pass, the clusters it hands back
+    // are still in use and no writer may take them meanwhile. A real run
+    // locks one file at a time, so readers and writers elsewhere carry on.
+    if (dry_run && (status = lock_fat(vol, true)) != FAT_OK) {
+        free(d.files);
+        free(d.buffer);
+        return status;
+    }
+    for (int i = 0; i < d.count && status == FAT_OK; i++) {
+        DefragFile *file = &d.files[i];
+        if (dry_run) {
+            status = defrag_file(&d, file);
+            continue;
+        }
+
+        pthread_rwlock_wrlock(dir_lock(vol, file->dir_cluster));
+        if ((status = lock_fat(vol, true)) == FAT_OK) {
+            // Skip files that changed since they were collected
+            Fat16Entry current;
+            if (cache_read(&vol->cache, file->offset, &current, sizeof(Fat16Entry)) == sizeof(Fat16Entry) &&
+                memcmp(&current, &file->entry, sizeof(Fat16Entry)) == 0)
+                status = defrag_file(&d, file);
+            else
+                report->files--;
+            unlock_fat(vol);
+        }
+        pthread_rwlock_unlock(dir_lock(vol, file->dir_cluster));
+    }
+    if (dry_run || lock_fat(vol, true) == FAT_OK) {
+        defrag_commit(&d);
+
+        // Undo what the dry run took and gave back, clusters that were both
+        // end up in use as they started
+        if (dry_run) {
+            freemap_release_extents(&vol->free_clusters, d.borrowed, d.borrowed_count);
+            for (int e = 0; e < d.returned_count; e++) {
+                for (unsigned int c = 0; c < d.returned[e].length; c++)
+                    freemap_mark_used(&vol->free_clusters, d.returned[e].start + c);
+            }
+        }
+        unlock_fat(vol);
+    }
+    if (status == FAT_OK)
+        status = d.status;
+
+    free(d.files);
+    free(d.buffer);
+    free(d.pending);
+    free(d.borrowed);
+    free(d.returned);
+    return status;
+}
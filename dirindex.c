@@ -0,0 +1,245 @@
+#include "dirindex.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+bool name_to_83(const char *name, unsigned char out[11])
+{
+    memset(out, ' ', 11);
+
+    // The dot entries are stored literally
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        memcpy(out, name, strlen(name));
+        return true;
+    }
+
+    const char *dot = strrchr(name, '.');
+    size_t base_len = dot ? (size_t)(dot - name) : strlen(name);
+    size_t ext_len = dot ? strlen(dot + 1) : 0;
+    if (base_len == 0 || base_len > 8 || ext_len > 3)
+        return false;
+
+    for (size_t i = 0; i < base_len; i++)
+        out[i] = toupper((unsigned char)name[i]);
+    for (size_t i = 0; i < ext_len; i++)
+        out[8 + i] = toupper((unsigned char)dot[1 + i]);
+    return true;
+}
+
+static unsigned int hash_name(const unsigned char name[11])
+{
+    // FNV-1a
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 11; i++)
+    {
+        h ^= name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(DirIndexCache *cache, DirIndex *index)
+{
+    if (index->newer) index->newer->older = index->older;
+    else cache->newest = index->older;
+    if (index->older) index->older->newer = index->newer;
+    else cache->oldest = index->newer;
+    index->newer = index->older = NULL;
+}
+
+static void lru_push(DirIndexCache *cache, DirIndex *index)
+{
+    index->older = cache->newest;
+    index->newer = NULL;
+    if (cache->newest) cache->newest->newer = index;
+    cache->newest = index;
+    if (!cache->oldest) cache->oldest = index;
+}
+
+DirIndex *dirindex_find(DirIndexCache *cache, unsigned int cluster)
+{
+    for (DirIndex *index = cache->buckets[cluster % DIRINDEX_BUCKETS]; index != NULL; index = index->next)
+    {
+        if (index->cluster == cluster)
+        {
+            lru_unlink(cache, index);
+            lru_push(cache, index);
+            return index;
+        }
+    }
+    return NULL;
+}
+
+// Drop the least recently used indexes until a new one fits the budget.
+// Indexes grow on insert without seeing the cache, so the slots are counted
+// here rather than kept as a running total.
+static void make_room(DirIndexCache *cache, unsigned long needed)
+{
+    unsigned long used = 0;
+    for (DirIndex *index = cache->oldest; index != NULL; index = index->newer)
+        used += index->capacity;
+    while (cache->oldest != NULL && used + needed > DIRINDEX_BUDGET)
+    {
+        used -= cache->oldest->capacity;
+        dirindex_invalidate(cache, cache->oldest->cluster);
+    }
+}
+
+DirIndex *dirindex_create(DirIndexCache *cache, unsigned int cluster)
+{
+    dirindex_invalidate(cache, cluster);
+    make_room(cache, 16);
+
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    if (index == NULL)
+        return NULL;
+    index->cluster = cluster;
+    index->capacity = 16;
+    index->slots = calloc(index->capacity, sizeof(DirIndexSlot));
+    if (index->slots == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+
+    index->next = cache->buckets[cluster % DIRINDEX_BUCKETS];
+    cache->buckets[cluster % DIRINDEX_BUCKETS] = index;
+    lru_push(cache, index);
+    return index;
+}
+
+void dirindex_invalidate(DirIndexCache *cache, unsigned int cluster)
+{
+    DirIndex **link = &cache->buckets[cluster % DIRINDEX_BUCKETS];
+    while (*link != NULL)
+    {
+        DirIndex *index = *link;
+        if (index->cluster == cluster)
+        {
+            *link = index->next;
+            lru_unlink(cache, index);
+            free(index->slots);
+            free(index);
+            return;
+        }
+        link = &index->next;
+    }
+}
+
+void dirindex_clear(DirIndexCache *cache)
+{
+    for (int b = 0; b < DIRINDEX_BUCKETS; b++)
+    {
+        while (cache->buckets[b] != NULL)
+        {
+            DirIndex *index = cache->buckets[b];
+            cache->buckets[b] = index->next;
+            free(index->slots);
+            free(index);
+        }
+    }
+    cache->newest = cache->oldest = NULL;
+    cache->recent_count = 0;
+}
+
+bool dirindex_seen(DirIndexCache *cache, unsigned int cluster)
+{
+    unsigned int known = cache->recent_count < DIRINDEX_RECENT ? cache->recent_count : DIRINDEX_RECENT;
+    for (unsigned int i = 0; i < known; i++)
+    {
+        if (cache->recent[i] == cluster)
+            return true;
+    }
+    cache->recent[cache->recent_count++ % DIRINDEX_RECENT] = cluster;
+    return false;
+}
+
+const DirIndexSlot *dirindex_lookup(const DirIndex *index, const unsigned char name[11])
+{
+    unsigned int mask = index->capacity - 1;
+    for (unsigned int i = hash_name(name) & mask; index->slots[i].used; i = (i + 1) & mask)
+    {
+        if (memcmp(index->slots[i].name, name, 11) == 0)
+            return &index->slots[i];
+    }
+    return NULL;
+}
+
+static int grow(DirIndex *index)
+{
+    unsigned int old_capacity = index->capacity;
+    DirIndexSlot *old_slots = index->slots;
+
+    index->slots = calloc(old_capacity * 2, sizeof(DirIndexSlot));
+    if (index->slots == NULL)
+    {
+        index->slots = old_slots;
+        return -1;
+    }
+    index->capacity = old_capacity * 2;
+    index->count = 0;
+
+    for (unsigned int i = 0; i < old_capacity; i++)
+    {
+        if (old_slots[i].used)
+            dirindex_insert(index, &old_slots[i].entry, old_slots[i].offset);
+    }
+    free(old_slots);
+    return 0;
+}
+
+int dirindex_insert(DirIndex *index, const Fat16Entry *entry, unsigned long offset)
+{
+    // Keep the load factor under one half
+    if ((index->count + 1) * 2 > index->capacity && grow(index) != 0)
+        return -1;
+
+    unsigned char name[11];
+    memcpy(name, entry->filename, 8);
+    memcpy(name + 8, entry->ext, 3);
+
+    unsigned int mask = index->capacity - 1;
+    unsigned int i = hash_name(name) & mask;
+    while (index->slots[i].used)
+    {
+        // First entry with a name wins, like a linear directory scan
+        if (memcmp(index->slots[i].name, name, 11) == 0)
+            return 0;
+        i = (i + 1) & mask;
+    }
+
+    memcpy(index->slots[i].name, name, 11);
+    index->slots[i].used = true;
+    index->slots[i].offset = offset;
+    index->slots[i].entry = *entry;
+    index->count++;
+    return 0;
+}
+
+void dirindex_remove(DirIndex *index, const unsigned char name[11])
+{
+    DirIndexSlot *slot = (DirIndexSlot *)dirindex_lookup(index, name);
+    if (slot == NULL)
+        return;
+
+    // Backward shift deletion keeps probe sequences intact without tombstones
+    unsigned int mask = index->capacity - 1;
+    unsigned int hole = slot - index->slots;
+    unsigned int i = hole;
+    while (true)
+    {
+        i = (i + 1) & mask;
+        if (!index->slots[i].used)
+            break;
+        unsigned int home = hash_name(index->slots[i].name) & mask;
+        // Move the entry back if its home position isn't between the hole and i
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            index->slots[hole] = index->slots[i];
+            hole = i;
+        }
+    }
+    index->slots[hole].used = false;
+    index->count--;
+}
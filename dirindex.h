@@ -0,0 +1,58 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "fat.h"
+#include <stdbool.h>
+
+// In-memory name index per directory, keyed on the raw 11-byte 8.3 name.
+// A directory is scanned directly on its first lookup and indexed on the
+// second, so a single visit doesn't pay for the index. Indexes are kept in a
+// small cache keyed by the directory's first cluster (0 for the root), with
+// LRU eviction once their slots pass a budget. A pointer from dirindex_find()
+// or dirindex_create() is only valid until the next dirindex_create().
+
+#define DIRINDEX_BUCKETS 64
+#define DIRINDEX_RECENT 8       // directories remembered as looked up once
+#define DIRINDEX_BUDGET 65536   // slots of all indexes together, about 3 MB
+
+typedef struct {
+    unsigned char name[11];
+    bool used;
+    unsigned long offset;   // image offset of the directory entry
+    Fat16Entry entry;
+} DirIndexSlot;
+
+typedef struct DirIndex {
+    unsigned int cluster;
+    unsigned int capacity;  // power of two
+    unsigned int count;
+    DirIndexSlot *slots;
+    struct DirIndex *next;
+    struct DirIndex *newer, *older;     // LRU list
+} DirIndex;
+
+typedef struct {
+    DirIndex *buckets[DIRINDEX_BUCKETS];
+    DirIndex *newest, *oldest;
+    unsigned int recent[DIRINDEX_RECENT];
+    unsigned int recent_count;
+} DirIndexCache;
+
+// Convert a user supplied name into the padded, uppercased 8.3 form.
+// Returns false if the name can't be represented.
+bool name_to_83(const char *name, unsigned char out[11]);
+
+DirIndex *dirindex_find(DirIndexCache *cache, unsigned int cluster);
+DirIndex *dirindex_create(DirIndexCache *cache, unsigned int cluster);
+void dirindex_invalidate(DirIndexCache *cache, unsigned int cluster);
+void dirindex_clear(DirIndexCache *cache);
+
+// Note a lookup in a directory. Returns true if it was looked up recently,
+// which is when building its index starts to pay off.
+bool dirindex_seen(DirIndexCache *cache, unsigned int cluster);
+
+const DirIndexSlot *dirindex_lookup(const DirIndex *index, const unsigned char name[11]);
+int dirindex_insert(DirIndex *index, const Fat16Entry *entry, unsigned long offset);
+void dirindex_remove(DirIndex *index, const unsigned char name[11]);
+
+#endif
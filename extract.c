@@ -0,0 +1,184 @@
+#include "extract.h"
+#include "pool.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define EXTRACT_CHUNK (256 * 1024)  // most bytes one pread/pwrite pair moves
+
+typedef struct {
+    const WalkVolume *vol;
+    const WalkNode *node;
+    ExtractTotals *totals;
+    char *path;
+} ExtractJob;
+
+typedef struct {
+    const WalkVolume *vol;
+    int fd;
+    unsigned char *buffer;
+    unsigned long remaining;    // bytes of the file not copied yet
+    unsigned long written;      // position in the host file
+    bool failed;
+} FileCopy;
+
+static void copy_run(void *ctx, unsigned int start, unsigned int length)
+{
+    FileCopy *copy = ctx;
+    const WalkVolume *vol = copy->vol;
+    unsigned long offset = fat_cluster_offset(vol->data_offset, vol->cluster_size, start);
+    unsigned long bytes = (unsigned long)length * vol->cluster_size;
+    if (bytes > copy->remaining)
+        bytes = copy->remaining;
+
+    while (bytes > 0 && !copy->failed)
+    {
+        unsigned long n = bytes < EXTRACT_CHUNK ? bytes : EXTRACT_CHUNK;
+
+        // A mapped image is written out straight from the mapping, as far as
+        // the image reaches
+        struct iovec iov = {copy->buffer, n};
+        const void *mapped = NULL;
+        if (image_is_mapped(vol->img))
+        {
+            if ((mapped = image_acquire(vol->img, offset, n)) == NULL)
+            {
+                copy->failed = true;
+                break;
+            }
+            iov.iov_base = (void *)mapped;
+        }
+        else if (image_read(vol->img, offset, copy->buffer, n) != n)
+        {
+            copy->failed = true;
+            break;
+        }
+
+        ssize_t w = pwritev(copy->fd, &iov, 1, copy->written);
+        stat_add(STAT_SYSCALLS, 1);
+        if (mapped != NULL)
+            image_release(vol->img, mapped);
+        if (w != (ssize_t)n)
+        {
+            copy->failed = true;
+            break;
+        }
+        offset += n;
+        bytes -= n;
+        copy->remaining -= n;
+        copy->written += n;
+    }
+}
+
+static void extract_file(Pool *pool, void *arg)
+{
+    (void)pool;     // files are leaves, nothing more to submit
+    ExtractJob *job = arg;
+    const WalkVolume *vol = job->vol;
+    const WalkNode *node = job->node;
+    bool ok = false;
+
+    FILE *out = fopen(job->path, "wb");
+    if (out != NULL)
+    {
+        FileCopy copy = {vol, fileno(out), NULL, node->file_size, 0, false};
+        if (!image_is_mapped(vol->img) && node->file_size > 0)
+        {
+            copy.buffer = malloc(node->file_size < EXTRACT_CHUNK ? node->file_size : EXTRACT_CHUNK);
+            copy.failed = copy.buffer == NULL;
+        }
+
+        unsigned int clusters = (node->file_size + vol->cluster_size - 1) / vol->cluster_size;
+        if (!copy.failed && clusters > 0)
+            vol->fat->ops->walk(vol->fat, node->cluster, clusters, copy_run, &copy);
+
+        ok = !copy.failed && copy.remaining == 0;
+        ok &= fclose(out) == 0;
+        free(copy.buffer);
+    }
+
+    if (ok)
+    {
+        __atomic_fetch_add(&job->totals->files, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&job->totals->bytes, node->file_size, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_fetch_add(&job->totals->errors, 1, __ATOMIC_RELAXED);
+    }
+    free(job->path);
+    free(job);
+}
+
+// Create the directories below node right away and queue its files
+static void extract_dir(Pool *pool, const WalkVolume *vol, const WalkNode *node, const char *path,
+                        ExtractTotals *totals)
+{
+    char name[13];
+
+    for (int i = 0; i < node->child_count; i++)
+    {
+        const WalkNode *child = &node->children[i];
+        fat_format_name(child->name, name);
+
+        size_t length = strlen(path) + strlen(name) + 2;
+        char *child_path = malloc(length);
+        if (child_path == NULL)
+        {
+            __atomic_fetch_add(&totals->errors, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        snprintf(child_path, length, "%s/%s", path, name);
+
+        if (child->is_dir)
+        {
+            if (mkdir(child_path, 0755) != 0 && errno != EEXIST)
+                __atomic_fetch_add(&totals->errors, 1, __ATOMIC_RELAXED);
+            else
+            {
+                totals->dirs++;
+                extract_dir(pool, vol, child, child_path, totals);
+            }
+            free(child_path);
+            continue;
+        }
+
+        ExtractJob *job = malloc(sizeof(ExtractJob));
+        if (job == NULL)
+        {
+            __atomic_fetch_add(&totals->errors, 1, __ATOMIC_RELAXED);
+            free(child_path);
+            continue;
+        }
+        job->vol = vol;
+        job->node = child;
+        job->totals = totals;
+        job->path = child_path;
+        pool_submit(pool, extract_file, job);
+    }
+}
+
+int extract_tree(const WalkVolume *vol, const WalkNode *root, const char *hostdir, int threads,
+                 ExtractTotals *totals)
+{
+    memset(totals, 0, sizeof(ExtractTotals));
+    if (mkdir(hostdir, 0755) != 0 && errno != EEXIST)
+    {
+        totals->errors++;
+        return -1;
+    }
+
+    Pool *pool = pool_create(threads);
+    if (pool == NULL)
+        return -1;
+
+    // Workers start on the files while later directories are still created
+    extract_dir(pool, vol, root, hostdir, totals);
+    pool_wait(pool);
+    pool_destroy(pool);
+    return totals->errors == 0 ? 0 : -1;
+}
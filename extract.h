@@ -0,0 +1,23 @@
+#ifndef EXTRACT_H
+#define EXTRACT_H
+
+#include "walk.h"
+
+// Copies a walked directory tree to the host. Directories are created first,
+// then every file becomes a task on a work-stealing pool that follows the
+// chain itself and copies each run with positional reads from the image and
+// positional writes into the host file, so workers share no file position.
+
+typedef struct {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+    unsigned long errors;       // files or directories that could not be written
+} ExtractTotals;
+
+// Recreate everything below root under hostdir, which is created if needed.
+// Returns 0 when every file was written.
+int extract_tree(const WalkVolume *vol, const WalkNode *root, const char *hostdir, int threads,
+                 ExtractTotals *totals);
+
+#endif
@@ -1,55 +1,91 @@
-#include "fat.h"
+#include "libfat.h"
+#include "stats.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <stdbool.h>
-
-#define CLUSTER_SIZE 512
-PartitionTable pt[4];
-Fat16BootSector bs;
-FILE *in;
-unsigned int *fat_table = NULL;
-unsigned int current_cluster = 0;
-unsigned int current_dir_offset = 0;
-char current_path[256] = "Groot";
-
-void format_filename(const unsigned char *filename, const unsigned char *ext, char *formatted)
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define COMMAND_MAX 1024
+#define RANGE_BYTES 512         // head and tail without a size
+#define RANGE_CHUNK 4096        // bytes head, tail and peek read at a time
+
+// Exit status, for scripts that drive the shell
+enum {
+    EXIT_OK = 0,
+    EXIT_COMMAND_FAILED = 1,    // batch mode: at least one command failed
+    EXIT_USAGE = 2,
+    EXIT_NO_IMAGE = 3,          // the image could not be mounted
+    EXIT_WRITE_BACK = 4         // the volume could not be written back at exit
+};
+
+// Interactive shell over one mounted volume. Everything it knows about the
+// image comes through libfat, the shell itself only keeps the current
+// directory and what the last command did.
+typedef struct {
+    FatVolume *vol;
+    unsigned int cwd;       // cluster of the current directory, 0 for the root
+    char path[256];
+    bool batch;             // commands from a script or -c, results as JSON lines
+
+    // Outcome of the current command, reported by batch mode
+    bool failed;
+    char error[256];
+    long bytes;             // data moved, -1 if the command moves none
+    const char *count_name; // what count counts, NULL for nothing
+    unsigned long count;
+} Shell;
+
+// Print an error for the current command and mark it failed, the first
+// error is the one batch mode reports
+void shell_error(Shell *sh, const char *format, ...)
 {
-    char base_name[9];
-    char extension[4];
-
-    // Copy and null-terminate filename
-    memcpy(base_name, filename, 8);
-    base_name[8] = '\0';
+    char message[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    printf("Error: %s\n", message);
+    if (!sh->failed)
+        strcpy(sh->error, message);
+    sh->failed = true;
+}
 
-    // Trim trailing spaces from filename
-    int i = 7;
-    while (i >= 0 && base_name[i] == ' ')
-    {
-        base_name[i--] = '\0';
-    }
+void shell_count(Shell *sh, const char *name, unsigned long count)
+{
+    sh->count_name = name;
+    sh->count = count;
+}
 
-    // Copy and null-terminate extension
-    memcpy(extension, ext, 3);
-    extension[3] = '\0';
+// A byte count or offset argument: decimal, or hex with 0x. Empty text,
+// signs, trailing junk and values that don't fit are rejected.
+bool parse_number(const char *text, unsigned long *value)
+{
+    if (text == NULL || *text < '0' || *text > '9')
+        return false;
+    char *end;
+    errno = 0;
+    *value = strtoul(text, &end, 0);
+    return errno == 0 && *end == '\0';
+}
 
-    // Trim trailing spaces from extension
-    i = 2;
-    while (i >= 0 && extension[i] == ' ')
-    {
-        extension[i--] = '\0';
-    }
+double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
 
-    // Format as filename.ext or just filename if no extension
-    if (extension[0] != '\0')
-    {
-        sprintf(formatted, "%s.%s", base_name, extension);
-    }
-    else
-    {
-        strcpy(formatted, base_name);
-    }
+// Host files are named after the last component of an image path
+const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
 }
 
 // Convert FAT16 time format to human-readable string
@@ -66,682 +102,1125 @@ void format_time(unsigned short fat_time, unsigned short fat_date, char *time_st
 }
 
 // Function to display directory listing in DOS-like format
-void print_directory()
+void print_directory(Shell *sh)
 {
-    Fat16Entry entry;
-    char formatted_name[13];
     char time_str[20];
     int file_count = 0;
     int dir_count = 0;
     unsigned long total_bytes = 0;
 
-    // Calculate directory offset based on current position
-    unsigned int dir_offset;
-    if (current_cluster == 0)
-    {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors) *
-                     bs.sector_size;
-    }
-    else
+    FatDir *dir;
+    if (fat_dir_open(sh->vol, sh->cwd, &dir) != FAT_OK)
     {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors +
-                      bs.root_dir_entries * 32 / bs.sector_size +
-                      (current_cluster - 2) * bs.sectors_per_cluster) *
-                     bs.sector_size;
+        shell_error(sh, "Could not read directory");
+        return;
     }
 
-    fseek(in, dir_offset, SEEK_SET);
-
-    printf("\nVolume in drive: %.11s\n", bs.volume_label);
-    // printf("Directory of %s\n\n", current_cluster == 0 ? "ROOT" : "ADR1");
-    printf("Directory of %s\n\n", current_path);
+    FatVolumeInfo info;
+    fat_volume_info(sh->vol, &info);
+    printf("\nVolume in drive: %.11s\n", info.label);
+    printf("Directory of %s\n\n", sh->path);
     printf("   Date    Time        Name           Size\n");
     printf("-----------------------------------------\n");
 
-    int entries_to_read = (current_cluster == 0) ? bs.root_dir_entries : (bs.sectors_per_cluster * bs.sector_size) / sizeof(Fat16Entry);
-
-    for (int i = 0; i < entries_to_read; i++)
+    FatDirent entry;
+    while (fat_dir_next(dir, &entry) == 1)
     {
-        if (fread(&entry, sizeof(entry), 1, in) != 1)
-            break;
-
-        if (entry.filename[0] == 0x00)
-            break;
-        if (entry.filename[0] == 0xE5)
-            continue;
-
-        format_filename(entry.filename, entry.ext, formatted_name);
         format_time(entry.modify_time, entry.modify_date, time_str);
 
-        if (entry.attributes & 0x10)
+        if (entry.is_dir)
         {
-            printf("%s  %-12s <DIR>\n", time_str, formatted_name);
+            printf("%s  %-12s <DIR>\n", time_str, entry.name);
             dir_count++;
         }
         else
         {
-            printf("%s  %-12s %8u\n", time_str, formatted_name, entry.file_size);
+            printf("%s  %-12s %8u\n", time_str, entry.name, entry.size);
             file_count++;
-            total_bytes += entry.file_size;
+            total_bytes += entry.size;
         }
     }
+    fat_dir_close(dir);
 
+    long free_clusters = fat_free_clusters(sh->vol);
     printf("-----------------------------------------\n");
     printf("%d File(s)    %lu bytes\n", file_count, total_bytes);
     printf("%d Dir(s)     %lu bytes free\n", dir_count,
-           (unsigned long)(bs.sectors_per_cluster * bs.sector_size *
-                           (bs.total_sectors_int - bs.reserved_sectors -
-                            bs.number_of_fats * bs.fat_size_sectors -
-                            bs.root_dir_entries * 32 / bs.sector_size)));
+           free_clusters > 0 ? (unsigned long)free_clusters * info.cluster_size : 0UL);
+    shell_count(sh, "entries", file_count + dir_count);
 }
 
-void print_tree(unsigned int cluster, int level) {
-    Fat16Entry entry;
+void print_walk(const WalkNode *node, int level) {
     char formatted_name[13];
-    unsigned int dir_offset;
-    long saved_pos;
-
-    if (cluster == 0) {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors + 
-                     bs.number_of_fats * bs.fat_size_sectors) * bs.sector_size;
-    } else {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors + 
-                     bs.number_of_fats * bs.fat_size_sectors +
-                     bs.root_dir_entries * 32 / bs.sector_size +
-                     (cluster - 2) * bs.sectors_per_cluster) * bs.sector_size;
-    }
-
-    fseek(in, dir_offset, SEEK_SET);
 
-    int entries_to_read = (cluster == 0) ? bs.root_dir_entries : 
-                         (bs.sectors_per_cluster * bs.sector_size) / sizeof(Fat16Entry);
-
-    for (int i = 0; i < entries_to_read; i++) {
-        saved_pos = ftell(in);
-        
-        if (fread(&entry, sizeof(entry), 1, in) != 1) break;
-        
-        if (entry.filename[0] == 0x00) break;
-        if (entry.filename[0] == 0xE5) continue;
-        if (entry.attributes & 0x08) continue;
-        if (entry.filename[0] == '.') continue;
-
-        format_filename(entry.filename, entry.ext, formatted_name);
+    for (int i = 0; i < node->child_count; i++) {
+        const WalkNode *child = &node->children[i];
+        fat_format_name(child->name, formatted_name);
 
         for (int j = 0; j < level; j++) printf("  ");
         printf("├── ");
 
-        if (entry.attributes & 0x10) {
+        if (child->is_dir) {
             printf("%s/\n", formatted_name);
-            if (entry.starting_cluster != cluster) {
-                print_tree(entry.starting_cluster, level + 1);
-                fseek(in, saved_pos + sizeof(Fat16Entry), SEEK_SET);
-            }
+            print_walk(child, level + 1);
         } else {
-            printf("%s (%u bytes)\n", formatted_name, entry.file_size);
+            printf("%s (%u bytes)\n", formatted_name, child->file_size);
         }
     }
 }
 
-void change_dir(char *path)
+void print_tree(Shell *sh, unsigned int cluster, int level) {
+    WalkNode *root = fat_walk(sh->vol, cluster);
+    if (root == NULL) {
+        shell_error(sh, "Could not walk directory tree");
+        return;
+    }
+    print_walk(root, level);
+    shell_count(sh, "files", root->totals.files);
+    fat_walk_free(root);
+}
+
+void print_du_line(const WalkNode *node, const char *path)
 {
-    printf("Changing directory to %s\n", path);
-    for (int i = 0; path[i]; i++)
-    {
-        path[i] = toupper(path[i]);
+    const WalkTotals *t = &node->totals;
+    printf("%7lu %12lu %9lu %8lu %6lu  %s\n", t->files, t->bytes, t->clusters, t->extents, t->fragmented, path);
+}
+
+void print_du_walk(const WalkNode *node, const char *path)
+{
+    char formatted_name[13];
+    char child_path[512];
+
+    for (int i = 0; i < node->child_count; i++) {
+        const WalkNode *child = &node->children[i];
+        if (!child->is_dir)
+            continue;
+
+        fat_format_name(child->name, formatted_name);
+        snprintf(child_path, sizeof(child_path), "%s/%s", path, formatted_name);
+        print_du_line(child, child_path);
+        print_du_walk(child, child_path);
+    }
+}
+
+// du-style totals for the current directory and every directory below it
+void print_du(Shell *sh)
+{
+    double started = now_ms();
+    WalkNode *root = fat_walk(sh->vol, sh->cwd);
+    double elapsed = now_ms() - started;
+    if (root == NULL) {
+        shell_error(sh, "Could not walk directory tree");
+        return;
     }
 
+    printf("  Files        Bytes  Clusters  Extents  Frag  Directory\n");
+    printf("---------------------------------------------------------\n");
+    print_du_line(root, sh->path);
+    print_du_walk(root, sh->path);
+    printf("---------------------------------------------------------\n");
+    printf("%lu file(s) in %lu dir(s), %lu of them fragmented, walked in %.3f ms\n",
+           root->totals.files, root->totals.dirs, root->totals.fragmented, elapsed);
+    shell_count(sh, "files", root->totals.files);
+    sh->bytes = root->totals.bytes;
+    fat_walk_free(root);
+}
+
+// Drop the last component of a shell path, never the root itself
+void path_up(char *path)
+{
+    char *last_slash = strrchr(path, '/');
+    if (last_slash != NULL)
+        *last_slash = '\0';
+}
+
+void change_dir(Shell *sh, const char *path)
+{
     char path_copy[256];
+    char new_path[256];
+    unsigned int cluster = sh->cwd;
+
     strncpy(path_copy, path, sizeof(path_copy));
     path_copy[sizeof(path_copy) - 1] = '\0';
-    char *token = strtok(path_copy, "/");
+    strcpy(new_path, path[0] == '/' ? "Groot" : sh->path);
+    if (path[0] == '/')
+        cluster = 0;
 
+    char *token = strtok(path_copy, "/");
     while (token != NULL)
     {
-        Fat16Entry entry;
-        bool found = false;
-
-        // If we're in root directory
-        if (current_cluster == 0)
+        FatDirent entry;
+        if (strcmp(token, ".") == 0)
         {
-            current_dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                                  bs.number_of_fats * bs.fat_size_sectors) *
-                                 bs.sector_size;
+            token = strtok(NULL, "/");
+            continue;
         }
-        else
+
+        // The root has no ".." entry, going up from it stays there
+        if (strcmp(token, "..") == 0 && cluster == 0)
         {
-            // Calculate directory offset from cluster
-            current_dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                                  bs.number_of_fats * bs.fat_size_sectors +
-                                  bs.root_dir_entries * 32 / bs.sector_size +
-                                  (current_cluster - 2) * bs.sectors_per_cluster) *
-                                 bs.sector_size;
+            token = strtok(NULL, "/");
+            continue;
         }
 
-        fseek(in, current_dir_offset, SEEK_SET);
-
-        // Search for directory entry
-        int entries_to_read = (current_cluster == 0) ? bs.root_dir_entries : (bs.sectors_per_cluster * bs.sector_size) / sizeof(Fat16Entry);
-
-        for (int i = 0; i < entries_to_read; i++)
+        if (fat_lookup(sh->vol, cluster, token, &entry) != FAT_OK || !entry.is_dir)
         {
-            fread(&entry, sizeof(entry), 1, in);
-
-            if (entry.filename[0] == 0x00)
-                break;
-            if (entry.filename[0] == 0xE5)
-                continue;
-
-            char formatted_name[13];
-            format_filename(entry.filename, entry.ext, formatted_name);
-
-            printf("Formatted name: %s\n", formatted_name);
-
-            if (strcmp(formatted_name, token) == 0 && (entry.attributes & 0x10))
-            {
-                sprintf(current_path, "%s/%s", current_path, formatted_name);
-                current_cluster = entry.starting_cluster;
-                found = true;
-                printf("Found directory %s at cluster %d\n", token, current_cluster);
-                break;
-            }
+            shell_error(sh, "Directory %s not found", token);
+            return;
         }
 
-        if (!found)
+        if (strcmp(token, "..") == 0)
         {
-            printf("Error: Directory %s not found\n", token);
-            return;
+            path_up(new_path);
+        }
+        else
+        {
+            strncat(new_path, "/", sizeof(new_path) - strlen(new_path) - 1);
+            strncat(new_path, entry.name, sizeof(new_path) - strlen(new_path) - 1);
         }
+        cluster = entry.cluster;
+        if (!sh->batch)
+            printf("Found directory %s at cluster %d\n", token, cluster);
 
         token = strtok(NULL, "/");
     }
+
+    sh->cwd = cluster;
+    strcpy(sh->path, new_path);
+}
+
+void report_transfer(Shell *sh, unsigned long bytes, double elapsed_ms)
+{
+    FatIoInfo io;
+    fat_io_info(sh->vol, &io);
+    sh->bytes = bytes;
+    printf("Transferred %lu bytes in %.3f ms (%.1f MB/s, %s engine)\n", bytes, elapsed_ms,
+           elapsed_ms > 0 ? bytes / elapsed_ms / 1000.0 : 0.0, io.uring ? "io_uring" : "sync");
+}
+
+// Open a file below the current directory, printing why if that fails
+FatFile *open_file(Shell *sh, const char *filename)
+{
+    FatFile *file;
+    int status = fat_open(sh->vol, sh->cwd, filename, &file);
+    if (status == FAT_ERR_NOT_FOUND || status == FAT_ERR_IS_DIR)
+        shell_error(sh, "File not found");
+    else if (status != FAT_OK)
+        shell_error(sh, "Could not open %s: %s", filename, fat_strerror(status));
+    return status == FAT_OK ? file : NULL;
 }
 
-void load_fat()
+int read_file(Shell *sh, const char *filename)
 {
-    // Determine FAT size and allocate memory
-    unsigned int fat_size_bytes = bs.fat_size_sectors * bs.sector_size;
-    printf("Loading FAT table (%u bytes)\n", fat_size_bytes);
-    fat_table = (unsigned int *)malloc(fat_size_bytes);
+    FatFile *file = open_file(sh, filename);
+    if (file == NULL)
+        return -1;
 
-    if (fat_table == NULL)
+    // Open output file
+    char output_filename[256];
+    snprintf(output_filename, sizeof(output_filename), "output_%s", base_name(filename));
+    FILE *output_file = fopen(output_filename, "wb");
+    if (output_file == NULL)
     {
-        printf("Error: Could not allocate memory for FAT table\n");
-        exit(1);
+        shell_error(sh, "Could not open output file %s", output_filename);
+        fat_close(file);
+        return -1;
     }
 
-    // Seek to the FAT table
-    unsigned int fat_offset = (pt[0].start_sector + bs.reserved_sectors) * bs.sector_size;
-    fseek(in, fat_offset, SEEK_SET);
+    FatDirent entry;
+    fat_file_info(file, &entry);
+    printf("Reading %s (%u bytes)...\n", filename, entry.size);
 
-    // Read the FAT table
-    fread(fat_table, 1, fat_size_bytes, in);
+    unsigned long total_bytes_read = 0;
+    double started = now_ms();
+    int status = fat_save(file, output_file, &total_bytes_read);
+    double elapsed = now_ms() - started;
+
+    fat_close(file);
+    fclose(output_file);
+
+    if (status != FAT_OK)
+    {
+        shell_error(sh, "Could not read file data");
+        return -1;
+    }
+    printf("File saved to %s\n", output_filename);
+    printf("Total bytes read: %lu\n", total_bytes_read);
+    report_transfer(sh, total_bytes_read, elapsed);
+
+    return 0;
 }
 
-int read(const char *filename)
+// Print a file's contents on the console
+int cat(Shell *sh, const char *filename)
 {
-    Fat16Entry entry;
-    char search_name[9], search_ext[4];
-    bool found = false;
+    FatFile *file = open_file(sh, filename);
+    if (file == NULL)
+        return -1;
 
-    // Parse filename into base and extension (convert to uppercase)
-    memset(search_name, ' ', 8);
-    memset(search_ext, ' ', 3);
-    search_name[8] = search_ext[3] = '\0';
+    unsigned long total_bytes_read = 0;
+    int status = fat_stream(file, stdout, &total_bytes_read);
+    fat_close(file);
+    printf("\n");
+    sh->bytes = total_bytes_read;
 
-   char upper_filename[256];
-    strncpy(upper_filename, filename, sizeof(upper_filename)-1);
-    upper_filename[sizeof(upper_filename)-1] = '\0';
-    for(int i = 0; upper_filename[i]; i++) {
-        upper_filename[i] = toupper(upper_filename[i]);
+    if (status != FAT_OK)
+    {
+        shell_error(sh, "Could not read file data");
+        return -1;
     }
+    return 0;
+}
+
+typedef enum {
+    RANGE_HEAD,
+    RANGE_TAIL,
+    RANGE_PEEK
+} RangeMode;
 
-    // Seek to root directory
-    unsigned int dir_offset;
-    if (current_cluster == 0)
+// 16 bytes a line: file offset, hex, printable characters
+void hex_dump(const unsigned char *data, unsigned long length, unsigned long offset)
+{
+    for (unsigned long line = 0; line < length; line += 16)
     {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors) *
-                     bs.sector_size;
+        unsigned long n = length - line < 16 ? length - line : 16;
+        printf("%08lx ", offset + line);
+        for (unsigned long i = 0; i < 16; i++)
+        {
+            if (i < n)
+                printf(" %02x", data[line + i]);
+            else
+                printf("   ");
+        }
+        printf("  |");
+        for (unsigned long i = 0; i < n; i++)
+            putchar(data[line + i] >= 0x20 && data[line + i] < 0x7F ? data[line + i] : '.');
+        printf("|\n");
     }
-    else
+}
+
+// Print part of a file: the first or last bytes as text, or a hex dump of
+// any range. Only the clusters under the range are read.
+void print_range(Shell *sh, char *args, RangeMode mode)
+{
+    static const char *names[] = {"head", "tail", "peek"};
+    char *filename = strtok(args, " ");
+    char *first = strtok(NULL, " ");
+    char *second = strtok(NULL, " ");
+    unsigned long offset = 0, length = RANGE_BYTES;
+    bool valid = filename != NULL;
+    if (mode == RANGE_PEEK)
+        valid = valid && parse_number(first, &offset) && parse_number(second, &length);
+    else if (first != NULL)
+        valid = valid && parse_number(first, &length);
+    if (!valid)
     {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors +
-                      bs.root_dir_entries * 32 / bs.sector_size +
-                      (current_cluster - 2) * bs.sectors_per_cluster) *
-                     bs.sector_size;
+        if (mode == RANGE_PEEK)
+            shell_error(sh, "Usage: peek <file> <offset> <length>");
+        else
+            shell_error(sh, "Usage: %s <file> [bytes]", names[mode]);
+        return;
     }
-    fseek(in, dir_offset, SEEK_SET);
-
-    // Find file in directory
-    for (int i = 0; i < bs.root_dir_entries; i++) {
-        fread(&entry, sizeof(entry), 1, in);
-
-        if (entry.filename[0] == 0x00) break;
-        if (entry.filename[0] == 0xE5) continue;
-        if ((entry.attributes & 0x10) || (entry.attributes & 0x08)) continue;
 
-        char formatted_name[13];
-        format_filename(entry.filename, entry.ext, formatted_name);
+    FatFile *file = open_file(sh, filename);
+    if (file == NULL)
+        return;
+    FatDirent entry;
+    fat_file_info(file, &entry);
 
-        if (strcmp(formatted_name, upper_filename) == 0) {
-            found = true;
-            break;
-        }
+    if (mode != RANGE_PEEK)
+    {
+        if (length > entry.size)
+            length = entry.size;
+        if (mode == RANGE_TAIL)
+            offset = entry.size - length;
     }
 
-    if (!found)
+    unsigned char buffer[RANGE_CHUNK];
+    unsigned long done = 0;
+    long n = 0;
+    while (done < length)
     {
-        printf("Error: File not found\n");
-        return -1;
+        n = fat_read(file, buffer, length - done < RANGE_CHUNK ? length - done : RANGE_CHUNK, offset + done);
+        if (n <= 0)
+            break;
+        if (mode == RANGE_PEEK)
+            hex_dump(buffer, n, offset + done);
+        else
+            fwrite(buffer, 1, n, stdout);
+        done += n;
     }
+    fat_close(file);
+    if (mode != RANGE_PEEK)
+        printf("\n");
+    sh->bytes = done;
 
-    if (fat_table == NULL)
-        load_fat();
-
-    // Calculation of data starting point
-    unsigned int data_start = pt[0].start_sector + bs.reserved_sectors +
-                              (bs.number_of_fats * bs.fat_size_sectors) +
-                              ((bs.root_dir_entries * 32) + bs.sector_size - 1) / bs.sector_size;
-
-    // Make buffer for one cluster
-    unsigned char buffer[bs.sector_size * bs.sectors_per_cluster];
+    if (n < 0)
+        shell_error(sh, "Could not read file data");
+    else if (mode == RANGE_PEEK && done < length)
+        printf("%lu of %lu bytes, %s is %u bytes long\n", done, length, filename, entry.size);
+}
 
-    // Read file cluster by cluster
-    unsigned short cluster = entry.starting_cluster;
-    unsigned int total_bytes_read = 0;
+// Extract a file to the host without showing its contents
+int get(Shell *sh, const char *filename, const char *dest)
+{
+    FatFile *file = open_file(sh, filename);
+    if (file == NULL)
+        return -1;
 
-    // Open output file
-    char output_filename[256];
-    sprintf(output_filename, "output_%s", filename);
-    FILE *output_file = fopen(output_filename, "wb");
+    FILE *output_file = fopen(dest, "wb");
     if (output_file == NULL)
     {
-        printf("Error: Could not open output file %s\n", output_filename);
+        shell_error(sh, "Could not open output file %s", dest);
+        fat_close(file);
         return -1;
     }
 
-    printf("Reading %s (%u bytes)...\n", filename, entry.file_size);
-
-    while (cluster >= 0x0002 && cluster < 0xFFF0 && total_bytes_read < entry.file_size)
-    {
-        fseek(in, (data_start + (cluster - 2) * bs.sectors_per_cluster) * bs.sector_size, SEEK_SET);
-
-        unsigned int bytes_to_read = bs.sector_size * bs.sectors_per_cluster;
-        if (entry.file_size - total_bytes_read < bytes_to_read)
-            bytes_to_read = entry.file_size - total_bytes_read;
+    static const char *method_names[] = {"copy_file_range", "sendfile", "buffered copy"};
+    FatCopyMethod method;
+    unsigned long copied = 0;
+    double started = now_ms();
+    int status = fat_copy_out(file, output_file, &copied, &method);
+    double elapsed = now_ms() - started;
+    int extent_count = fat_file_extents(file);
 
-        size_t bytes_actually_read = fread(buffer, 1, bytes_to_read, in);
-        if (bytes_actually_read != bytes_to_read)
-        {
-            printf("Error: Could not read file data\n");
-            fclose(output_file);
-            return -1;
-        }
-        fwrite(buffer, 1, bytes_actually_read, output_file);
+    fat_close(file);
+    fclose(output_file);
 
-        total_bytes_read += bytes_actually_read;
+    if (status != FAT_OK)
+    {
+        shell_error(sh, "Could not extract %s", filename);
+        return -1;
+    }
+    sh->bytes = copied;
+    printf("Saved %s to %s (%lu bytes, %d extent(s), %s, %.3f ms)\n",
+           filename, dest, copied, extent_count, method_names[method], elapsed);
+    return 0;
+}
 
-        if (strstr(filename, ".JPG") || strstr(filename, ".jpg"))
-        {
-            printf(".");
-        }
-        else
-        {
-            printf("%.*s", (int)bytes_actually_read, buffer);
-        }
+// One line on how a file was laid out: in one piece, or how many pieces and the largest
+void report_fragmentation(const FatWriteReport *report)
+{
+    if (report->extents == 1)
+        printf("Allocated %u cluster(s) contiguously at cluster %u\n", report->clusters, report->first_cluster);
+    else if (report->extents > 1)
+        printf("Allocated %u cluster(s) in %d extents, largest %u cluster(s) (%.1f%% of the file)\n",
+               report->clusters, report->extents, report->largest_extent,
+               100.0 * report->largest_extent / report->clusters);
+}
 
-        cluster = ((unsigned short *)fat_table)[cluster];
+// Copy a host file into the current directory under its own name
+void write_file(Shell *sh, const char *filename)
+{
+    FILE *file_to_write = fopen(filename, "rb");
+    if (file_to_write == NULL) {
+        shell_error(sh, "Could not open file %s", filename);
+        return;
     }
 
-    fclose(output_file);
-    printf("\nFile saved to %s\n", output_filename);
-    printf("Total bytes read: %u\n", total_bytes_read);
+    FatWriteReport report;
+    double started = now_ms();
+    int status = fat_write(sh->vol, sh->cwd, base_name(filename), file_to_write, &report);
+    double elapsed = now_ms() - started;
+    fclose(file_to_write);
 
-    return 0;
+    if (status != FAT_OK) {
+        shell_error(sh, "Could not create %s: %s", base_name(filename), fat_strerror(status));
+        return;
+    }
+    report_fragmentation(&report);
+    report_transfer(sh, report.bytes, elapsed);
+    printf("File created successfully\n");
 }
 
-void write(char* filename){
-    Fat16Entry new_entry;
-    memset(&new_entry, 0, sizeof(Fat16Entry));
-    
-    char base[9], ext[4];
-    memset(base, ' ', 8);
-    memset(ext, ' ', 3);
-    char* dot = strrchr(filename, '.');
-    if (dot) {
-        strncpy(base, filename, (dot - filename > 8) ? 8 : (dot - filename));
-        strncpy(ext, dot + 1, 3);
-    } else {
-        strncpy(base, filename, 8);
-    }
-    printf("Base: %s, Ext: %s\n", base, ext);
-    for(int i = 0; i < 8; i++) {
-        new_entry.filename[i] = toupper(base[i]);
+// Add a host file to the end of a file in the image
+void append_file(Shell *sh, char *args)
+{
+    char *hostfile = strtok(args, " ");
+    char *filename = strtok(NULL, " ");
+    if (hostfile == NULL || filename == NULL) {
+        shell_error(sh, "Usage: append <hostfile> <file>");
+        return;
     }
-    for(int i = 0; i < 3; i++) {
-        new_entry.ext[i] = toupper(ext[i]);
+    FILE *source = fopen(hostfile, "rb");
+    if (source == NULL) {
+        shell_error(sh, "Could not open file %s", hostfile);
+        return;
     }
 
-    printf("Filename: %.8s.%.3s\n", new_entry.filename, new_entry.ext);
+    FatWriteReport report;
+    double started = now_ms();
+    int status = fat_append(sh->vol, sh->cwd, filename, source, &report);
+    double elapsed = now_ms() - started;
+    fclose(source);
 
-    if(fat_table == NULL) {
-        load_fat();
+    if (status == FAT_ERR_NOT_FOUND || status == FAT_ERR_IS_DIR) {
+        shell_error(sh, "File not found");
+        return;
+    }
+    if (status != FAT_OK) {
+        shell_error(sh, "Could not append to %s: %s", filename, fat_strerror(status));
+        return;
     }
+    report_fragmentation(&report);
+    report_transfer(sh, report.bytes, elapsed);
+    printf("Appended %s to %s\n", hostfile, filename);
+}
 
-    short current_cluster = 0xFFFF;
+void truncate_file(Shell *sh, char *args)
+{
+    char *filename = strtok(args, " ");
+    unsigned long size;
+    if (filename == NULL || !parse_number(strtok(NULL, " "), &size)) {
+        shell_error(sh, "Usage: truncate <file> <size>");
+        return;
+    }
+    if (size > 0xFFFFFFFFUL) {
+        shell_error(sh, "%lu bytes is more than a FAT file can hold", size);
+        return;
+    }
 
-    for(unsigned short cluster = 2; cluster < (bs.fat_size_sectors * bs.sector_size / 2); cluster++) {
-        if (((unsigned short*)fat_table)[cluster] == 0) {
-            current_cluster = cluster;
-            ((unsigned short*)fat_table)[current_cluster] = 0xFFFF;
-            printf("Found starting cluster %d\n", current_cluster);
-            break;
-        }
+    int status = fat_truncate(sh->vol, sh->cwd, filename, size);
+    if (status == FAT_ERR_NOT_FOUND || status == FAT_ERR_IS_DIR) {
+        shell_error(sh, "File not found");
+        return;
     }
+    if (status != FAT_OK) {
+        shell_error(sh, "Could not truncate %s: %s", filename, fat_strerror(status));
+        return;
+    }
+    printf("File %s is now %lu bytes\n", filename, size);
+}
 
-    FILE* file_to_write = fopen(filename, "rb+");
-    if(file_to_write == NULL) {
-        printf("Error: Could not open file %s\n", filename);
+void delete_file(Shell *sh, const char *filename)
+{
+    int status = fat_unlink(sh->vol, sh->cwd, filename);
+    if (status == FAT_ERR_NOT_FOUND || status == FAT_ERR_IS_DIR) {
+        shell_error(sh, "File not found");
         return;
     }
-    fseek(file_to_write, 0, SEEK_END);
-    long file_size = ftell(file_to_write);
-    fseek(file_to_write, 0, SEEK_SET);
+    if (status != FAT_OK) {
+        shell_error(sh, "Could not delete %s: %s", filename, fat_strerror(status));
+        return;
+    }
+    printf("File %s deleted successfully\n", filename);
+}
 
-    new_entry.attributes = 0x20;
-    new_entry.file_size = file_size;
-    new_entry.starting_cluster = current_cluster;
+void print_moved(void *ctx, const char *name, int old_extents, int new_extents, unsigned int clusters,
+                 unsigned int start)
+{
+    (void)ctx;
+    printf("%-12s %6d -> %d extent(s), %u cluster(s) at %u\n", name, old_extents, new_extents, clusters, start);
+}
 
-    //TODO - set current time and date
-    new_entry.modify_time = 0;
-    new_entry.modify_date = 0;
+// defrag [-n] [path]: relocate fragmented files of the current directory,
+// or of path (a file or a directory), into contiguous free runs. With -n
+// only report what would move.
+void defrag(Shell *sh, const char *args)
+{
+    bool dry_run = false;
+
+    while (*args == ' ')
+        args++;
+    if (strncmp(args, "-n", 2) == 0 && (args[2] == '\0' || args[2] == ' ')) {
+        dry_run = true;
+        args += 2;
+        while (*args == ' ')
+            args++;
+    }
 
-    unsigned int dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-        bs.number_of_fats * bs.fat_size_sectors) * bs.sector_size;
+    FatDefragReport report;
+    double started = now_ms();
+    int status = fat_defrag(sh->vol, sh->cwd, args, dry_run, print_moved, NULL, &report);
+    double elapsed = now_ms() - started;
+    if (status != FAT_OK) {
+        shell_error(sh, "Defrag of %s stopped: %s", *args ? args : sh->path, fat_strerror(status));
+        if (report.files == 0)
+            return;
+    }
 
-    Fat16Entry temp_entry;
-    bool entry_written = false;
-    for(int i = 0; i < bs.root_dir_entries; i++) {
-        fseek(in, dir_offset + i * sizeof(Fat16Entry), SEEK_SET);
-        fread(&temp_entry, sizeof(Fat16Entry), 1, in);
+    shell_count(sh, "moved", report.moved);
+    printf("%u of %d file(s) fragmented, %u %s, %lu cluster(s)%s\n", report.fragmented, report.files, report.moved,
+           dry_run ? "could be moved" : "moved", report.clusters_moved, dry_run ? " (dry run)" : "");
+    printf("Read extents %s from %lu to %lu in %.3f ms\n", dry_run ? "would drop" : "dropped",
+           report.extents_before, report.extents_after, elapsed);
+}
 
-        if(temp_entry.filename[0] == 0x00 || temp_entry.filename[0] == 0xE5) {
-            fseek(in, dir_offset + i * sizeof(Fat16Entry), SEEK_SET);
-            fwrite(&new_entry, sizeof(Fat16Entry), 1, in);
-            entry_written = true;
-            printf("File created successfully\n");
-            break;
-        }
+void print_problem(void *ctx, const FatCheckProblem *problem)
+{
+    (void)ctx;
+    const char *what = problem->path != NULL ? problem->path : "FAT";
+    switch (problem->kind) {
+    case FAT_PROBLEM_CROSS_LINKED:
+        printf("%s: cross-linked at cluster %u after %lu cluster(s)", what, problem->cluster, problem->found);
+        break;
+    case FAT_PROBLEM_BROKEN_CHAIN:
+        printf("%s: chain broken at cluster %u after %lu cluster(s)", what, problem->cluster, problem->found);
+        break;
+    case FAT_PROBLEM_CHAIN_LONGER:
+    case FAT_PROBLEM_CHAIN_SHORTER:
+        printf("%s: chain of %lu cluster(s), size needs %lu", what, problem->found, problem->expected);
+        break;
+    case FAT_PROBLEM_LOST_CLUSTERS:
+        printf("%lu lost cluster(s), first at %u", problem->found, problem->cluster);
+        break;
+    case FAT_PROBLEM_FAT_MISMATCH:
+        printf("FAT copy %u differs from the first in %lu sector(s)", problem->cluster + 1, problem->found);
+        break;
     }
+    printf("%s\n", problem->repaired ? ", repaired" : "");
+}
 
-    if (!entry_written) {
-        printf("Error: No free directory entries\n");
-        fclose(file_to_write);
+// check [-r]: check the whole volume, -r also repairs what it finds
+void check(Shell *sh, const char *args)
+{
+    while (*args == ' ')
+        args++;
+    bool repair = strcmp(args, "-r") == 0;
+    if (*args != '\0' && !repair) {
+        shell_error(sh, "Usage: check [-r]");
         return;
     }
 
-    unsigned char buffer[bs.sector_size * bs.sectors_per_cluster];
-    unsigned int bytes_written = 0;
-
-    unsigned int data_start = pt[0].start_sector + bs.reserved_sectors +
-                              (bs.number_of_fats * bs.fat_size_sectors) +
-                              ((bs.root_dir_entries * 32) + bs.sector_size - 1) / bs.sector_size;
-
-    size_t bytes_read;
-    printf("Writing %ld bytes in chunks of %d bytes\n", file_size, bs.sector_size * bs.sectors_per_cluster);
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file_to_write)) > 0) {
-        // Write current chunk
-        fseek(in, (data_start + (current_cluster - 2) * bs.sectors_per_cluster) * bs.sector_size, SEEK_SET);
-        fwrite(buffer, 1, bytes_read, in);
-        bytes_written += bytes_read;
-
-        if (bytes_written < file_size) {
-            unsigned short next_cluster = 0xFFFF;
-            for(unsigned short cluster = 2; cluster < (bs.fat_size_sectors * bs.sector_size / 2); cluster++) {
-                if (((unsigned short*)fat_table)[cluster] == 0) {
-                    next_cluster = cluster;
-                    ((unsigned short*)fat_table)[current_cluster] = next_cluster;
-                    ((unsigned short*)fat_table)[next_cluster] = 0xFFFF;
-                    current_cluster = next_cluster;
-                    break;
-                }
-            }
-        } else {
-            ((unsigned short*)fat_table)[current_cluster] = 0xFFFF;
-        }
+    FatCheckReport report;
+    double started = now_ms();
+    int status = fat_check(sh->vol, repair, print_problem, NULL, &report);
+    double elapsed = now_ms() - started;
+    if (status != FAT_OK) {
+        shell_error(sh, "Check stopped: %s", fat_strerror(status));
+        return;
     }
 
-    unsigned int fat_offset = (pt[0].start_sector + bs.reserved_sectors) * bs.sector_size;
-    for(int i = 0; i < bs.number_of_fats; i++) {
-        fseek(in, fat_offset + i * bs.fat_size_sectors * bs.sector_size, SEEK_SET);
-        fwrite(fat_table, bs.fat_size_sectors * bs.sector_size, 1, in);
-    }
+    printf("%lu file(s), %lu directories, %lu cluster(s) in use, %lu free, %u FAT copies, %.3f ms\n",
+           report.files, report.dirs, report.clusters, report.free_clusters, report.fat_copies, elapsed);
+    shell_count(sh, "problems", report.problems);
+    if (report.problems == 0)
+        printf("No problems found\n");
+    else
+        printf("%lu problem(s) found%s\n", report.problems, repair ? ", all repaired" : ", run check -r to repair");
+}
 
-    if(bytes_written != file_size) {
-        printf("Error: Not all bytes written\n");
-        fclose(file_to_write);
+// import <hostdir>: copy every regular file of a host directory into the
+// current directory
+void import(Shell *sh, const char *hostdir)
+{
+    FatImportReport report;
+    double started = now_ms();
+    int status = fat_import(sh->vol, sh->cwd, hostdir, &report);
+    double elapsed = now_ms() - started;
+
+    if (report.bad_names > 0)
+        printf("Skipping %d file(s) without an 8.3 name\n", report.bad_names);
+    if (report.too_large > 0)
+        printf("Skipping %d file(s) too large for FAT (4 GiB or more)\n", report.too_large);
+    if (status == FAT_ERR_NOT_FOUND) {
+        shell_error(sh, "Could not open host directory %s", hostdir);
+        return;
+    }
+    if (status == FAT_ERR_DIR_FULL)
+        shell_error(sh, "No free directory entries for %d more file(s)", report.not_placed);
+    else if (status == FAT_ERR_NO_SPACE)
+        shell_error(sh, "No free clusters for %d more file(s)", report.not_placed);
+    else if (status != FAT_OK) {
+        shell_error(sh, "Could not import %s: %s", hostdir, fat_strerror(status));
         return;
     }
 
-    fclose(file_to_write);
-    printf("File created successfully\n");
+    if (report.files == 0 && report.existing == 0 && report.not_placed == 0) {
+        printf("Nothing to import from %s\n", hostdir);
+        return;
+    }
+    if (report.existing > 0)
+        printf("Skipped %d file(s) whose names already exist\n", report.existing);
+    shell_count(sh, "files", report.files);
+    printf("Imported %d file(s) into %d extent(s), %d of them fragmented\n", report.files, report.extents,
+           report.fragmented);
+    report_transfer(sh, report.bytes, elapsed);
 }
 
-void delete(char* filename) {
-    if (fat_table == NULL) {
-        load_fat();
+// extract <dir> <hostdir>: copy a directory tree to the host
+void extract(Shell *sh, char *args)
+{
+    char *dir = strtok(args, " ");
+    char *hostdir = strtok(NULL, " ");
+    if (dir == NULL || hostdir == NULL) {
+        shell_error(sh, "Usage: extract <dir> <hostdir>");
+        return;
     }
-    Fat16Entry entry;
-    char search_name[9], search_ext[4];
-    bool found = false;
-    unsigned int entry_offset = 0; 
 
-    // Parse filename into base and extension (convert to uppercase)
-    memset(search_name, ' ', 8);
-    memset(search_ext, ' ', 3);
-    search_name[8] = search_ext[3] = '\0';
+    FatDirent entry;
+    int status = fat_lookup(sh->vol, sh->cwd, dir, &entry);
+    if (status != FAT_OK) {
+        shell_error(sh, "%s: %s", dir, fat_strerror(status));
+        return;
+    }
+    if (!entry.is_dir) {
+        shell_error(sh, "%s is not a directory, use get for single files", dir);
+        return;
+    }
 
-   char upper_filename[256];
-    strncpy(upper_filename, filename, sizeof(upper_filename)-1);
-    upper_filename[sizeof(upper_filename)-1] = '\0';
-    for(int i = 0; upper_filename[i]; i++) {
-        upper_filename[i] = toupper(upper_filename[i]);
+    FatExtractReport report;
+    double started = now_ms();
+    status = fat_extract(sh->vol, entry.cluster, hostdir, &report);
+    double elapsed = now_ms() - started;
+    if (status == FAT_ERR_NO_MEMORY) {
+        shell_error(sh, "Could not walk directory tree");
+        return;
     }
+    if (status != FAT_OK)
+        shell_error(sh, "%lu file(s) or dir(s) could not be extracted", report.errors);
+
+    shell_count(sh, "files", report.files);
+    sh->bytes = report.bytes;
+    printf("Extracted %lu file(s) in %lu dir(s) to %s with %d threads\n", report.files, report.dirs, hostdir,
+           report.threads);
+    printf("Transferred %lu bytes in %.3f ms (%.1f MB/s)\n", report.bytes, elapsed,
+           elapsed > 0 ? report.bytes / elapsed / 1000.0 : 0.0);
+}
 
-    // Seek to root directory
-    unsigned int dir_offset;
-    if (current_cluster == 0)
+// Run one command line. Returns 1 for exit, otherwise 0; whether the
+// command worked is left in sh->failed.
+int run_command(Shell *sh, char *input)
+{
+    sh->failed = false;
+    sh->error[0] = '\0';
+    sh->bytes = -1;
+    sh->count_name = NULL;
+
+    if (strncmp(input, "ls", 2) == 0)
     {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors) *
-                     bs.sector_size;
+        print_directory(sh);
+    }
+    else if (strncmp(input, "exit", 4) == 0)
+    {
+        return 1;
+    }
+    else if (strncmp(input, "cd ", 3) == 0)
+    {
+        if (strcmp(input + 3, "..") == 0)
+        {
+            printf("Moving up to parent directory\n");
+            change_dir(sh, "..");
+        }
+        else if (strcmp(input + 3, ".") == 0)
+        {
+            printf("Staying in current directory\n");
+        }
+        else
+        {
+            printf("Changing directory to %s\n", input + 3);
+            change_dir(sh, input + 3);
+        }
+    }
+    else if (strncmp(input, "read ", 5) == 0)
+    {
+        read_file(sh, input + 5);
+    }
+    else if (strncmp(input, "cat ", 4) == 0)
+    {
+        cat(sh, input + 4);
+    }
+    else if (strncmp(input, "head ", 5) == 0)
+    {
+        print_range(sh, input + 5, RANGE_HEAD);
+    }
+    else if (strncmp(input, "tail ", 5) == 0)
+    {
+        print_range(sh, input + 5, RANGE_TAIL);
+    }
+    else if (strncmp(input, "peek ", 5) == 0)
+    {
+        print_range(sh, input + 5, RANGE_PEEK);
+    }
+    else if (strncmp(input, "get ", 4) == 0)
+    {
+        char *name = input + 4;
+        char *dest = strchr(name, ' ');
+        if (dest != NULL)
+        {
+            *dest++ = '\0';
+            while (*dest == ' ')
+                dest++;
+        }
+        get(sh, name, dest != NULL && *dest ? dest : base_name(name));
+    }
+    else if(strncmp(input, "write ", 6) == 0)
+    {
+        printf("Creating file %s\n", input + 6);
+        write_file(sh, input + 6);
+    }
+    else if (strncmp(input, "append ", 7) == 0)
+    {
+        append_file(sh, input + 7);
+    }
+    else if (strncmp(input, "truncate ", 9) == 0)
+    {
+        truncate_file(sh, input + 9);
+    }
+    else if (strncmp(input, "del ", 4) == 0)
+    {
+        printf("Deleting file %s\n", input + 4);
+        delete_file(sh, input + 4);
+    }
+    else if (strncmp(input, "import ", 7) == 0)
+    {
+        import(sh, input + 7);
+    }
+    else if (strncmp(input, "extract ", 8) == 0)
+    {
+        extract(sh, input + 8);
+    }
+    else if (strncmp(input, "defrag", 6) == 0 && (input[6] == '\0' || input[6] == ' '))
+    {
+        defrag(sh, input + 6);
+    }
+    else if (strncmp(input, "check", 5) == 0 && (input[5] == '\0' || input[5] == ' '))
+    {
+        check(sh, input + 5);
+    }
+    else if (strncmp(input, "help", 4) == 0)
+    {
+        printf("Available commands:\n");
+        printf("  ls           - List directory contents\n");
+        printf("  cd <dir>     - Change directory\n");
+        printf("  read <file>  - Save a file to output_<file>\n");
+        printf("  get <file> [dest] - Extract a file to the host\n");
+        printf("  cat <file>   - Print file contents\n");
+        printf("  head <file> [bytes] - Print the start of a file (512 bytes)\n");
+        printf("  tail <file> [bytes] - Print the end of a file (512 bytes)\n");
+        printf("  peek <file> <offset> <length> - Hex dump of any part of a file\n");
+        printf("  extract <dir> <hostdir> - Copy a directory tree to the host\n");
+        printf("  help         - Show this help message\n");
+        printf("  tree         - Show directory tree\n");
+        printf("  du           - Show per-directory usage totals\n");
+        printf("  write <file> - Create a new file\n");
+        printf("  import <hostdir> - Copy the files of a host directory here\n");
+        printf("  append <hostfile> <file> - Add a host file to the end of a file\n");
+        printf("  truncate <file> <size> - Cut a file to size bytes, or grow it with zeros\n");
+        printf("  del <file>   - Delete a file\n");
+        printf("  defrag [-n] [path] - Move fragmented files into contiguous runs, -n only reports\n");
+        printf("  check [-r]   - Check the volume for damaged chains and lost clusters, -r repairs\n");
+        printf("  cache [size <bytes>|flush] - Show block cache statistics\n");
+        printf("  io [sync|uring [depth]] - Select the bulk data I/O engine\n");
+        printf("  stats [reset|json] - Show per-command I/O counters and latencies\n");
+        printf("  exit         - Exit program\n");
+    }
+    else if (strncmp(input, "cache", 5) == 0)
+    {
+        if (strncmp(input, "cache size ", 11) == 0)
+        {
+            fat_cache_set_budget(sh->vol, strtoul(input + 11, NULL, 10));
+        }
+        else if (strcmp(input, "cache flush") == 0)
+        {
+            if (fat_flush(sh->vol) != FAT_OK)
+                shell_error(sh, "Could not write back cached blocks");
+        }
+        FatCacheInfo cache;
+        fat_cache_info(sh->vol, &cache);
+        printf("Cache: %lu/%lu bytes in %lu blocks\n", cache.used, cache.budget, cache.blocks);
+        printf("  hits %lu, misses %lu, evictions %lu, write-backs %lu\n",
+               cache.hits, cache.misses, cache.evictions, cache.writebacks);
+    }
+    else if (strncmp(input, "io", 2) == 0 && (input[2] == '\0' || input[2] == ' '))
+    {
+        if (strncmp(input, "io uring", 8) == 0)
+        {
+            unsigned int depth = input[8] == ' ' ? strtoul(input + 9, NULL, 10) : 0;
+            if (fat_use_uring(sh->vol, depth) != FAT_OK)
+                shell_error(sh, "io_uring is not available, staying synchronous");
+        }
+        else if (strcmp(input, "io sync") == 0)
+        {
+            fat_use_sync(sh->vol);
+        }
+        FatIoInfo io;
+        fat_io_info(sh->vol, &io);
+        if (io.uring)
+            printf("I/O engine: io_uring, queue depth %u, %u byte chunks\n", io.depth, io.chunk_size);
+        else
+            printf("I/O engine: synchronous\n");
+    }
+    else if (strcmp(input, "du") == 0)
+    {
+        print_du(sh);
+    }
+    else if(strncmp(input, "tree", 4) == 0)
+    {
+        print_tree(sh, 0, 1);
+    }
+    else if (strncmp(input, "stats", 5) == 0)
+    {
+        if (strcmp(input, "stats reset") == 0)
+            stats_reset();
+        else if (strcmp(input, "stats json") == 0)
+            stats_json(stdout);
+        else
+            stats_print(stdout);
     }
     else
     {
-        dir_offset = (pt[0].start_sector + bs.reserved_sectors +
-                      bs.number_of_fats * bs.fat_size_sectors +
-                      bs.root_dir_entries * 32 / bs.sector_size +
-                      (current_cluster - 2) * bs.sectors_per_cluster) *
-                     bs.sector_size;
+        shell_error(sh, "Unknown command: %s", input);
+        stats_cancel();
     }
-    fseek(in, dir_offset, SEEK_SET);
-
-    for (int i = 0; i < bs.root_dir_entries; i++) {
-        entry_offset = dir_offset + i * sizeof(Fat16Entry);
-        fseek(in, entry_offset, SEEK_SET);
-        fread(&entry, sizeof(entry), 1, in);
-
-        if (entry.filename[0] == 0x00) break;
-        if (entry.filename[0] == 0xE5) continue;
-        if ((entry.attributes & 0x10) || (entry.attributes & 0x08)) continue;
-
-        char formatted_name[13];
-        format_filename(entry.filename, entry.ext, formatted_name);
+    return 0;
+}
 
-        if (strcmp(formatted_name, upper_filename) == 0) {
-            found = true;
-            break;
-        }
+// A string as a JSON value, quotes, backslashes and control characters escaped
+void json_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            fprintf(out, "\\%c", *c);
+        else if (*c < 0x20)
+            fprintf(out, "\\u%04x", *c);
+        else
+            fputc(*c, out);
     }
+    fputc('"', out);
+}
 
-    if (!found)
+// Run one command of a batch and write its JSON line
+bool batch_command(Shell *sh, char *input, int line, FILE *json)
+{
+    char command[COMMAND_MAX];
+    strcpy(command, input);
+    double started = now_ms();
+    stats_begin(input);
+    int done = run_command(sh, input);
+    stats_end();
+    double elapsed = now_ms() - started;
+    fflush(stdout);
+
+    fprintf(json, "{\"line\":%d,\"command\":", line);
+    json_string(json, command);
+    fprintf(json, ",\"ok\":%s,\"ms\":%.3f,\"cwd\":", sh->failed ? "false" : "true", elapsed);
+    json_string(json, sh->path);
+    if (sh->bytes >= 0)
+        fprintf(json, ",\"bytes\":%ld", sh->bytes);
+    if (sh->count_name != NULL)
+        fprintf(json, ",\"%s\":%lu", sh->count_name, sh->count);
+    if (sh->failed)
     {
-        printf("Error: File not found\n");
-        return;
+        fprintf(json, ",\"error\":");
+        json_string(json, sh->error);
     }
+    fprintf(json, "}\n");
+    fflush(json);
+    return done == 1;
+}
 
-    // // Mark file as deleted in directory
-    fseek(in, entry_offset, SEEK_SET);
-    unsigned char deleted = 0xE5;
-    fwrite(&deleted, 1, 1, in);
+// Batch mode: the -c commands, then the script (blank lines and # comments
+// skipped), one JSON line each and a summary line at the end. Returns the
+// exit status.
+int run_batch(Shell *sh, char **commands, int command_count, FILE *script, bool stop_on_error, FILE *json)
+{
+    char input[COMMAND_MAX];
+    int line = 0, run = 0, failed = 0;
+    bool done = false;
+    double started = now_ms();
 
-    unsigned short cluster = entry.starting_cluster;
-    while(cluster >= 0x0002 && cluster < 0xFFF0) {
-        unsigned short next_cluster = ((unsigned short*)fat_table)[cluster];
-        ((unsigned short*)fat_table)[cluster] = 0x0000;  // Mark as free
-        cluster = next_cluster;
+    for (int c = 0; c < command_count && !done; c++)
+    {
+        snprintf(input, sizeof(input), "%s", commands[c]);
+        done = batch_command(sh, input, ++line, json);
+        run++;
+        failed += sh->failed;
+        done |= sh->failed && stop_on_error;
     }
-
-    unsigned int fat_offset = (pt[0].start_sector + bs.reserved_sectors) * bs.sector_size;
-    for(int i = 0; i < bs.number_of_fats; i++) {
-        fseek(in, fat_offset + i * bs.fat_size_sectors * bs.sector_size, SEEK_SET);
-        fwrite(fat_table, bs.fat_size_sectors * bs.sector_size, 1, in);
+    while (script != NULL && !done && fgets(input, sizeof(input), script) != NULL)
+    {
+        line++;
+        input[strcspn(input, "\r\n")] = 0;
+        if (input[strspn(input, " \t")] == '\0' || input[strspn(input, " \t")] == '#')
+            continue;
+        done = batch_command(sh, input, line, json);
+        run++;
+        failed += sh->failed;
+        done |= sh->failed && stop_on_error;
     }
 
-    printf("File %s deleted successfully\n", filename);
+    fprintf(json, "{\"commands\":%d,\"failed\":%d,\"ms\":%.3f}\n", run, failed, now_ms() - started);
+    fflush(json);
+    return failed > 0 ? EXIT_COMMAND_FAILED : EXIT_OK;
+}
+
+void usage()
+{
+    fprintf(stderr, "usage: fat [-v] [-i image] [-j stats.json] [file]\n");
+    fprintf(stderr, "       fat [-i image] [-j stats.json] [-q] [-e] [-b script] [-c command]...\n");
 }
 
 int main(int argc, char **argv)
 {
-    in = fopen("sd.img", "rb+");
     int i;
-
-    // PartitionTable pt[4];
-    // //Fat16BootSector bs;
-    Fat16Entry entry;
-
-    fseek(in, 0x1BE, SEEK_SET);               // go to partition table start, partitions start at offset 0x1BE, see http://www.cse.scu.edu/~tschwarz/coen252_07Fall/Lectures/HDPartitions.html
-    fread(pt, sizeof(PartitionTable), 4, in); // read all entries (4)
-
-    printf("Partition table\n-----------------------\n");
-    for (i = 0; i < 4; i++){ // for all partition entries print basic info
-        printf("Partition %d, type %02X, ", i, pt[i].partition_type);
-        printf("start sector %8d, length %8d sectors\n", pt[i].start_sector, pt[i].length_sectors);
+    const char *image_path = "sd.img";
+    const char *stats_path = NULL;
+    const char *script_path = NULL;
+    bool verbose = false, quiet = false, stop_on_error = false;
+    char **commands = calloc(argc, sizeof(char *));
+    int command_count = 0;
+    int arg = 1;
+
+    // fat [-v] [-i image] [-j stats.json] [file], or in batch mode
+    // fat [-i image] [-j stats.json] [-q] [-e] [-b script] [-c command]...
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-v") == 0)
+            verbose = true;
+        else if (strcmp(argv[arg], "-q") == 0)
+            quiet = true;
+        else if (strcmp(argv[arg], "-e") == 0)
+            stop_on_error = true;
+        else if (strcmp(argv[arg], "-i") == 0 && arg + 1 < argc)
+            image_path = argv[++arg];
+        else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+            stats_path = argv[++arg];
+        else if (strcmp(argv[arg], "-b") == 0 && arg + 1 < argc)
+            script_path = argv[++arg];
+        else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc && commands != NULL)
+            commands[command_count++] = argv[++arg];
+        else
+        {
+            usage();
+            return EXIT_USAGE;
+        }
+        arg++;
     }
 
-    printf("\nSeeking to first partition by %d sectors\n", pt[0].start_sector);
-    fseek(in, 512 * pt[0].start_sector, SEEK_SET); // Boot sector starts here (seek in bytes)
-    fread(&bs, sizeof(Fat16BootSector), 1, in);    // Read boot sector content, see http://www.tavi.co.uk/phobos/fat.html#boot_block
-    printf("Volume_label %.11s, %d sectors size\n", bs.volume_label, bs.sector_size);
+    Shell sh = {.vol = NULL, .cwd = 0, .path = "Groot", .batch = script_path != NULL || command_count > 0};
 
-    // Seek to the beginning of root directory, it's position is fixed
-    fseek(in, (bs.reserved_sectors - 1 + bs.fat_size_sectors * bs.number_of_fats) * bs.sector_size, SEEK_CUR);
-
-    // Read all entries of root directory
-    printf("\nFilesystem root directory listing\n-----------------------\n");
-    for (i = 0; i < bs.root_dir_entries; i++){
-        fread(&entry, sizeof(entry), 1, in);
-        // Skip if filename was never used, see http://www.tavi.co.uk/phobos/fat.html#file_attributes
-        if (entry.filename[0] != 0x00)
+    // Batch results own stdout. Everything the commands print for people
+    // goes to stderr instead, or nowhere with -q.
+    FILE *json = stdout;
+    FILE *script = NULL;
+    if (sh.batch)
+    {
+        if (script_path != NULL && (script = strcmp(script_path, "-") == 0 ? stdin : fopen(script_path, "r")) == NULL)
+        {
+            fprintf(stderr, "Error: Could not open script %s\n", script_path);
+            return EXIT_USAGE;
+        }
+        int chatter = quiet ? open("/dev/null", O_WRONLY) : dup(STDERR_FILENO);
+        json = fdopen(dup(STDOUT_FILENO), "w");
+        if (chatter < 0 || json == NULL || dup2(chatter, STDOUT_FILENO) < 0)
         {
-            printf("%.8s.%.3s attributes 0x%02X starting cluster %8d len %8d B\n", entry.filename, entry.ext, entry.attributes, entry.starting_cluster, entry.file_size);
-            print_directory();
+            fprintf(stderr, "Error: Could not set up batch output\n");
+            return EXIT_USAGE;
         }
+        close(chatter);
     }
 
-    if (argc == 2)
+    stats_begin("startup");
+
+    int status = fat_mount(image_path, FAT_MOUNT_READ_WRITE, &sh.vol);
+    if (status != FAT_OK)
     {
-        printf("\nReading %s:\n-----------------------\n", argv[1]);
-        if (read(argv[1]) == -1)
+        printf("Error: Could not open image %s: %s\n", image_path, fat_strerror(status));
+        if (sh.batch)
         {
-            printf("Error: File not found or couldn't be read\n");
+            fprintf(json, "{\"commands\":0,\"failed\":0,\"error\":");
+            json_string(json, fat_strerror(status));
+            fprintf(json, "}\n");
         }
+        return EXIT_NO_IMAGE;
     }
 
-    char input[256];
-    while (true)
-    {
-        printf("%s>", current_path); // Add prompt
-        fgets(input, 256, stdin);
-        input[strcspn(input, "\n")] = 0;
+    FatVolumeInfo info;
+    fat_volume_info(sh.vol, &info);
+    printf("Image opened %s%s\n", info.read_only ? "read-only" : "read-write", info.mapped ? ", memory mapped" : "");
 
-        if (strncmp(input, "ls", 2) == 0)
-        {
-            print_directory();
-        }
-        else if (strncmp(input, "exit", 4) == 0)
-        {
-            break;
+    // Startup only touches the boot sector, the rest of the volume is read on first use
+    if (verbose)
+    {
+        printf("Partition table\n-----------------------\n");
+        for (i = 0; i < 4; i++){ // for all partition entries print basic info
+            printf("Partition %d, type %02X, ", i, info.partitions[i].type);
+            printf("start sector %8d, length %8d sectors\n", info.partitions[i].start_sector,
+                   info.partitions[i].length_sectors);
         }
-        else if (strncmp(input, "cd ", 3) == 0)
+        printf("\nSeeking to first partition by %d sectors\n", info.partitions[0].start_sector);
+    }
+    printf("Volume_label %.11s, %d sectors size, FAT%d with %u clusters\n",
+           info.label, info.sector_size, info.fat_type, info.data_clusters);
+
+    // Raw root entries, then the root once as ls shows it
+    if (verbose)
+    {
+        printf("\nFilesystem root directory listing\n-----------------------\n");
+        FatDir *root;
+        FatDirent entry;
+        if (fat_dir_open(sh.vol, 0, &root) == FAT_OK)
         {
-            if (strcmp(input + 3, "..") == 0)
+            while (fat_dir_next(root, &entry) == 1)
             {
-                printf("Moving up to parent directory\n");
-                current_cluster = 0; // Reset to root directory
-                char* last_slash = strrchr(current_path, '/');
-                if (last_slash != NULL && last_slash != current_path) {
-                    *last_slash = '\0';  // Truncate string at last slash
-                }
-                
-                // If we removed everything, restore root
-                if (strlen(current_path) == 0) {
-                    strcpy(current_path, "Groot");
-                }
-            }
-            else if (strcmp(input + 3, ".") == 0)
-            {
-                printf("Staying in current directory\n");
-            }
-            else
-            {
-                printf("Changing directory to %s\n", input + 3);
-                change_dir(input + 3);
+                printf("%.8s.%.3s attributes 0x%02X starting cluster %8d len %8d B\n", entry.raw_name,
+                       entry.raw_name + 8, entry.attributes, entry.cluster, entry.size);
             }
+            fat_dir_close(root);
         }
-        else if (strncmp(input, "read ", 5) == 0)
-        {
-            read(input + 5);
-        }
-        else if(strncmp(input, "write ", 6) == 0)
-        {
-            printf("Creating file %s\n", input + 6);
-            write(input + 6);
-        }
-        else if (strncmp(input, "del ", 4) == 0)
+        print_directory(&sh);
+    }
+
+    if (arg < argc)
+    {
+        printf("\nReading %s:\n-----------------------\n", argv[arg]);
+        if (read_file(&sh, argv[arg]) == -1)
         {
-            printf("Deleting file %s\n", input + 4);
-            delete(input + 4);
+            printf("Error: File not found or couldn't be read\n");
         }
-        else if (strncmp(input, "help", 4) == 0)
+    }
+
+    stats_end();
+
+    int exit_status = EXIT_OK;
+    if (sh.batch)
+    {
+        exit_status = run_batch(&sh, commands, command_count, script, stop_on_error, json);
+        if (script != NULL && script != stdin)
+            fclose(script);
+    }
+    else
+    {
+        char input[COMMAND_MAX];
+        while (true)
         {
-            printf("Available commands:\n");
-            printf("  ls           - List directory contents\n");
-            printf("  cd <dir>     - Change directory\n");
-            printf("  read <file>  - Read file contents\n");
-            printf("  help         - Show this help message\n");
-            printf("  tree         - Show directory tree\n");
-            printf("  write <file> - Create a new file\n");
-            printf("  del <file>   - Delete a file\n");
-            printf("  exit         - Exit program\n");
+            printf("%s>", sh.path); // Add prompt
+            fflush(stdout);
+            if (fgets(input, sizeof(input), stdin) == NULL)
+                break;
+            input[strcspn(input, "\n")] = 0;
+            stats_begin(input);
+            int done = run_command(&sh, input);
+            stats_end();
+            if (done)
+                break;
+            printf("\n");
         }
-        else if(strncmp(input, "tree", 4) == 0)
+    }
+    free(commands);
+
+    if (stats_path != NULL)
+    {
+        FILE *stats_file = fopen(stats_path, "w");
+        if (stats_file == NULL)
         {
-           // print_tree();
-            print_tree(0, 1);
+            printf("Error: Could not write statistics to %s\n", stats_path);
         }
         else
         {
-            printf("Unknown command: %s\n", input);
+            stats_json(stats_file);
+            fclose(stats_file);
         }
-        printf("\n");
     }
 
-    free(fat_table);
-    fclose(in);
-    return 0;
-}
\ No newline at end of file
+    // Writes back the FAT and every dirty block
+    if (fat_unmount(sh.vol) != FAT_OK)
+    {
+        printf("Error: Could not write back the volume\n");
+        exit_status = EXIT_WRITE_BACK;
+    }
+    return exit_status;
+}
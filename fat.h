@@ -1,4 +1,7 @@
-// FAT16 structures
+#ifndef FAT_H
+#define FAT_H
+
+// FAT12/16/32 structures
 // see http://www.tavi.co.uk/phobos/fat.html
 
 typedef struct {
@@ -35,15 +38,56 @@ typedef struct {
     unsigned short boot_sector_signature;
 } __attribute((packed)) Fat16BootSector;
 
+// FAT32 boot sector: same BPB up to total_sectors_int, then the extended BPB
+typedef struct {
+    unsigned char jmp[3];
+    char oem[8];
+    unsigned short sector_size;
+    unsigned char sectors_per_cluster;
+    unsigned short reserved_sectors;
+    unsigned char number_of_fats;
+    unsigned short root_dir_entries;    // always 0, the root is a cluster chain
+    unsigned short total_sectors_short;
+    unsigned char media_descriptor;
+    unsigned short fat_size_sectors;    // always 0, see fat_size_sectors_32
+    unsigned short sectors_per_track;
+    unsigned short number_of_heads;
+    unsigned int hidden_sectors;
+    unsigned int total_sectors_int;
+    unsigned int fat_size_sectors_32;
+    unsigned short ext_flags;           // bit 7 set: only FAT number (bits 0-3) is used
+    unsigned short fs_version;
+    unsigned int root_cluster;
+    unsigned short fs_info_sector;
+    unsigned short backup_boot_sector;
+    unsigned char reserved[12];
+    unsigned char drive_number;
+    unsigned char current_head;
+    unsigned char boot_signature;
+    unsigned int volume_id;
+    char volume_label[11];
+    char fs_type[8];
+    char boot_code[420];
+    unsigned short boot_sector_signature;
+} __attribute((packed)) Fat32BootSector;
+
 typedef struct {
     unsigned char filename[8];
     unsigned char ext[3];
     unsigned char attributes;
-    unsigned char reserved[10];
+    unsigned char reserved[8];
+    unsigned short starting_cluster_high;   // FAT32 only
     unsigned short modify_time;
     unsigned short modify_date;
     unsigned short starting_cluster;
     unsigned int file_size;
 } __attribute((packed)) Fat16Entry;
 
-int read(const char*);
\ No newline at end of file
+// Image offset of a data cluster, the first one is cluster 2
+static inline unsigned long fat_cluster_offset(unsigned long data_offset, unsigned int cluster_size,
+                                               unsigned int cluster)
+{
+    return data_offset + (unsigned long)(cluster - 2) * cluster_size;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#include "fattable.h"
+#include "stats.h"
+#include "simd.h"
+#include <string.h>
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+// FAT12 packs two entries into three bytes, odd entries take the high nibbles
+static inline unsigned int fat12_get(const FatTable *fat, unsigned int cluster)
+{
+    const unsigned char *p = fat->data + cluster + cluster / 2;
+    unsigned int value = p[0] | p[1] << 8;
+    return cluster & 1 ? value >> 4 : value & 0x0FFF;
+}
+
+static inline void fat12_set(FatTable *fat, unsigned int cluster, unsigned int value)
+{
+    unsigned char *p = fat->data + cluster + cluster / 2;
+    if (cluster & 1)
+    {
+        p[0] = (p[0] & 0x0F) | (value << 4 & 0xF0);
+        p[1] = value >> 4;
+    }
+    else
+    {
+        p[0] = value;
+        p[1] = (p[1] & 0xF0) | (value >> 8 & 0x0F);
+    }
+}
+
+static inline unsigned int fat16_get(const FatTable *fat, unsigned int cluster)
+{
+    unsigned short value;
+    memcpy(&value, fat->data + (unsigned long)cluster * 2, 2);
+    return value;
+}
+
+static inline void fat16_set(FatTable *fat, unsigned int cluster, unsigned int value)
+{
+    unsigned short entry = value;
+    memcpy(fat->data + (unsigned long)cluster * 2, &entry, 2);
+}
+
+// FAT32 entries are 28 bits, the top four are reserved and kept as found
+static inline unsigned int fat32_get(const FatTable *fat, unsigned int cluster)
+{
+    unsigned int value;
+    memcpy(&value, fat->data + (unsigned long)cluster * 4, 4);
+    return value & 0x0FFFFFFF;
+}
+
+static inline void fat32_set(FatTable *fat, unsigned int cluster, unsigned int value)
+{
+    unsigned int entry;
+    memcpy(&entry, fat->data + (unsigned long)cluster * 4, 4);
+    entry = (entry & 0xF0000000) | (value & 0x0FFFFFFF);
+    memcpy(fat->data + (unsigned long)cluster * 4, &entry, 4);
+}
+
+#define FAT_BITS 12
+#include "fattable_width.h"
+#undef FAT_BITS
+
+#define FAT_BITS 16
+#include "fattable_width.h"
+#undef FAT_BITS
+
+#define FAT_BITS 32
+#include "fattable_width.h"
+#undef FAT_BITS
+
+FatType fat_type_for(unsigned long data_clusters)
+{
+    if (data_clusters < 4085)
+        return FAT12;
+    if (data_clusters < 65525)
+        return FAT16;
+    return FAT32;
+}
+
+unsigned long fat_entries_for(FatType type, unsigned long bytes)
+{
+    return type == FAT12 ? bytes * 2 / 3 : bytes / (type / 8);
+}
+
+void fattable_init(FatTable *fat, FatType type, unsigned int clusters)
+{
+    memset(fat, 0, sizeof(FatTable));
+    fat->type = type;
+    fat->clusters = clusters;
+
+    // Values from 0x?FF0 up are reserved, bad cluster or end of chain
+    switch (type)
+    {
+    case FAT12:
+        fat->limit = 0x0FF0;
+        fat->eoc = 0x0FFF;
+        fat->ops = &fat12_ops;
+        break;
+    case FAT16:
+        fat->limit = 0xFFF0;
+        fat->eoc = 0xFFFF;
+        fat->ops = &fat16_ops;
+        break;
+    case FAT32:
+        fat->limit = 0x0FFFFFF0;
+        fat->eoc = 0x0FFFFFFF;
+        fat->ops = &fat32_ops;
+        break;
+    }
+    if (fat->limit > clusters)
+        fat->limit = clusters;
+}
@@ -0,0 +1,91 @@
+#ifndef FATTABLE_H
+#define FATTABLE_H
+
+#include "fat.h"
+#include <stdbool.h>
+
+// The in-memory File Allocation Table for FAT12 (12-bit packed entries),
+// FAT16 and FAT32 (28-bit entries). The type is fixed at mount time and picks
+// a table of accessors; the chain walk and free scan are instantiated once
+// per entry width (see fattable_width.h), so their loops call the accessor
+// of that width directly instead of checking the type for every entry.
+
+typedef enum {
+    FAT12 = 12,
+    FAT16 = 16,
+    FAT32 = 32
+} FatType;
+
+typedef struct FatTable FatTable;
+
+// Run of consecutive clusters in a chain
+typedef struct {
+    unsigned int start;
+    unsigned int length;
+} Extent;
+
+// Called for each run of consecutive clusters found while walking a chain
+typedef void (*FatRunFn)(void *ctx, unsigned int start, unsigned int length);
+
+typedef struct {
+    unsigned int (*get)(const FatTable *fat, unsigned int cluster);
+    void (*set)(FatTable *fat, unsigned int cluster, unsigned int value);
+
+    // Follow the chain from start for at most max_clusters clusters, reporting
+    // every run to run (may be NULL). Returns the number of clusters visited.
+    unsigned int (*walk)(const FatTable *fat, unsigned int start, unsigned int max_clusters,
+                         FatRunFn run, void *ctx);
+
+    // Set the bit of every free cluster in bits, returns how many were free
+    unsigned int (*find_free)(const FatTable *fat, unsigned long *bits);
+} FatOps;
+
+struct FatTable {
+    FatType type;
+    unsigned char *data;        // table as stored on disk, NULL until loaded
+    unsigned long bytes;
+    unsigned int clusters;      // highest valid cluster + 1
+    unsigned int limit;         // entries below this (and >= 2) point to a next cluster
+    unsigned int eoc;           // end of chain marker written by set()
+    const FatOps *ops;
+};
+
+// FAT type of a volume follows from its count of data clusters alone
+FatType fat_type_for(unsigned long data_clusters);
+
+// Entries a table of the given size can hold
+unsigned long fat_entries_for(FatType type, unsigned long bytes);
+
+void fattable_init(FatTable *fat, FatType type, unsigned int clusters);
+
+static inline bool fat_is_next(const FatTable *fat, unsigned int value)
+{
+    return value >= 0x0002 && value < fat->limit;
+}
+
+// Byte range of an entry inside the table, for tracking dirty sectors
+static inline unsigned long fat_entry_offset(const FatTable *fat, unsigned int cluster)
+{
+    return fat->type == FAT12 ? cluster + cluster / 2 : (unsigned long)cluster * (fat->type / 8);
+}
+
+static inline unsigned int fat_entry_size(const FatTable *fat)
+{
+    return fat->type == FAT12 ? 2 : fat->type / 8;
+}
+
+// First cluster of a directory entry, FAT32 keeps the high word separately
+static inline unsigned int fat_entry_cluster(const FatTable *fat, const Fat16Entry *entry)
+{
+    if (fat->type == FAT32)
+        return (unsigned int)entry->starting_cluster_high << 16 | entry->starting_cluster;
+    return entry->starting_cluster;
+}
+
+static inline void fat_set_entry_cluster(Fat16Entry *entry, unsigned int cluster)
+{
+    entry->starting_cluster = cluster & 0xFFFF;
+    entry->starting_cluster_high = cluster >> 16;
+}
+
+#endif
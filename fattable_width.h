@@ -0,0 +1,84 @@
+// Loops over the FAT for one entry width. fattable.c includes this once per
+// width with FAT_BITS set to 12, 16 or 32 and fatNN_get() defined, producing
+// fatNN_walk(), fatNN_find_free() and the fatNN_ops table. The free scan of
+// the 16 and 32-bit tables runs on the vector kernels from simd.c.
+
+#define FAT_FN__(bits, name) fat##bits##_##name
+#define FAT_FN_(bits, name) FAT_FN__(bits, name)
+#define FAT_FN(name) FAT_FN_(FAT_BITS, name)
+
+static unsigned int FAT_FN(walk)(const FatTable *fat, unsigned int start, unsigned int max_clusters,
+                                 FatRunFn run, void *ctx)
+{
+    unsigned int visited = 0, run_start = 0, run_length = 0;
+    unsigned int cluster = start;
+
+    // A chain can't be longer than the volume, that bounds damaged loops
+    if (max_clusters > fat->clusters)
+        max_clusters = fat->clusters;
+
+    while (cluster >= 0x0002 && cluster < fat->limit && visited < max_clusters)
+    {
+        if (run_length > 0 && cluster == run_start + run_length)
+        {
+            run_length++;
+        }
+        else
+        {
+            if (run_length > 0 && run != NULL)
+                run(ctx, run_start, run_length);
+            run_start = cluster;
+            run_length = 1;
+        }
+        visited++;
+        cluster = FAT_FN(get)(fat, cluster);
+    }
+    if (run_length > 0 && run != NULL)
+        run(ctx, run_start, run_length);
+
+    stat_add(STAT_CLUSTERS, visited);
+    stat_add(STAT_FAT_LOOKUPS, visited);
+    return visited;
+}
+
+static unsigned int FAT_FN(find_free)(const FatTable *fat, unsigned long *bits)
+{
+    unsigned int free_count = 0;
+
+#if FAT_BITS == 16
+    free_count = simd_zero_bits16((const unsigned short *)fat->data, fat->clusters, bits);
+#elif FAT_BITS == 32
+    free_count = simd_zero_bits32((const unsigned int *)fat->data, fat->clusters, bits);
+#else
+    for (unsigned int cluster = 2; cluster < fat->clusters; cluster++)
+    {
+        if (FAT_FN(get)(fat, cluster) == 0)
+        {
+            bits[cluster / WORD_BITS] |= 1UL << (cluster % WORD_BITS);
+            free_count++;
+        }
+    }
+#endif
+
+    // Clusters 0 and 1 are reserved and never handed out, the kernels see them too
+    for (unsigned int cluster = 0; cluster < 2 && cluster < fat->clusters; cluster++)
+    {
+        if (bits[0] & 1UL << cluster)
+        {
+            bits[0] &= ~(1UL << cluster);
+            free_count--;
+        }
+    }
+    return free_count;
+}
+
+static const FatOps FAT_FN(ops) = {
+    FAT_FN(get),
+    FAT_FN(set),
+    FAT_FN(walk),
+    FAT_FN(find_free),
+};
+
+#undef FAT_FN
+#undef FAT_FN_
+#undef FAT_FN__
@@ -0,0 +1,323 @@
+#include "freemap.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+int freemap_build(FreeMap *map, const FatTable *fat)
+{
+    unsigned int clusters = fat->clusters;
+    unsigned int words = (clusters + WORD_BITS - 1) / WORD_BITS;
+    unsigned int summary_words = (words + WORD_BITS - 1) / WORD_BITS;
+
+    memset(map, 0, sizeof(FreeMap));
+    map->bits = calloc(words ? words : 1, sizeof(unsigned long));
+    map->summary = calloc(summary_words ? summary_words : 1, sizeof(unsigned long));
+    if (map->bits == NULL || map->summary == NULL)
+    {
+        freemap_destroy(map);
+        return -1;
+    }
+    map->clusters = clusters;
+    map->hint = 2;
+
+    map->free_count = fat->ops->find_free(fat, map->bits);
+    for (unsigned int w = 0; w < words; w++)
+    {
+        if (map->bits[w] != 0)
+            map->summary[w / WORD_BITS] |= 1UL << (w % WORD_BITS);
+    }
+    return 0;
+}
+
+void freemap_destroy(FreeMap *map)
+{
+    free(map->bits);
+    free(map->summary);
+    memset(map, 0, sizeof(FreeMap));
+}
+
+bool freemap_is_free(const FreeMap *map, unsigned int cluster)
+{
+    if (cluster < 2 || cluster >= map->clusters)
+        return false;
+    return (map->bits[cluster / WORD_BITS] >> (cluster % WORD_BITS)) & 1;
+}
+
+void freemap_mark_used(FreeMap *map, unsigned int cluster)
+{
+    if (!freemap_is_free(map, cluster))
+        return;
+
+    unsigned int w = cluster / WORD_BITS;
+    map->bits[w] &= ~(1UL << (cluster % WORD_BITS));
+    if (map->bits[w] == 0)
+        map->summary[w / WORD_BITS] &= ~(1UL << (w % WORD_BITS));
+    map->free_count--;
+}
+
+void freemap_mark_free(FreeMap *map, unsigned int cluster)
+{
+    if (cluster < 2 || cluster >= map->clusters || freemap_is_free(map, cluster))
+        return;
+
+    unsigned int w = cluster / WORD_BITS;
+    map->bits[w] |= 1UL << (cluster % WORD_BITS);
+    map->summary[w / WORD_BITS] |= 1UL << (w % WORD_BITS);
+    map->free_count++;
+}
+
+// First free cluster at or after start, or 0 if there is none
+static unsigned int find_from(const FreeMap *map, unsigned int start)
+{
+    unsigned int words = (map->clusters + WORD_BITS - 1) / WORD_BITS;
+    unsigned int summary_words = (words + WORD_BITS - 1) / WORD_BITS;
+    unsigned int w = start / WORD_BITS;
+
+    if (w >= words)
+        return 0;
+
+    // Rest of the word the start cluster lives in
+    unsigned long bits = map->bits[w] & (~0UL << (start % WORD_BITS));
+    if (bits != 0)
+        return w * WORD_BITS + __builtin_ctzl(bits);
+
+    // Then jump between non-full words through the summary
+    w++;
+    unsigned int s = w / WORD_BITS;
+    unsigned long summary = s < summary_words ? map->summary[s] & (~0UL << (w % WORD_BITS)) : 0;
+    while (true)
+    {
+        if (summary != 0)
+        {
+            w = s * WORD_BITS + __builtin_ctzl(summary);
+            return w * WORD_BITS + __builtin_ctzl(map->bits[w]);
+        }
+        if (++s >= summary_words)
+            return 0;
+        summary = map->summary[s];
+    }
+}
+
+unsigned int freemap_alloc(FreeMap *map)
+{
+    if (map->free_count == 0)
+        return 0;
+
+    // Next-fit: continue after the last allocation and wrap around once
+    unsigned int cluster = find_from(map, map->hint);
+    if (cluster == 0 || cluster >= map->clusters)
+        cluster = find_from(map, 2);
+    if (cluster == 0 || cluster >= map->clusters)
+        return 0;
+
+    freemap_mark_used(map, cluster);
+    map->hint = cluster + 1;
+    return cluster;
+}
+
+// First cluster at or after start that is not free
+static unsigned int run_end(const FreeMap *map, unsigned int start)
+{
+    unsigned int words = (map->clusters + WORD_BITS - 1) / WORD_BITS;
+    unsigned int w = start / WORD_BITS;
+    unsigned long used = ~map->bits[w] & (~0UL << (start % WORD_BITS));
+
+    // Bits past the last cluster are never set, so a run always ends
+    while (used == 0 && ++w < words)
+        used = ~map->bits[w];
+    if (used == 0)
+        return map->clusters;
+
+    unsigned int end = w * WORD_BITS + __builtin_ctzl(used);
+    return end < map->clusters ? end : map->clusters;
+}
+
+static int longer_run(const void *a, const void *b)
+{
+    const Extent *x = a, *y = b;
+    if (x->length != y->length)
+        return x->length < y->length ? 1 : -1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int earlier_run(const void *a, const void *b)
+{
+    const Extent *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
+
+int freemap_alloc_extents(FreeMap *map, unsigned int needed, Extent **extents)
+{
+    *extents = NULL;
+    if (needed == 0 || needed > map->free_count)
+        return -1;
+
+    // Any free cluster holds a single one, next-fit finds it without a scan
+    if (needed == 1)
+    {
+        Extent *one = malloc(sizeof(Extent));
+        if (one == NULL)
+            return -1;
+        if ((one->start = freemap_alloc(map)) == 0)
+        {
+            free(one);
+            return -1;
+        }
+        one->length = 1;
+        *extents = one;
+        return 1;
+    }
+
+    // Best fit: the smallest run that holds the whole file, meanwhile
+    // collecting the runs in case none does
+    Extent best = {0, 0};
+    Extent *runs = NULL;
+    unsigned int run_count = 0, run_capacity = 0;
+    unsigned int cluster = find_from(map, 2);
+    while (cluster != 0 && cluster < map->clusters)
+    {
+        unsigned int end = run_end(map, cluster);
+        unsigned int length = end - cluster;
+
+        if (length >= needed)
+        {
+            if (best.length == 0 || length < best.length)
+                best = (Extent){cluster, length};
+            if (length == needed)
+                break;
+        }
+        else if (best.length == 0)
+        {
+            if (run_count == run_capacity)
+            {
+                run_capacity = run_capacity ? run_capacity * 2 : 64;
+                Extent *grown = realloc(runs, run_capacity * sizeof(Extent));
+                if (grown == NULL)
+                {
+                    free(runs);
+                    return -1;
+                }
+                runs = grown;
+            }
+            runs[run_count++] = (Extent){cluster, length};
+        }
+        cluster = end < map->clusters ? find_from(map, end) : 0;
+    }
+
+    int count = 0;
+    if (best.length != 0)
+    {
+        free(runs);
+        runs = malloc(sizeof(Extent));
+        if (runs == NULL)
+            return -1;
+        runs[0] = (Extent){best.start, needed};
+        count = 1;
+    }
+    else
+    {
+        // Fewest extents: the longest runs first, then the smallest run that
+        // still holds the remainder
+        qsort(runs, run_count, sizeof(Extent), longer_run);
+        unsigned int remaining = needed;
+        while (remaining > 0)
+        {
+            if (runs[count].length >= remaining)
+            {
+                unsigned int fit = count;
+                while (fit + 1 < run_count && runs[fit + 1].length >= remaining)
+                    fit++;
+                Extent last = {runs[fit].start, remaining};
+                runs[fit] = runs[count];
+                runs[count++] = last;
+                remaining = 0;
+            }
+            else
+            {
+                remaining -= runs[count++].length;
+            }
+        }
+        qsort(runs, count, sizeof(Extent), earlier_run);
+    }
+
+    for (int e = 0; e < count; e++)
+    {
+        for (unsigned int c = 0; c < runs[e].length; c++)
+            freemap_mark_used(map, runs[e].start + c);
+    }
+    map->hint = runs[count - 1].start + runs[count - 1].length;
+    *extents = runs;
+    return count;
+}
+
+// Move the cursor to the next free run at or after cluster
+static void cursor_seek(FreeCursor *cursor, unsigned int cluster)
+{
+    FreeMap *map = cursor->map;
+    cursor->cluster = cluster < map->clusters ? find_from(map, cluster) : 0;
+    if (cursor->cluster >= map->clusters)
+        cursor->cluster = 0;
+    cursor->end = cursor->cluster != 0 ? run_end(map, cursor->cluster) : 0;
+}
+
+void freemap_cursor_init(FreeCursor *cursor, FreeMap *map)
+{
+    cursor->map = map;
+    cursor_seek(cursor, 2);
+}
+
+int freemap_cursor_alloc(FreeCursor *cursor, unsigned int needed, Extent **extents)
+{
+    FreeMap *map = cursor->map;
+    *extents = NULL;
+    if (needed == 0 || needed > map->free_count)
+        return -1;
+
+    Extent *runs = NULL;
+    int count = 0, capacity = 0;
+    unsigned int remaining = needed;
+    while (remaining > 0 && cursor->cluster != 0)
+    {
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 4;
+            Extent *grown = realloc(runs, capacity * sizeof(Extent));
+            if (grown == NULL)
+                break;
+            runs = grown;
+        }
+
+        unsigned int length = cursor->end - cursor->cluster;
+        if (length > remaining)
+            length = remaining;
+        runs[count++] = (Extent){cursor->cluster, length};
+        for (unsigned int c = 0; c < length; c++)
+            freemap_mark_used(map, cursor->cluster + c);
+        remaining -= length;
+
+        cursor->cluster += length;
+        if (cursor->cluster == cursor->end)
+            cursor_seek(cursor, cursor->end);
+    }
+
+    // Free clusters behind the cursor (freed since it started) or no memory
+    if (remaining > 0)
+    {
+        freemap_release_extents(map, runs, count);
+        free(runs);
+        return -1;
+    }
+    map->hint = runs[count - 1].start + runs[count - 1].length;
+    *extents = runs;
+    return count;
+}
+
+void freemap_release_extents(FreeMap *map, const Extent *extents, int count)
+{
+    for (int e = 0; e < count; e++)
+    {
+        for (unsigned int c = 0; c < extents[e].length; c++)
+            freemap_mark_free(map, extents[e].start + c);
+    }
+}
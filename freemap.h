@@ -0,0 +1,56 @@
+#ifndef FREEMAP_H
+#define FREEMAP_H
+
+#include "fattable.h"
+#include <stdbool.h>
+
+// Free-cluster index built from the FAT. One bit per cluster (set = free),
+// plus a summary bit per bitmap word telling whether that word has any free
+// cluster left, so allocation skips full regions 4096 clusters at a time.
+
+typedef struct {
+    unsigned long *bits;
+    unsigned long *summary;
+    unsigned int clusters;      // number of FAT entries covered, including 0 and 1
+    unsigned int free_count;
+    unsigned int hint;          // where the next allocation starts looking
+} FreeMap;
+
+int freemap_build(FreeMap *map, const FatTable *fat);
+void freemap_destroy(FreeMap *map);
+
+// Take the next free cluster and mark it used, returns 0 if the volume is full
+unsigned int freemap_alloc(FreeMap *map);
+
+// Reserve needed clusters for one file and mark them used. Takes the
+// smallest free run that holds all of them; without one, the largest runs
+// so the file gets as few extents as possible. The extents come back in
+// disk order in a malloc'd array. Returns their count, or -1 (nothing
+// taken) if the volume has too few free clusters. A single cluster comes
+// from freemap_alloc() without searching the runs.
+int freemap_alloc_extents(FreeMap *map, unsigned int needed, Extent **extents);
+
+// Hands out free clusters in disk order from one pass over the map, for
+// placing many files at once. Everything before the cursor is in use, so
+// each file costs only the runs it takes, not a search of the whole map.
+typedef struct {
+    FreeMap *map;
+    unsigned int cluster;   // next free cluster, 0 once the map is used up
+    unsigned int end;       // end of the free run cluster lies in
+} FreeCursor;
+
+void freemap_cursor_init(FreeCursor *cursor, FreeMap *map);
+
+// Reserve needed clusters from the cursor on and mark them used. Returns
+// the number of extents, in disk order in a malloc'd array, or -1 (nothing
+// taken) if too few free clusters are left.
+int freemap_cursor_alloc(FreeCursor *cursor, unsigned int needed, Extent **extents);
+
+// Mark every cluster of the extents free again
+void freemap_release_extents(FreeMap *map, const Extent *extents, int count);
+
+void freemap_mark_used(FreeMap *map, unsigned int cluster);
+void freemap_mark_free(FreeMap *map, unsigned int cluster);
+bool freemap_is_free(const FreeMap *map, unsigned int cluster);
+
+#endif
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include "image.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+int image_open(Image *img, const char *path, ImageMode mode)
+{
+    memset(img, 0, sizeof(Image));
+    img->fd = -1;
+    img->mode = mode;
+
+    int fd = open(path, mode == IMAGE_READ_WRITE ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        int prot = PROT_READ | (mode == IMAGE_READ_WRITE ? PROT_WRITE : 0);
+        void *map = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            img->fd = fd;
+            img->map = map;
+            img->size = st.st_size;
+            return 0;
+        }
+    }
+
+    // Can't map it (device node, special file, mmap refused), use positional I/O on the fd
+    off_t end = lseek(fd, 0, SEEK_END);
+    img->fd = fd;
+    img->size = end > 0 ? end : 0;
+    return 0;
+}
+
+void image_close(Image *img)
+{
+    if (img->map != NULL)
+    {
+        if (img->mode == IMAGE_READ_WRITE)
+            msync(img->map, img->size, MS_SYNC);
+        munmap(img->map, img->size);
+    }
+    if (img->fd >= 0)
+        close(img->fd);
+    img->map = NULL;
+    img->fd = -1;
+}
+
+bool image_is_mapped(const Image *img)
+{
+    return img->map != NULL;
+}
+
+size_t image_read(Image *img, unsigned long offset, void *buf, size_t len)
+{
+    if (img->map != NULL)
+    {
+        if (offset >= img->size)
+            return 0;
+        if (len > img->size - offset)
+            len = img->size - offset;
+        memcpy(buf, img->map + offset, len);
+        stat_add(STAT_BYTES_READ, len);
+        return len;
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(img->fd, (unsigned char *)buf + done, len - done, offset + done);
+        stat_add(STAT_SYSCALLS, 1);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    stat_add(STAT_BYTES_READ, done);
+    return done;
+}
+
+size_t image_write(Image *img, unsigned long offset, const void *buf, size_t len)
+{
+    if (img->mode != IMAGE_READ_WRITE)
+        return 0;
+
+    if (img->map != NULL)
+    {
+        // A mapping can't grow the file, writes past the end are dropped
+        if (offset >= img->size)
+            return 0;
+        if (len > img->size - offset)
+            len = img->size - offset;
+        memcpy(img->map + offset, buf, len);
+        stat_add(STAT_BYTES_WRITTEN, len);
+        return len;
+    }
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pwrite(img->fd, (const unsigned char *)buf + done, len - done, offset + done);
+        stat_add(STAT_SYSCALLS, 1);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    stat_add(STAT_BYTES_WRITTEN, done);
+    return done;
+}
+
+size_t image_readv(Image *img, unsigned long offset, const struct iovec *iov, int iovcnt)
+{
+    if (img->map != NULL)
+    {
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            size_t n = image_read(img, offset + total, iov[i].iov_base, iov[i].iov_len);
+            total += n;
+            if (n != iov[i].iov_len)
+                break;
+        }
+        return total;
+    }
+
+    ssize_t n = preadv(img->fd, iov, iovcnt, offset);
+    stat_add(STAT_SYSCALLS, 1);
+    if (n <= 0)
+        return 0;
+    stat_add(STAT_BYTES_READ, n);
+    return n;
+}
+
+size_t image_copy_out(Image *img, unsigned long offset, size_t len, int out_fd, unsigned long out_offset,
+                      ImageCopyMethod *method)
+{
+    size_t done = 0;
+
+    // copy_file_range can share extents or copy inside the kernel
+    *method = IMAGE_COPY_FILE_RANGE;
+    while (done < len)
+    {
+        loff_t in_pos = offset + done;
+        loff_t out_pos = out_offset + done;
+        ssize_t n = copy_file_range(img->fd, &in_pos, out_fd, &out_pos, len - done, 0);
+        stat_add(STAT_SYSCALLS, 1);
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    if (done == len)
+    {
+        stat_add(STAT_BYTES_READ, done);
+        return done;
+    }
+
+    // sendfile writes at the current position of out_fd
+    *method = IMAGE_COPY_SENDFILE;
+    stat_add(STAT_SEEKS, 1);
+    stat_add(STAT_SYSCALLS, 1);
+    if (lseek(out_fd, out_offset + done, SEEK_SET) >= 0)
+    {
+        while (done < len)
+        {
+            off_t in_pos = offset + done;
+            ssize_t n = sendfile(out_fd, img->fd, &in_pos, len - done);
+            stat_add(STAT_SYSCALLS, 1);
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        if (done == len)
+        {
+            stat_add(STAT_BYTES_READ, done);
+            return done;
+        }
+    }
+
+    // Plain copy, straight out of the mapping when there is one
+    *method = IMAGE_COPY_BUFFERED;
+    unsigned char buffer[64 * 1024];
+    while (done < len)
+    {
+        size_t n = len - done < sizeof(buffer) ? len - done : sizeof(buffer);
+        const void *data = buffer;
+        if (img->map != NULL)
+        {
+            if (offset + done + n > img->size)
+                break;
+            data = img->map + offset + done;
+            stat_add(STAT_BYTES_READ, n);
+        }
+        else if (image_read(img, offset + done, buffer, n) != n)
+        {
+            break;
+        }
+
+        ssize_t w = pwrite(out_fd, data, n, out_offset + done);
+        stat_add(STAT_SYSCALLS, 1);
+        if (w <= 0)
+            break;
+        done += w;
+    }
+    return done;
+}
+
+const void *image_acquire(Image *img, unsigned long offset, size_t len)
+{
+    if (img->map != NULL)
+    {
+        if (offset > img->size || len > img->size - offset)
+            return NULL;
+        return img->map + offset;
+    }
+
+    void *copy = malloc(len ? len : 1);
+    if (copy == NULL)
+        return NULL;
+    if (image_read(img, offset, copy, len) != len)
+    {
+        free(copy);
+        return NULL;
+    }
+    return copy;
+}
+
+void image_release(Image *img, const void *ptr)
+{
+    const unsigned char *p = ptr;
+    if (p == NULL)
+        return;
+    if (img->map != NULL && p >= img->map && p < img->map + img->size)
+        return;
+    free((void *)ptr);
+}
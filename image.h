@@ -0,0 +1,59 @@
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+// Disk image backend. The whole image is mapped into memory when possible so
+// that the boot sector, FAT, root directory and data region can be reached as
+// plain pointers. Images that can't be mapped fall back to pread/pwrite on
+// the file descriptor. Neither backend keeps a file position, so any number
+// of threads may read and write disjoint ranges at once.
+
+typedef enum {
+    IMAGE_READ_ONLY,
+    IMAGE_READ_WRITE
+} ImageMode;
+
+typedef struct {
+    int fd;
+    unsigned char *map;     // whole image, NULL when not mapped
+    unsigned long size;
+    ImageMode mode;
+} Image;
+
+int image_open(Image *img, const char *path, ImageMode mode);
+void image_close(Image *img);
+
+// Copy bytes between the image and a caller buffer, returns bytes moved.
+// Positional, safe to call from several threads at once.
+size_t image_read(Image *img, unsigned long offset, void *buf, size_t len);
+size_t image_write(Image *img, unsigned long offset, const void *buf, size_t len);
+
+// How image_copy_out() moved the data
+typedef enum {
+    IMAGE_COPY_FILE_RANGE,
+    IMAGE_COPY_SENDFILE,
+    IMAGE_COPY_BUFFERED
+} ImageCopyMethod;
+
+// Copy len bytes at offset into out_fd at out_offset, keeping the data in
+// the kernel (copy_file_range, then sendfile) when the files allow it.
+// Returns bytes copied, method reports the mechanism that was used.
+size_t image_copy_out(Image *img, unsigned long offset, size_t len, int out_fd, unsigned long out_offset,
+                      ImageCopyMethod *method);
+
+// Scatter one contiguous range of the image into several buffers
+size_t image_readv(Image *img, unsigned long offset, const struct iovec *iov, int iovcnt);
+
+// Pointer to len bytes at offset. Mapped images return a pointer into the
+// mapping, otherwise the bytes are read into a heap copy. Either way the
+// result must be handed back to image_release(). Returns NULL on failure.
+const void *image_acquire(Image *img, unsigned long offset, size_t len);
+void image_release(Image *img, const void *ptr);
+
+bool image_is_mapped(const Image *img);
+
+#endif
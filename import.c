@@ -0,0 +1,326 @@
+#include "volume.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define IMPORT_BATCH (4 * 1024 * 1024)  // most bytes import gathers into one image write
+
+// A host file planned by import
+typedef struct {
+    char path[512];
+    unsigned char key[11];
+    unsigned int size;
+    Extent *extents;
+    int extent_count;
+    bool planned;
+    FILE *in;                   // open while pieces of it are being copied
+    int pieces_left;
+} ImportFile;
+
+// One extent of an imported file, placed on the volume
+typedef struct {
+    int file;
+    unsigned long file_offset;
+    unsigned long dst_offset;
+    unsigned long length;       // bytes of file data, the rest of the last cluster is zeroed
+    unsigned int clusters;
+} ImportPiece;
+
+static int compare_import_key(const void *a, const void *b)
+{
+    return memcmp(((const ImportFile *)a)->key, ((const ImportFile *)b)->key, 11);
+}
+
+static int compare_import_dst(const void *a, const void *b)
+{
+    const ImportPiece *x = a, *y = b;
+    return x->dst_offset < y->dst_offset ? -1 : x->dst_offset > y->dst_offset;
+}
+
+// Regular files of a host directory whose names fit 8.3, sorted by name
+static int import_scan(const char *hostdir, ImportFile **files, FatImportReport *report)
+{
+    DIR *dir = opendir(hostdir);
+    if (dir == NULL)
+        return FAT_ERR_NOT_FOUND;
+
+    int count = 0, capacity = 0;
+    *files = NULL;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+
+        ImportFile file;
+        memset(&file, 0, sizeof(ImportFile));
+        snprintf(file.path, sizeof(file.path), "%s/%s", hostdir, de->d_name);
+        struct stat st;
+        if (stat(file.path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (!name_to_83(de->d_name, file.key)) {
+            report->bad_names++;
+            continue;
+        }
+        if (st.st_size > 0xFFFFFFFFL) {
+            report->too_large++;
+            continue;
+        }
+        file.size = st.st_size;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            ImportFile *grown = realloc(*files, capacity * sizeof(ImportFile));
+            if (grown == NULL) {
+                closedir(dir);
+                free(*files);
+                *files = NULL;
+                return FAT_ERR_NO_MEMORY;
+            }
+            *files = grown;
+        }
+        (*files)[count++] = file;
+    }
+    closedir(dir);
+
+    if (count > 0)
+        qsort(*files, count, sizeof(ImportFile), compare_import_key);
+    return count;
+}
+
+// Read one piece of a host file into buffer. The file is opened for its
+// first piece and stays open until its last one is copied.
+static int import_read(ImportFile *file, unsigned long offset, unsigned char *buffer, unsigned long length)
+{
+    if (file->in == NULL && (file->in = fopen(file->path, "rb")) == NULL)
+        return FAT_ERR_IO;
+    if (fseek(file->in, offset, SEEK_SET) != 0 || fread(buffer, 1, length, file->in) != length)
+        return FAT_ERR_IO;
+    return FAT_OK;
+}
+
+// One piece of a file is copied, close the file after its last
+static void import_piece_done(ImportFile *file)
+{
+    if (--file->pieces_left == 0 && file->in != NULL) {
+        fclose(file->in);
+        file->in = NULL;
+    }
+}
+
+// Copy the planned pieces in disk order, gathering neighbouring pieces into
+// one buffer so a run of small files becomes a single large write
+static int import_copy(FatVolume *vol, ImportFile *files, ImportPiece *pieces, int piece_count,
+                       unsigned char *buffer, unsigned long *bytes_copied)
+{
+    unsigned int cluster_size = vol->cluster_size;
+    int p = 0;
+    while (p < piece_count) {
+        unsigned long batch_start = pieces[p].dst_offset, filled = 0;
+
+        while (p < piece_count && pieces[p].dst_offset == batch_start + filled &&
+               filled + (unsigned long)pieces[p].clusters * cluster_size <= IMPORT_BATCH) {
+            ImportPiece *piece = &pieces[p];
+            unsigned long span = (unsigned long)piece->clusters * cluster_size;
+
+            if (import_read(&files[piece->file], piece->file_offset, buffer + filled, piece->length) != FAT_OK)
+                return FAT_ERR_IO;
+            memset(buffer + filled + piece->length, 0, span - piece->length);
+            filled += span;
+            *bytes_copied += piece->length;
+            import_piece_done(&files[piece->file]);
+            p++;
+        }
+
+        // A piece bigger than the batch goes out in batch-sized parts
+        if (filled == 0) {
+            ImportPiece *piece = &pieces[p];
+            unsigned long span = IMPORT_BATCH / cluster_size * cluster_size;
+            unsigned long length = piece->length < span ? piece->length : span;
+            if (import_read(&files[piece->file], piece->file_offset, buffer, length) != FAT_OK)
+                return FAT_ERR_IO;
+            memset(buffer + length, 0, span - length);
+            filled = span;
+            *bytes_copied += length;
+
+            piece->file_offset += length;
+            piece->dst_offset += span;
+            piece->length -= length;
+            piece->clusters -= span / cluster_size;
+        }
+
+        if (cache_write(&vol->cache, batch_start, buffer, filled) != filled)
+            return FAT_ERR_IO;
+    }
+    return FAT_OK;
+}
+
+int fat_import(FatVolume *vol, unsigned int dir, const char *hostdir, FatImportReport *report)
+{
+    memset(report, 0, sizeof(FatImportReport));
+    if (!volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    ImportFile *files;
+    int file_count = import_scan(hostdir, &files, report);
+    if (file_count <= 0)
+        return file_count;
+
+    unsigned int cluster_size = vol->cluster_size;
+    unsigned long *slots = malloc(file_count * sizeof(unsigned long));
+    unsigned char *buffer = malloc(IMPORT_BATCH > cluster_size ? IMPORT_BATCH : cluster_size);
+    ImportPiece *pieces = NULL;
+    int slot_count = 0, piece_count = 0, piece_capacity = 0;
+    int status = FAT_OK;
+    bool committed = false, fat_locked = true;
+    if (slots == NULL || buffer == NULL) {
+        free(files);
+        free(slots);
+        free(buffer);
+        return FAT_ERR_NO_MEMORY;
+    }
+
+    // The directory is locked for the whole import so the planned slots stay
+    // free, the FAT only while planning and committing
+    pthread_rwlock_wrlock(dir_lock(vol, dir));
+    if ((status = lock_fat(vol, true)) != FAT_OK) {
+        pthread_rwlock_unlock(dir_lock(vol, dir));
+        free(files);
+        free(slots);
+        free(buffer);
+        return status;
+    }
+
+    // Free directory slots in one pass
+    DirIter it;
+    const Fat16Entry *slot;
+    unsigned long slot_offset;
+    if ((status = dir_iter_open(&it, vol, dir)) != FAT_OK)
+        goto done;
+    while (slot_count < file_count && (slot = dir_iter_next(&it, &slot_offset)) != NULL) {
+        if (slot->filename[0] == 0x00 || slot->filename[0] == 0xE5)
+            slots[slot_count++] = slot_offset;
+    }
+    dir_iter_close(&it);
+
+    // Plan clusters for every file before any data moves, in disk order from
+    // one pass over the free map. Names that are already taken are skipped.
+    FreeCursor cursor;
+    freemap_cursor_init(&cursor, &vol->free_clusters);
+    for (int i = 0; i < file_count; i++) {
+        Fat16Entry entry;
+        if ((i > 0 && memcmp(files[i].key, files[i - 1].key, 11) == 0) ||
+            find_entry(vol, dir, files[i].key, &entry, NULL)) {
+            report->existing++;
+            continue;
+        }
+        if (report->files == slot_count) {
+            report->not_placed = file_count - i;
+            status = FAT_ERR_DIR_FULL;
+            break;
+        }
+
+        // Empty files get a directory entry and no clusters
+        unsigned int needed = (files[i].size + cluster_size - 1) / cluster_size;
+        files[i].planned = true;
+        report->files++;
+        if (needed == 0)
+            continue;
+        files[i].extent_count = freemap_cursor_alloc(&cursor, needed, &files[i].extents);
+        if (files[i].extent_count < 0) {
+            files[i].planned = false;
+            report->files--;
+            report->not_placed = file_count - i;
+            status = FAT_ERR_NO_SPACE;
+            files[i].extent_count = 0;
+            break;
+        }
+
+        unsigned long file_offset = 0;
+        for (int e = 0; e < files[i].extent_count; e++) {
+            if (piece_count == piece_capacity) {
+                piece_capacity = piece_capacity ? piece_capacity * 2 : 256;
+                ImportPiece *grown = realloc(pieces, piece_capacity * sizeof(ImportPiece));
+                if (grown == NULL) {
+                    status = FAT_ERR_NO_MEMORY;
+                    goto done;
+                }
+                pieces = grown;
+            }
+            unsigned long span = (unsigned long)files[i].extents[e].length * cluster_size;
+            ImportPiece *piece = &pieces[piece_count++];
+            piece->file = i;
+            piece->file_offset = file_offset;
+            files[i].pieces_left++;
+            piece->dst_offset = cluster_offset(vol, files[i].extents[e].start);
+            piece->length = files[i].size - file_offset < span ? files[i].size - file_offset : span;
+            piece->clusters = files[i].extents[e].length;
+            file_offset += piece->length;
+        }
+    }
+    report->extents = piece_count;
+    unlock_fat(vol);
+
+    qsort(pieces, piece_count, sizeof(ImportPiece), compare_import_dst);
+    int copied = import_copy(vol, files, pieces, piece_count, buffer, &report->bytes);
+    int relocked = lock_fat(vol, true);
+    if (relocked != FAT_OK) {
+        // Without the FAT the plan can't be handed back, its clusters stay
+        // taken in the free map until the next mount
+        fat_locked = false;
+        status = relocked;
+        goto done;
+    }
+    if (copied != FAT_OK) {
+        status = copied;
+        goto done;
+    }
+
+    // Data is in place, now the metadata: chains, entries, one flush
+    int next_slot = 0;
+    for (int i = 0; i < file_count; i++) {
+        if (!files[i].planned)
+            continue;
+        link_extents(vol, files[i].extents, files[i].extent_count);
+        report->fragmented += files[i].extent_count > 1;
+
+        Fat16Entry entry;
+        memset(&entry, 0, sizeof(Fat16Entry));
+        memcpy(entry.filename, files[i].key, 8);
+        memcpy(entry.ext, files[i].key + 8, 3);
+        entry.attributes = FAT_ATTR_ARCHIVE;
+        entry.file_size = files[i].size;
+        stamp_entry(&entry);
+        fat_set_entry_cluster(&entry, files[i].extent_count > 0 ? files[i].extents[0].start : 0);
+        cache_write(&vol->cache, slots[next_slot++], &entry, sizeof(Fat16Entry));
+    }
+    pthread_mutex_lock(&vol->index_lock);
+    dirindex_invalidate(&vol->dir_indexes, dir);
+    pthread_mutex_unlock(&vol->index_lock);
+    if ((flush_fat(vol) != FAT_OK || cache_flush(&vol->cache) != 0) && status == FAT_OK)
+        status = FAT_ERR_IO;
+    committed = true;
+
+done:
+    // Clusters of an import that failed are not referenced by anything yet
+    for (int i = 0; i < file_count; i++) {
+        if (!committed && fat_locked)
+            freemap_release_extents(&vol->free_clusters, files[i].extents, files[i].extent_count);
+        free(files[i].extents);
+        if (files[i].in != NULL)
+            fclose(files[i].in);
+    }
+    if (fat_locked)
+        unlock_fat(vol);
+    pthread_rwlock_unlock(dir_lock(vol, dir));
+    if (!committed) {
+        report->files = 0;
+        report->extents = 0;
+    }
+    free(files);
+    free(slots);
+    free(buffer);
+    free(pieces);
+    return status;
+}
@@ -0,0 +1,364 @@
+#include "ioengine.h"
+#include "stats.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+void ioengine_init(IoEngine *engine)
+{
+    memset(engine, 0, sizeof(IoEngine));
+    engine->kind = IO_ENGINE_SYNC;
+    engine->depth = 1;
+    engine->chunk_size = IO_DEFAULT_CHUNK;
+    engine->ring.ring_fd = -1;
+}
+
+static void ring_teardown(IoRing *ring)
+{
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ptr != NULL && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_len);
+    if (ring->sq_ptr != NULL)
+        munmap(ring->sq_ptr, ring->sq_len);
+    if (ring->ring_fd >= 0)
+        close(ring->ring_fd);
+    memset(ring, 0, sizeof(IoRing));
+    ring->ring_fd = -1;
+}
+
+static int ring_setup(IoRing *ring, unsigned int depth)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(IoRing));
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, depth, &p);
+    if (ring->ring_fd < 0)
+    {
+        ring->ring_fd = -1;
+        return -1;
+    }
+    ring->entries = p.sq_entries;
+
+    ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_len > ring->sq_len)
+            ring->sq_len = ring->cq_len;
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+    {
+        ring->sq_ptr = NULL;
+        ring_teardown(ring);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+        {
+            ring->cq_ptr = NULL;
+            ring_teardown(ring);
+            return -1;
+        }
+    }
+
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        ring_teardown(ring);
+        return -1;
+    }
+
+    unsigned char *sq = ring->sq_ptr;
+    unsigned char *cq = ring->cq_ptr;
+    ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+    ring->cqes = cq + p.cq_off.cqes;
+    return 0;
+}
+
+int ioengine_use_uring(IoEngine *engine, unsigned int depth)
+{
+    if (depth == 0)
+        depth = IO_DEFAULT_DEPTH;
+
+    ioengine_use_sync(engine);
+    if (ring_setup(&engine->ring, depth) != 0)
+        return -1;
+
+    engine->kind = IO_ENGINE_URING;
+    engine->depth = depth < engine->ring.entries ? depth : engine->ring.entries;
+    return 0;
+}
+
+void ioengine_use_sync(IoEngine *engine)
+{
+    if (engine->kind == IO_ENGINE_URING)
+        ring_teardown(&engine->ring);
+    engine->kind = IO_ENGINE_SYNC;
+    engine->depth = 1;
+}
+
+void ioengine_destroy(IoEngine *engine)
+{
+    ioengine_use_sync(engine);
+}
+
+static unsigned long copy_sync(IoEngine *engine, int src_fd, int dst_fd, const IoChunk *chunks, int count,
+                               IoConsumer consume, void *ctx)
+{
+    unsigned char *buffer = malloc(engine->chunk_size);
+    unsigned long copied = 0;
+    if (buffer == NULL)
+        return 0;
+
+    for (int c = 0; c < count; c++)
+    {
+        unsigned long done = 0;
+        while (done < chunks[c].length)
+        {
+            unsigned int n = chunks[c].length - done;
+            if (n > engine->chunk_size)
+                n = engine->chunk_size;
+
+            stat_add(STAT_SYSCALLS, 2);
+            if (pread(src_fd, buffer, n, chunks[c].src_offset + done) != (ssize_t)n)
+                goto out;
+            if (consume != NULL)
+                consume(ctx, buffer, n);
+            if (pwrite(dst_fd, buffer, n, chunks[c].dst_offset + done) != (ssize_t)n)
+                goto out;
+            done += n;
+            copied += n;
+        }
+    }
+out:
+    free(buffer);
+    return copied;
+}
+
+// Buffer slot of the io_uring pipeline
+typedef enum {
+    SLOT_FREE,
+    SLOT_READING,
+    SLOT_READY,
+    SLOT_WRITING
+} SlotState;
+
+typedef struct {
+    SlotState state;
+    unsigned long seq;          // position of the piece in the whole job
+    unsigned long src_offset;
+    unsigned long dst_offset;
+    unsigned int length;
+    unsigned int done;          // bytes finished by the current operation
+    unsigned char *buffer;
+} Slot;
+
+static void queue_op(IoRing *ring, int opcode, int fd, Slot *slot, unsigned int index)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int at = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + at;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(slot->buffer + slot->done);
+    sqe->len = slot->length - slot->done;
+    sqe->off = (opcode == IORING_OP_READ ? slot->src_offset : slot->dst_offset) + slot->done;
+    sqe->user_data = index;
+
+    ring->sq_array[at] = at;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_enter(IoRing *ring, unsigned int submit, unsigned int wait)
+{
+    int r;
+    do
+    {
+        r = syscall(__NR_io_uring_enter, ring->ring_fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        stat_add(STAT_SYSCALLS, 1);
+    } while (r < 0 && errno == EINTR);
+    return r;
+}
+
+static unsigned long copy_uring(IoEngine *engine, int src_fd, int dst_fd, const IoChunk *chunks, int count,
+                                IoConsumer consume, void *ctx)
+{
+    IoRing *ring = &engine->ring;
+    unsigned int depth = engine->depth;
+    Slot *slots = calloc(depth, sizeof(Slot));
+    unsigned char *buffers = malloc((unsigned long)depth * engine->chunk_size);
+    unsigned long copied = 0;
+    bool failed = false;
+
+    if (slots == NULL || buffers == NULL)
+    {
+        free(slots);
+        free(buffers);
+        return 0;
+    }
+    for (unsigned int i = 0; i < depth; i++)
+        slots[i].buffer = buffers + (unsigned long)i * engine->chunk_size;
+
+    int next_chunk = 0;             // job position for the next read
+    unsigned long next_done = 0;
+    unsigned long next_seq = 0;     // sequence number of the next read
+    unsigned long emit_seq = 0;     // next piece to hand to the consumer and write
+    unsigned int in_flight = 0;
+    unsigned int pending = 0;       // queued but not yet submitted
+
+    while (!failed)
+    {
+        // Fill free slots with reads
+        for (unsigned int i = 0; i < depth && next_chunk < count; i++)
+        {
+            if (slots[i].state != SLOT_FREE)
+                continue;
+
+            unsigned int n = chunks[next_chunk].length - next_done;
+            if (n > engine->chunk_size)
+                n = engine->chunk_size;
+
+            slots[i].state = SLOT_READING;
+            slots[i].seq = next_seq++;
+            slots[i].src_offset = chunks[next_chunk].src_offset + next_done;
+            slots[i].dst_offset = chunks[next_chunk].dst_offset + next_done;
+            slots[i].length = n;
+            slots[i].done = 0;
+            queue_op(ring, IORING_OP_READ, src_fd, &slots[i], i);
+            in_flight++;
+            pending++;
+
+            next_done += n;
+            if (next_done >= chunks[next_chunk].length)
+            {
+                next_chunk++;
+                next_done = 0;
+            }
+        }
+
+        // Pieces that finished reading go out in order
+        bool progressed = true;
+        while (progressed)
+        {
+            progressed = false;
+            for (unsigned int i = 0; i < depth; i++)
+            {
+                if (slots[i].state == SLOT_READY && slots[i].seq == emit_seq)
+                {
+                    if (consume != NULL)
+                        consume(ctx, slots[i].buffer, slots[i].length);
+                    slots[i].state = SLOT_WRITING;
+                    slots[i].done = 0;
+                    queue_op(ring, IORING_OP_WRITE, dst_fd, &slots[i], i);
+                    in_flight++;
+                    pending++;
+                    emit_seq++;
+                    progressed = true;
+                }
+            }
+        }
+
+        if (in_flight == 0)
+            break;
+
+        if (ring_enter(ring, pending, 1) < 0)
+        {
+            failed = true;
+            break;
+        }
+        pending = 0;
+
+        // Reap completions
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+            Slot *slot = &slots[cqe->user_data];
+            int res = cqe->res;
+            head++;
+            in_flight--;
+
+            if (res <= 0)
+            {
+                failed = true;
+                continue;
+            }
+
+            slot->done += res;
+            if (slot->done < slot->length)
+            {
+                // Short transfer, queue the rest
+                queue_op(ring, slot->state == SLOT_READING ? IORING_OP_READ : IORING_OP_WRITE,
+                         slot->state == SLOT_READING ? src_fd : dst_fd, slot, slot - slots);
+                in_flight++;
+                pending++;
+            }
+            else if (slot->state == SLOT_READING)
+            {
+                slot->state = SLOT_READY;
+            }
+            else
+            {
+                copied += slot->length;
+                slot->state = SLOT_FREE;
+            }
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // Don't free buffers the kernel may still be using
+    while (failed && in_flight > 0)
+    {
+        if (ring_enter(ring, pending, 1) < 0)
+            break;
+        pending = 0;
+        unsigned int head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            head++;
+            in_flight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    free(slots);
+    free(buffers);
+    return copied;
+}
+
+unsigned long ioengine_copy(IoEngine *engine, int src_fd, int dst_fd, const IoChunk *chunks, int count,
+                            IoConsumer consume, void *ctx)
+{
+    if (engine->kind == IO_ENGINE_URING)
+        return copy_uring(engine, src_fd, dst_fd, chunks, count, consume, ctx);
+    return copy_sync(engine, src_fd, dst_fd, chunks, count, consume, ctx);
+}
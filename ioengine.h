@@ -0,0 +1,61 @@
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <stdbool.h>
+
+// Bulk data mover between two file descriptors. The io_uring engine keeps up
+// to depth chunk reads and writes in flight so source reads overlap with
+// destination writes. When io_uring isn't available the engine stays
+// synchronous (pread then pwrite, one chunk at a time).
+
+typedef enum {
+    IO_ENGINE_SYNC,
+    IO_ENGINE_URING
+} IoEngineKind;
+
+// One piece of a copy job
+typedef struct {
+    unsigned long src_offset;
+    unsigned long dst_offset;
+    unsigned int length;
+} IoChunk;
+
+// Called with each chunk's data once it has been read, in chunk order,
+// before the data is written out
+typedef void (*IoConsumer)(void *ctx, const unsigned char *data, unsigned int length);
+
+typedef struct {
+    int ring_fd;
+    unsigned int entries;
+    unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned int *cq_head, *cq_tail, *cq_mask;
+    void *sqes;
+    void *cqes;
+    void *sq_ptr, *cq_ptr;
+    unsigned long sq_len, cq_len, sqes_len;
+} IoRing;
+
+typedef struct {
+    IoEngineKind kind;
+    unsigned int depth;         // chunks in flight
+    unsigned int chunk_size;    // largest single read or write
+    IoRing ring;
+} IoEngine;
+
+#define IO_DEFAULT_DEPTH 32
+#define IO_DEFAULT_CHUNK (128 * 1024)
+
+void ioengine_init(IoEngine *engine);
+
+// Switch to io_uring with the given queue depth. Returns -1 and stays
+// synchronous if the kernel doesn't provide io_uring.
+int ioengine_use_uring(IoEngine *engine, unsigned int depth);
+void ioengine_use_sync(IoEngine *engine);
+void ioengine_destroy(IoEngine *engine);
+
+// Copy every chunk from src_fd to dst_fd. Chunks longer than chunk_size are
+// split. Returns the number of bytes copied.
+unsigned long ioengine_copy(IoEngine *engine, int src_fd, int dst_fd, const IoChunk *chunks, int count,
+                            IoConsumer consume, void *ctx);
+
+#endif
@@ -0,0 +1,1724 @@
+#include "volume.h"
+#include "extract.h"
+#include "pool.h"
+#include "stats.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define READ_CHUNK (64 * 1024)  // size of one staging buffer in fat_stream()
+#define READ_CHUNKS 64          // staging buffers filled by a single preadv
+
+const char *fat_strerror(int error)
+{
+    switch (error)
+    {
+    case FAT_OK: return "Success";
+    case FAT_ERR_IO: return "I/O error";
+    case FAT_ERR_NO_MEMORY: return "Out of memory";
+    case FAT_ERR_NOT_FOUND: return "Not found";
+    case FAT_ERR_NOT_DIR: return "Not a directory";
+    case FAT_ERR_IS_DIR: return "Is a directory";
+    case FAT_ERR_EXISTS: return "Name already exists";
+    case FAT_ERR_NO_SPACE: return "No free clusters";
+    case FAT_ERR_DIR_FULL: return "No free directory entries";
+    case FAT_ERR_READ_ONLY: return "Image is opened read-only";
+    case FAT_ERR_BAD_NAME: return "Name has no 8.3 form";
+    case FAT_ERR_BAD_VOLUME: return "Not a FAT volume";
+    case FAT_ERR_UNSUPPORTED: return "Not supported";
+    }
+    return "Unknown error";
+}
+
+void fat_format_name(const unsigned char raw[11], char *name)
+{
+    int length = 8;
+    while (length > 0 && raw[length - 1] == ' ')
+        length--;
+    memcpy(name, raw, length);
+
+    int ext_length = 3;
+    while (ext_length > 0 && raw[8 + ext_length - 1] == ' ')
+        ext_length--;
+    if (ext_length > 0)
+    {
+        name[length++] = '.';
+        memcpy(name + length, raw + 8, ext_length);
+        length += ext_length;
+    }
+    name[length] = '\0';
+}
+
+static void compute_layout(FatVolume *vol)
+{
+    const Fat16BootSector *bs = &vol->bs;
+    const Fat32BootSector *bs32 = (const Fat32BootSector *)&vol->bs;
+    unsigned long part_start = vol->part_offset;
+    unsigned int root_sectors = (bs->root_dir_entries * 32 + bs->sector_size - 1) / bs->sector_size;
+
+    // FAT32 leaves the 16-bit FAT size at zero and uses the extended BPB
+    vol->fat_sectors = bs->fat_size_sectors ? bs->fat_size_sectors : bs32->fat_size_sectors_32;
+    vol->fat_offset = part_start + (unsigned long)bs->reserved_sectors * bs->sector_size;
+    vol->root_offset = vol->fat_offset + (unsigned long)bs->number_of_fats * vol->fat_sectors * bs->sector_size;
+    vol->data_offset = vol->root_offset + (unsigned long)root_sectors * bs->sector_size;
+    vol->cluster_size = bs->sectors_per_cluster * bs->sector_size;
+
+    // Data clusters on the volume decide the FAT type, limited by how many entries the FAT holds
+    unsigned long total_sectors = bs->total_sectors_short ? bs->total_sectors_short : bs->total_sectors_int;
+    unsigned long used_sectors = (vol->data_offset - part_start) / bs->sector_size;
+    unsigned long data_clusters = total_sectors > used_sectors ? (total_sectors - used_sectors) / bs->sectors_per_cluster : 0;
+    FatType type = bs->fat_size_sectors == 0 ? FAT32 : fat_type_for(data_clusters);
+    unsigned long fat_entries = fat_entries_for(type, (unsigned long)vol->fat_sectors * bs->sector_size);
+    vol->cluster_count = data_clusters + 2 < fat_entries ? data_clusters + 2 : fat_entries;
+    fattable_init(&vol->fat, type, vol->cluster_count);
+
+    vol->fat_copies = bs->number_of_fats;
+    vol->root_cluster = 0;
+    vol->fsinfo_offset = 0;
+    vol->volume_label = bs->volume_label;
+    if (type == FAT32)
+    {
+        vol->root_cluster = bs32->root_cluster;
+        vol->volume_label = bs32->volume_label;
+        if (bs32->fs_info_sector != 0 && bs32->fs_info_sector != 0xFFFF)
+            vol->fsinfo_offset = part_start + (unsigned long)bs32->fs_info_sector * bs->sector_size;
+
+        // Mirroring off: only the active FAT is read and written
+        if (bs32->ext_flags & 0x80)
+        {
+            vol->fat_offset += (unsigned long)(bs32->ext_flags & 0x0F) * vol->fat_sectors * bs->sector_size;
+            vol->fat_copies = 1;
+        }
+    }
+}
+
+unsigned long cluster_offset(const FatVolume *vol, unsigned int cluster)
+{
+    return fat_cluster_offset(vol->data_offset, vol->cluster_size, cluster);
+}
+
+void stamp_entry(Fat16Entry *entry)
+{
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    entry->modify_time = tm.tm_hour << 11 | tm.tm_min << 5 | tm.tm_sec / 2;
+    entry->modify_date = (tm.tm_year > 80 ? tm.tm_year - 80 : 0) << 9 | (tm.tm_mon + 1) << 5 | tm.tm_mday;
+}
+
+// Cluster 0 stands for the fixed root directory region
+unsigned long dir_offset(const FatVolume *vol, unsigned int cluster)
+{
+    return cluster == 0 ? vol->root_offset : cluster_offset(vol, cluster);
+}
+
+// Cache block covering an image offset: single sectors up to the root
+// directory, the fixed root region as one block, then data clusters
+static void block_bounds(void *ctx, unsigned long offset, unsigned long *start, unsigned int *length)
+{
+    const FatVolume *vol = ctx;
+    unsigned int sector_size = vol->bs.sector_size ? vol->bs.sector_size : 512;
+
+    if (vol->data_offset == 0 || offset < vol->root_offset)
+    {
+        *start = offset - offset % sector_size;
+        *length = sector_size;
+    }
+    else if (offset < vol->data_offset)
+    {
+        *start = vol->root_offset;
+        *length = vol->data_offset - vol->root_offset;
+    }
+    else
+    {
+        *start = offset - (offset - vol->data_offset) % vol->cluster_size;
+        *length = vol->cluster_size;
+    }
+}
+
+// Whether a boot sector read at offset describes a volume this code can use:
+// the signature, power of two sizes, and metadata regions inside the image
+static bool valid_boot_sector(const FatVolume *vol, const Fat16BootSector *bs, unsigned long offset)
+{
+    const Fat32BootSector *bs32 = (const Fat32BootSector *)bs;
+    unsigned int sector_size = bs->sector_size, spc = bs->sectors_per_cluster;
+    unsigned long total = bs->total_sectors_short ? bs->total_sectors_short : bs->total_sectors_int;
+    unsigned long fat_sectors = bs->fat_size_sectors ? bs->fat_size_sectors : bs32->fat_size_sectors_32;
+
+    if (bs->boot_sector_signature != 0xAA55)
+        return false;
+    if (sector_size < 512 || sector_size > 4096 || (sector_size & (sector_size - 1)) != 0)
+        return false;
+    if (spc == 0 || (spc & (spc - 1)) != 0)
+        return false;
+    if (bs->reserved_sectors == 0 || bs->number_of_fats == 0 || fat_sectors == 0 || total == 0)
+        return false;
+
+    // FAT32 keeps its root in a chain, the others in a fixed region
+    if (bs->fat_size_sectors == 0 ? bs32->root_cluster < 2 : bs->root_dir_entries == 0)
+        return false;
+
+    unsigned long root_sectors = (bs->root_dir_entries * 32UL + sector_size - 1) / sector_size;
+    unsigned long metadata = bs->reserved_sectors + bs->number_of_fats * fat_sectors + root_sectors;
+    if (metadata >= total)
+        return false;
+    return vol->img.size == 0 || offset + metadata * sector_size <= vol->img.size;
+}
+
+// Find the boot sector and fill in bs, pt and part_offset. Normally it starts
+// the first MBR partition, whose start is counted in 512 byte sectors or, on
+// 4K native disks, in the volume's own sector size. A disk without a
+// partition table has it in sector 0.
+// Partition entries start at offset 0x1BE, see http://www.cse.scu.edu/~tschwarz/coen252_07Fall/Lectures/HDPartitions.html
+// Boot sector starts the first partition, see http://www.tavi.co.uk/phobos/fat.html#boot_block
+static int find_boot_sector(FatVolume *vol)
+{
+    unsigned char mbr[512];
+    Fat16BootSector bs;
+    if (image_read(&vol->img, 0, mbr, sizeof(mbr)) != sizeof(mbr) || mbr[510] != 0x55 || mbr[511] != 0xAA)
+        return FAT_ERR_BAD_VOLUME;
+
+    // A boot sector opens with a jump over the BPB, an MBR with boot code
+    memcpy(&bs, mbr, sizeof(bs));
+    if ((mbr[0] == 0xEB || mbr[0] == 0xE9) && valid_boot_sector(vol, &bs, 0))
+    {
+        vol->bs = bs;
+        vol->part_offset = 0;
+        return FAT_OK;
+    }
+
+    memcpy(vol->pt, mbr + 0x1BE, sizeof(vol->pt));
+    if (vol->pt[0].partition_type == 0 || vol->pt[0].start_sector == 0)
+        return FAT_ERR_BAD_VOLUME;
+    for (unsigned int unit = 512; unit <= 4096; unit *= 2)
+    {
+        unsigned long offset = (unsigned long)vol->pt[0].start_sector * unit;
+        if (image_read(&vol->img, offset, &bs, sizeof(bs)) == sizeof(bs) && valid_boot_sector(vol, &bs, offset) &&
+            (unit == 512 || bs.sector_size == unit))
+        {
+            vol->bs = bs;
+            vol->part_offset = offset;
+            return FAT_OK;
+        }
+    }
+    return FAT_ERR_BAD_VOLUME;
+}
+
+int fat_mount(const char *path, FatMountFlags flags, FatVolume **mounted)
+{
+    *mounted = NULL;
+    FatVolume *vol = calloc(1, sizeof(FatVolume));
+    if (vol == NULL)
+        return FAT_ERR_NO_MEMORY;
+
+    // Read-write if we may and can, read-only otherwise
+    if ((flags == FAT_MOUNT_READ_ONLY || image_open(&vol->img, path, IMAGE_READ_WRITE) != 0) &&
+        image_open(&vol->img, path, IMAGE_READ_ONLY) != 0)
+    {
+        free(vol);
+        return FAT_ERR_IO;
+    }
+    cache_init(&vol->cache, &vol->img, block_bounds, vol, CACHE_DEFAULT_BUDGET);
+    ioengine_init(&vol->io_engine);
+    pthread_rwlock_init(&vol->fat_lock, NULL);
+    for (int i = 0; i < DIR_LOCKS; i++)
+        pthread_rwlock_init(&vol->dir_locks[i], NULL);
+    pthread_mutex_init(&vol->index_lock, NULL);
+    pthread_mutex_init(&vol->io_lock, NULL);
+
+    // Only the two sectors that locate the volume are read here, past the
+    // cache so its blocks follow the real sector size. The FAT and the
+    // directory indexes are loaded on first use.
+    int status = find_boot_sector(vol);
+    if (status != FAT_OK)
+    {
+        fat_unmount(vol);
+        return status;
+    }
+    compute_layout(vol);
+
+    *mounted = vol;
+    return FAT_OK;
+}
+
+int fat_unmount(FatVolume *vol)
+{
+    if (vol == NULL)
+        return FAT_OK;
+
+    int status = fat_flush(vol);
+    free(vol->fat.data);
+    free(vol->fat_dirty);
+    free(vol->deferred);
+    dirindex_clear(&vol->dir_indexes);
+    freemap_destroy(&vol->free_clusters);
+    ioengine_destroy(&vol->io_engine);
+    cache_destroy(&vol->cache);
+    image_close(&vol->img);
+    pthread_rwlock_destroy(&vol->fat_lock);
+    for (int i = 0; i < DIR_LOCKS; i++)
+        pthread_rwlock_destroy(&vol->dir_locks[i]);
+    pthread_mutex_destroy(&vol->index_lock);
+    pthread_mutex_destroy(&vol->io_lock);
+    free(vol);
+    return status;
+}
+
+int fat_flush(FatVolume *vol)
+{
+    int status = FAT_OK;
+    pthread_rwlock_wrlock(&vol->fat_lock);
+    if (vol->fat.data != NULL)
+        status = flush_fat(vol);
+    pthread_rwlock_unlock(&vol->fat_lock);
+    if (cache_flush(&vol->cache) != 0)
+        status = FAT_ERR_IO;
+    return status;
+}
+
+void fat_volume_info(const FatVolume *vol, FatVolumeInfo *info)
+{
+    memset(info, 0, sizeof(FatVolumeInfo));
+    info->fat_type = vol->fat.type;
+    memcpy(info->label, vol->volume_label, 11);
+    info->sector_size = vol->bs.sector_size;
+    info->cluster_size = vol->cluster_size;
+    info->data_clusters = vol->cluster_count > 2 ? vol->cluster_count - 2 : 0;
+    info->root_cluster = vol->root_cluster;
+    info->read_only = !volume_writable(vol);
+    info->mapped = image_is_mapped(&vol->img);
+    for (int i = 0; i < 4; i++)
+    {
+        info->partitions[i].type = vol->pt[i].partition_type;
+        info->partitions[i].start_sector = vol->pt[i].start_sector;
+        info->partitions[i].length_sectors = vol->pt[i].length_sectors;
+    }
+    info->fat_bytes_flushed = vol->fat_bytes_flushed;
+}
+
+long fat_free_clusters(FatVolume *vol)
+{
+    int status = lock_fat(vol, false);
+    if (status != FAT_OK)
+        return status;
+    long free_count = vol->free_clusters.free_count;
+    unlock_fat(vol);
+    return free_count;
+}
+
+// Read the FAT and index its free clusters, with fat_lock held exclusively
+static int load_fat(FatVolume *vol)
+{
+    if (vol->fat.data != NULL)
+        return FAT_OK;
+
+    unsigned long fat_size_bytes = (unsigned long)vol->fat_sectors * vol->bs.sector_size;
+    vol->fat.data = malloc(fat_size_bytes);
+    vol->fat.bytes = fat_size_bytes;
+    vol->fat_dirty = calloc(vol->fat_sectors, 1);
+    if (vol->fat.data == NULL || vol->fat_dirty == NULL)
+        goto fail_memory;
+
+    // Read the first FAT copy
+    if (cache_read(&vol->cache, vol->fat_offset, vol->fat.data, fat_size_bytes) != fat_size_bytes)
+    {
+        free(vol->fat.data);
+        free(vol->fat_dirty);
+        vol->fat.data = NULL;
+        vol->fat_dirty = NULL;
+        return FAT_ERR_IO;
+    }
+
+    // Index the free clusters once, writes and unlinks keep it current
+    if (freemap_build(&vol->free_clusters, &vol->fat) != 0)
+        goto fail_memory;
+    return FAT_OK;
+
+fail_memory:
+    free(vol->fat.data);
+    free(vol->fat_dirty);
+    vol->fat.data = NULL;
+    vol->fat_dirty = NULL;
+    return FAT_ERR_NO_MEMORY;
+}
+
+int lock_fat(FatVolume *vol, bool exclusive)
+{
+    for (;;)
+    {
+        if (exclusive)
+            pthread_rwlock_wrlock(&vol->fat_lock);
+        else
+            pthread_rwlock_rdlock(&vol->fat_lock);
+        if (vol->fat.data != NULL)
+            return FAT_OK;
+
+        // First use of the FAT, load it exclusively and then take the lock asked for
+        if (!exclusive)
+        {
+            pthread_rwlock_unlock(&vol->fat_lock);
+            pthread_rwlock_wrlock(&vol->fat_lock);
+        }
+        int status = vol->fat.data != NULL ? FAT_OK : load_fat(vol);
+        if (status != FAT_OK || !exclusive)
+            pthread_rwlock_unlock(&vol->fat_lock);
+        if (status != FAT_OK || exclusive)
+            return status;
+    }
+}
+
+void unlock_fat(FatVolume *vol)
+{
+    pthread_rwlock_unlock(&vol->fat_lock);
+}
+
+void release_clusters(FatVolume *vol, const Extent *extents, int extent_count)
+{
+    if (__atomic_load_n(&vol->open_files, __ATOMIC_ACQUIRE) == 0)
+    {
+        freemap_release_extents(&vol->free_clusters, extents, extent_count);
+        return;
+    }
+
+    if (vol->deferred_count + extent_count > vol->deferred_capacity)
+    {
+        int capacity = (vol->deferred_count + extent_count) * 2;
+        Extent *grown = realloc(vol->deferred, capacity * sizeof(Extent));
+        if (grown == NULL)
+            return;     // lost until the next mount rebuilds the free map
+        vol->deferred = grown;
+        vol->deferred_capacity = capacity;
+    }
+    memcpy(vol->deferred + vol->deferred_count, extents, extent_count * sizeof(Extent));
+    vol->deferred_count += extent_count;
+}
+
+int lock_dir_shared(FatVolume *vol, unsigned int dir)
+{
+    pthread_rwlock_rdlock(dir_lock(vol, dir));
+    if (dir == 0 && vol->root_cluster == 0)
+        return FAT_OK;
+    int status = lock_fat(vol, false);
+    if (status != FAT_OK)
+        pthread_rwlock_unlock(dir_lock(vol, dir));
+    return status;
+}
+
+void unlock_dir_shared(FatVolume *vol, unsigned int dir)
+{
+    if (dir != 0 || vol->root_cluster != 0)
+        unlock_fat(vol);
+    pthread_rwlock_unlock(dir_lock(vol, dir));
+}
+
+// Read one FAT entry, counted as a FAT lookup
+unsigned int get_fat_entry(FatVolume *vol, unsigned int cluster)
+{
+    stat_add(STAT_FAT_LOOKUPS, 1);
+    return vol->fat.ops->get(&vol->fat, cluster);
+}
+
+// Change one FAT entry in memory and remember which sectors need flushing,
+// a FAT12 entry can straddle two
+void set_fat_entry(FatVolume *vol, unsigned int cluster, unsigned int value)
+{
+    unsigned long offset = fat_entry_offset(&vol->fat, cluster);
+    vol->fat.ops->set(&vol->fat, cluster, value);
+    vol->fat_dirty[offset / vol->bs.sector_size] = 1;
+    vol->fat_dirty[(offset + fat_entry_size(&vol->fat) - 1) / vol->bs.sector_size] = 1;
+}
+
+// Write the dirty FAT sectors to every FAT copy on the volume. Neighbouring
+// dirty sectors are merged so each run costs one write per copy.
+int flush_fat(FatVolume *vol)
+{
+    unsigned int sector_size = vol->bs.sector_size;
+    unsigned long fat_size_bytes = (unsigned long)vol->fat_sectors * sector_size;
+    unsigned long flushed = 0, expected = 0;
+    int runs = 0;
+
+    unsigned int sector = 0;
+    while (sector < vol->fat_sectors)
+    {
+        if (!vol->fat_dirty[sector])
+        {
+            sector++;
+            continue;
+        }
+
+        unsigned int run_start = sector;
+        while (sector < vol->fat_sectors && vol->fat_dirty[sector])
+        {
+            vol->fat_dirty[sector++] = 0;
+        }
+
+        unsigned long offset = (unsigned long)run_start * sector_size;
+        unsigned long length = (unsigned long)(sector - run_start) * sector_size;
+        for (unsigned int i = 0; i < vol->fat_copies; i++)
+        {
+            flushed += cache_write(&vol->cache, vol->fat_offset + i * fat_size_bytes + offset,
+                                   vol->fat.data + offset, length);
+            expected += length;
+        }
+        runs++;
+    }
+
+    if (runs > 0)
+        stat_add(STAT_FAT_FLUSHES, 1);
+
+    // The FSInfo free cluster count and hint are stale now, mark them unknown
+    unsigned int signature = 0;
+    if (runs > 0 && vol->fsinfo_offset != 0 &&
+        cache_read(&vol->cache, vol->fsinfo_offset, &signature, 4) == 4 && signature == 0x41615252)
+    {
+        unsigned int unknown[2] = {0xFFFFFFFF, 0xFFFFFFFF};
+        cache_write(&vol->cache, vol->fsinfo_offset + 488, unknown, sizeof(unknown));
+        vol->fsinfo_offset = 0;
+    }
+    vol->fat_bytes_flushed += flushed;
+    return flushed == expected ? FAT_OK : FAT_ERR_IO;
+}
+
+static void dir_iter_fetch(DirIter *it)
+{
+    FatVolume *vol = it->vol;
+    it->count = it->cluster == 0 ? vol->bs.root_dir_entries : vol->cluster_size / sizeof(Fat16Entry);
+    it->pos = 0;
+    it->entries = cache_get(&vol->cache, dir_offset(vol, it->cluster), it->count * sizeof(Fat16Entry));
+    if (it->entries == NULL)
+        it->count = 0;
+}
+
+int dir_iter_open(DirIter *it, FatVolume *vol, unsigned int cluster)
+{
+    memset(it, 0, sizeof(DirIter));
+    it->vol = vol;
+
+    // A FAT32 root is an ordinary chain
+    if (cluster == 0)
+        cluster = vol->root_cluster;
+
+    it->cluster = cluster;
+    it->clusters_left = vol->cluster_count;
+    dir_iter_fetch(it);
+    return it->entries != NULL ? FAT_OK : FAT_ERR_IO;
+}
+
+// Next raw slot of the directory, including free and deleted ones. Returns
+// NULL past the last slot. entry_offset receives the slot's image offset.
+const Fat16Entry *dir_iter_next(DirIter *it, unsigned long *entry_offset)
+{
+    FatVolume *vol = it->vol;
+    while (it->pos >= it->count)
+    {
+        if (it->cluster == 0 || it->entries == NULL || --it->clusters_left == 0)
+            return NULL;
+
+        unsigned int next = get_fat_entry(vol, it->cluster);
+        stat_add(STAT_CLUSTERS, 1);
+        if (!fat_is_next(&vol->fat, next))
+            return NULL;
+
+        cache_put(&vol->cache, dir_offset(vol, it->cluster));
+        it->cluster = next;
+        dir_iter_fetch(it);
+    }
+
+    if (entry_offset != NULL)
+        *entry_offset = dir_offset(vol, it->cluster) + it->pos * sizeof(Fat16Entry);
+    return &it->entries[it->pos++];
+}
+
+// Rest of the current block as one array, for scanning it in bulk. Returns
+// NULL past the last block; first_offset receives the image offset of the
+// first entry handed out.
+const Fat16Entry *dir_iter_next_block(DirIter *it, unsigned int *count, unsigned long *first_offset)
+{
+    const Fat16Entry *first = dir_iter_next(it, first_offset);
+    if (first == NULL)
+        return NULL;
+
+    *count = it->count - (it->pos - 1);
+    it->pos = it->count;
+    return first;
+}
+
+void dir_iter_close(DirIter *it)
+{
+    if (it->entries != NULL)
+        cache_put(&it->vol->cache, dir_offset(it->vol, it->cluster));
+    it->entries = NULL;
+    it->count = it->pos = 0;
+}
+
+static void to_dirent(const FatVolume *vol, const Fat16Entry *entry, FatDirent *dirent)
+{
+    memset(dirent, 0, sizeof(FatDirent));
+    memcpy(dirent->raw_name, entry->filename, 8);
+    memcpy(dirent->raw_name + 8, entry->ext, 3);
+    fat_format_name(dirent->raw_name, dirent->name);
+    dirent->attributes = entry->attributes;
+    dirent->is_dir = (entry->attributes & FAT_ATTR_DIRECTORY) != 0;
+    dirent->cluster = dirent->is_dir ? entry_dir_cluster(vol, entry) : fat_entry_cluster(&vol->fat, entry);
+    dirent->size = entry->file_size;
+    dirent->modify_time = entry->modify_time;
+    dirent->modify_date = entry->modify_date;
+}
+
+int fat_dir_open(FatVolume *vol, unsigned int dir, FatDir **opened)
+{
+    *opened = NULL;
+    FatDir *d = malloc(sizeof(FatDir));
+    if (d == NULL)
+        return FAT_ERR_NO_MEMORY;
+    d->dir = dir;
+
+    int status = lock_dir_shared(vol, dir);
+    if (status == FAT_OK)
+    {
+        status = dir_iter_open(&d->it, vol, dir);
+        unlock_dir_shared(vol, dir);
+    }
+    if (status != FAT_OK)
+    {
+        free(d);
+        return status;
+    }
+    *opened = d;
+    return FAT_OK;
+}
+
+int fat_dir_next(FatDir *d, FatDirent *dirent)
+{
+    FatVolume *vol = d->it.vol;
+    const Fat16Entry *entry;
+    int found = 0;
+    if (lock_dir_shared(vol, d->dir) != FAT_OK)
+        return 0;
+    while (!found && (entry = dir_iter_next(&d->it, NULL)) != NULL)
+    {
+        if (entry->filename[0] == 0x00)
+            break;
+        if (entry->filename[0] == 0xE5 || (entry->attributes & FAT_ATTR_VOLUME_LABEL))
+            continue;
+
+        to_dirent(vol, entry, dirent);
+        found = 1;
+    }
+    unlock_dir_shared(vol, d->dir);
+    return found;
+}
+
+void fat_dir_close(FatDir *d)
+{
+    if (d == NULL)
+        return;
+    dir_iter_close(&d->it);
+    free(d);
+}
+
+// Name index of a directory, built from a full scan on the first visit
+static DirIndex *get_dir_index(FatVolume *vol, unsigned int cluster)
+{
+    DirIndex *index = dirindex_find(&vol->dir_indexes, cluster);
+    if (index != NULL)
+        return index;
+
+    DirIter it;
+    if (dir_iter_open(&it, vol, cluster) != FAT_OK)
+        return NULL;
+
+    index = dirindex_create(&vol->dir_indexes, cluster);
+
+    const Fat16Entry *entry;
+    unsigned long entry_offset;
+    while (index != NULL && (entry = dir_iter_next(&it, &entry_offset)) != NULL)
+    {
+        if (entry->filename[0] == 0x00)
+            break;
+        if (entry->filename[0] == 0xE5)
+            continue;
+        if (entry->attributes & 0x08)
+            continue;
+
+        if (dirindex_insert(index, entry, entry_offset) != 0)
+        {
+            dirindex_invalidate(&vol->dir_indexes, cluster);
+            index = NULL;
+        }
+    }
+    dir_iter_close(&it);
+    return index;
+}
+
+// Search a directory for an 8.3 name block by block with the SIMD kernel
+static bool scan_entry(FatVolume *vol, unsigned int dir_cluster, const unsigned char key[11], Fat16Entry *entry,
+                       unsigned long *entry_offset)
+{
+    DirIter it;
+    const Fat16Entry *block;
+    unsigned int count;
+    unsigned long block_offset;
+    bool end = false, found = false;
+
+    if (dir_iter_open(&it, vol, dir_cluster) != FAT_OK)
+        return false;
+    while (!found && !end && (block = dir_iter_next_block(&it, &count, &block_offset)) != NULL)
+    {
+        int i = simd_find_name(block, count, key, &end);
+        if (i >= 0)
+        {
+            *entry = block[i];
+            if (entry_offset != NULL)
+                *entry_offset = block_offset + i * sizeof(Fat16Entry);
+            found = true;
+        }
+    }
+    dir_iter_close(&it);
+    return found;
+}
+
+bool find_entry(FatVolume *vol, unsigned int dir_cluster, const unsigned char key[11], Fat16Entry *entry,
+                unsigned long *entry_offset)
+{
+    // First visit: one vector scan over the directory blocks, no index
+    pthread_mutex_lock(&vol->index_lock);
+    DirIndex *index = dirindex_find(&vol->dir_indexes, dir_cluster);
+    if (index == NULL && !dirindex_seen(&vol->dir_indexes, dir_cluster))
+    {
+        pthread_mutex_unlock(&vol->index_lock);
+        return scan_entry(vol, dir_cluster, key, entry, entry_offset);
+    }
+
+    if (index == NULL)
+        index = get_dir_index(vol, dir_cluster);
+    const DirIndexSlot *slot = index != NULL ? dirindex_lookup(index, key) : NULL;
+    if (slot != NULL)
+    {
+        *entry = slot->entry;
+        if (entry_offset != NULL)
+            *entry_offset = slot->offset;
+    }
+    pthread_mutex_unlock(&vol->index_lock);
+    return slot != NULL;
+}
+
+int resolve_parent(FatVolume *vol, unsigned int dir, const char *path, unsigned int *parent, unsigned char key[11])
+{
+    char path_copy[256];
+    if (strlen(path) >= sizeof(path_copy))
+        return FAT_ERR_BAD_NAME;
+    strcpy(path_copy, path);
+
+    *parent = path_copy[0] == '/' ? 0 : dir;
+    char *saved;
+    char *last = NULL;
+    for (char *token = strtok_r(path_copy, "/", &saved); token != NULL; token = strtok_r(NULL, "/", &saved)) {
+        if (strcmp(token, ".") == 0)
+            continue;
+        if (last == NULL) {
+            last = token;
+            continue;
+        }
+
+        // Every component before the last has to be a directory
+        Fat16Entry found;
+        if (!name_to_83(last, key))
+            return FAT_ERR_NOT_FOUND;
+        int status = lock_dir_shared(vol, *parent);
+        if (status != FAT_OK)
+            return status;
+        bool exists = find_entry(vol, *parent, key, &found, NULL);
+        unlock_dir_shared(vol, *parent);
+        if (!exists)
+            return FAT_ERR_NOT_FOUND;
+        if (!(found.attributes & FAT_ATTR_DIRECTORY))
+            return FAT_ERR_NOT_DIR;
+        *parent = entry_dir_cluster(vol, &found);
+        last = token;
+    }
+
+    if (last == NULL)
+        return 1;
+    return name_to_83(last, key) ? 0 : FAT_ERR_NOT_FOUND;
+}
+
+int resolve_path(FatVolume *vol, unsigned int dir, const char *path, unsigned int *cluster, Fat16Entry *entry,
+                 unsigned long *entry_offset)
+{
+    // A path naming the start directory itself has no entry of its own
+    memset(entry, 0, sizeof(Fat16Entry));
+    entry->attributes = FAT_ATTR_DIRECTORY;
+
+    unsigned char key[11];
+    int kind = resolve_parent(vol, dir, path, cluster, key);
+    if (kind != 0)
+        return kind;
+
+    Fat16Entry found;
+    unsigned long found_offset;
+    int status = lock_dir_shared(vol, *cluster);
+    if (status != FAT_OK)
+        return status;
+    bool exists = find_entry(vol, *cluster, key, &found, &found_offset);
+    unlock_dir_shared(vol, *cluster);
+    if (!exists)
+        return FAT_ERR_NOT_FOUND;
+
+    *entry = found;
+    if (entry_offset != NULL)
+        *entry_offset = found_offset;
+    if (!(found.attributes & FAT_ATTR_DIRECTORY))
+        return 0;
+    *cluster = entry_dir_cluster(vol, &found);
+    return 1;
+}
+
+int fat_lookup(FatVolume *vol, unsigned int dir, const char *path, FatDirent *dirent)
+{
+    unsigned int cluster;
+    Fat16Entry entry;
+    int kind = resolve_path(vol, dir, path, &cluster, &entry, NULL);
+    if (kind < 0)
+        return kind;
+
+    to_dirent(vol, &entry, dirent);
+    if (kind == 1)
+        dirent->cluster = cluster;
+    return FAT_OK;
+}
+
+typedef struct {
+    Extent *extents;
+    int count;
+    int capacity;
+    bool failed;
+} ExtentList;
+
+static void add_extent(void *ctx, unsigned int start, unsigned int length)
+{
+    ExtentList *list = ctx;
+    if (list->failed)
+        return;
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        Extent *grown = realloc(list->extents, capacity * sizeof(Extent));
+        if (grown == NULL)
+        {
+            list->failed = true;
+            return;
+        }
+        list->extents = grown;
+        list->capacity = capacity;
+    }
+    list->extents[list->count].start = start;
+    list->extents[list->count].length = length;
+    list->count++;
+}
+
+int build_extents(FatVolume *vol, unsigned int start, unsigned int max_clusters, Extent **extents)
+{
+    ExtentList list = {NULL, 0, 0, false};
+    vol->fat.ops->walk(&vol->fat, start, max_clusters, add_extent, &list);
+    if (list.failed)
+    {
+        free(list.extents);
+        *extents = NULL;
+        return -1;
+    }
+    *extents = list.extents;
+    return list.count;
+}
+
+// Chain the clusters of the extents together in order, the last one ends the file
+void link_extents(FatVolume *vol, const Extent *extents, int extent_count)
+{
+    for (int e = 0; e < extent_count; e++) {
+        unsigned int last = extents[e].start + extents[e].length - 1;
+        for (unsigned int cluster = extents[e].start; cluster < last; cluster++)
+            set_fat_entry(vol, cluster, cluster + 1);
+        set_fat_entry(vol, last, e + 1 < extent_count ? extents[e + 1].start : vol->fat.eoc);
+    }
+}
+
+int fat_open(FatVolume *vol, unsigned int dir, const char *path, FatFile **opened)
+{
+    *opened = NULL;
+    unsigned int parent;
+    unsigned char key[11];
+    int kind = resolve_parent(vol, dir, path, &parent, key);
+    if (kind != 0)
+        return kind == 1 ? FAT_ERR_IS_DIR : kind;
+
+    FatFile *file = calloc(1, sizeof(FatFile));
+    if (file == NULL)
+        return FAT_ERR_NO_MEMORY;
+    file->vol = vol;
+    file->dir_cluster = parent;
+
+    // Entry and chain are read under the locks an unlink needs exclusively,
+    // and the open count keeps the clusters from being handed out again
+    pthread_rwlock_rdlock(dir_lock(vol, parent));
+    int status = lock_fat(vol, false);
+    if (status == FAT_OK)
+    {
+        if (!find_entry(vol, parent, key, &file->entry, &file->entry_offset))
+            status = FAT_ERR_NOT_FOUND;
+        else if (file->entry.attributes & FAT_ATTR_DIRECTORY)
+            status = FAT_ERR_IS_DIR;
+        else
+        {
+            // The chain as extents, so each contiguous run moves with one I/O
+            file->extent_count = build_extents(vol, fat_entry_cluster(&vol->fat, &file->entry),
+                                               (file->entry.file_size + vol->cluster_size - 1) / vol->cluster_size,
+                                               &file->extents);
+            if (file->extent_count < 0 ||
+                (file->extent_offsets = malloc((file->extent_count + 1) * sizeof(unsigned long))) == NULL)
+                status = FAT_ERR_NO_MEMORY;
+            else
+            {
+                // Where each extent starts in the file, for fat_read to search
+                unsigned long offset = 0;
+                for (int e = 0; e < file->extent_count; e++)
+                {
+                    file->extent_offsets[e] = offset;
+                    offset += (unsigned long)file->extents[e].length * vol->cluster_size;
+                }
+                __atomic_add_fetch(&vol->open_files, 1, __ATOMIC_ACQ_REL);
+            }
+        }
+        unlock_fat(vol);
+    }
+    pthread_rwlock_unlock(dir_lock(vol, parent));
+
+    if (status != FAT_OK)
+    {
+        free(file->extents);
+        free(file->extent_offsets);
+        free(file);
+        return status;
+    }
+    *opened = file;
+    return FAT_OK;
+}
+
+void fat_close(FatFile *file)
+{
+    if (file == NULL)
+        return;
+    FatVolume *vol = file->vol;
+    free(file->extents);
+    free(file->extent_offsets);
+    free(file);
+
+    // The last file out ends the grace period of the clusters freed meanwhile
+    if (__atomic_sub_fetch(&vol->open_files, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        pthread_rwlock_wrlock(&vol->fat_lock);
+        if (__atomic_load_n(&vol->open_files, __ATOMIC_ACQUIRE) == 0 && vol->deferred_count > 0)
+        {
+            freemap_release_extents(&vol->free_clusters, vol->deferred, vol->deferred_count);
+            vol->deferred_count = 0;
+        }
+        pthread_rwlock_unlock(&vol->fat_lock);
+    }
+}
+
+void fat_file_info(const FatFile *file, FatDirent *dirent)
+{
+    to_dirent(file->vol, &file->entry, dirent);
+}
+
+int fat_file_extents(const FatFile *file)
+{
+    return file->extent_count;
+}
+
+long fat_read(FatFile *file, void *buf, unsigned long len, unsigned long offset)
+{
+    FatVolume *vol = file->vol;
+    unsigned long size = file->entry.file_size;
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+
+    // Last extent starting at or before offset, the rest follow in order
+    int low = 0, high = file->extent_count - 1;
+    while (low < high)
+    {
+        int mid = (low + high + 1) / 2;
+        if (file->extent_offsets[mid] <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    unsigned long done = 0;
+    for (int e = low; e < file->extent_count && done < len; e++)
+    {
+        unsigned long extent_bytes = (unsigned long)file->extents[e].length * vol->cluster_size;
+        unsigned long within = offset + done - file->extent_offsets[e];
+        if (within >= extent_bytes)
+            break;      // chain shorter than the file
+        unsigned long n = extent_bytes - within < len - done ? extent_bytes - within : len - done;
+        unsigned long at = cluster_offset(vol, file->extents[e].start) + within;
+
+        // Positional read past the cache, so readers of different files don't queue on it
+        if (cache_sync_range(&vol->cache, at, n) != 0 ||
+            image_read(&vol->img, at, (unsigned char *)buf + done, n) != n)
+            return FAT_ERR_IO;
+        done += n;
+    }
+    return done;
+}
+
+// Copy the extents straight from the image (mapped) or with one preadv per
+// extent into staging buffers (unmapped images)
+int fat_stream(FatFile *file, FILE *out, unsigned long *bytes)
+{
+    FatVolume *vol = file->vol;
+    unsigned long file_size = file->entry.file_size;
+    *bytes = 0;
+
+    // Staging buffers for images that aren't mapped
+    unsigned char *staging = NULL;
+    struct iovec iov[READ_CHUNKS];
+    if (!image_is_mapped(&vol->img))
+    {
+        staging = malloc(READ_CHUNK * READ_CHUNKS);
+        if (staging == NULL)
+            return FAT_ERR_NO_MEMORY;
+    }
+
+    int status = FAT_OK;
+    for (int e = 0; e < file->extent_count && *bytes < file_size; e++)
+    {
+        unsigned long offset = cluster_offset(vol, file->extents[e].start);
+        unsigned long extent_bytes = (unsigned long)file->extents[e].length * vol->cluster_size;
+        if (extent_bytes > file_size - *bytes)
+            extent_bytes = file_size - *bytes;
+
+        if (staging == NULL)
+        {
+            // Mapped image, the whole extent is already in memory
+            const unsigned char *data = cache_acquire(&vol->cache, offset, extent_bytes);
+            if (data == NULL)
+            {
+                status = FAT_ERR_IO;
+                break;
+            }
+            fwrite(data, 1, extent_bytes, out);
+            cache_release(&vol->cache, data);
+            *bytes += extent_bytes;
+            continue;
+        }
+
+        // One preadv per extent, split into batches only if it outgrows the staging buffers
+        while (extent_bytes > 0)
+        {
+            unsigned long batch = extent_bytes < READ_CHUNK * READ_CHUNKS ? extent_bytes : READ_CHUNK * READ_CHUNKS;
+            int iovcnt = 0;
+            for (unsigned long filled = 0; filled < batch; filled += READ_CHUNK, iovcnt++)
+            {
+                iov[iovcnt].iov_base = staging + filled;
+                iov[iovcnt].iov_len = batch - filled < READ_CHUNK ? batch - filled : READ_CHUNK;
+            }
+
+            if (cache_readv(&vol->cache, offset, iov, iovcnt) != batch)
+            {
+                status = FAT_ERR_IO;
+                break;
+            }
+            for (int i = 0; i < iovcnt; i++)
+            {
+                fwrite(iov[i].iov_base, 1, iov[i].iov_len, out);
+            }
+
+            offset += batch;
+            extent_bytes -= batch;
+            *bytes += batch;
+        }
+        if (status != FAT_OK)
+            break;
+    }
+
+    free(staging);
+    if (status == FAT_OK && *bytes != file_size)
+        status = FAT_ERR_IO;
+    return status;
+}
+
+// Hand the extents to the I/O engine, image reads overlap output file writes
+static int save_engine(FatFile *file, FILE *out, unsigned long *bytes)
+{
+    FatVolume *vol = file->vol;
+    unsigned long file_size = file->entry.file_size;
+    IoChunk *chunks = malloc((file->extent_count ? file->extent_count : 1) * sizeof(IoChunk));
+    if (chunks == NULL)
+        return FAT_ERR_NO_MEMORY;
+
+    unsigned long planned = 0;
+    int count = 0;
+    for (int e = 0; e < file->extent_count && planned < file_size; e++, count++)
+    {
+        unsigned long extent_bytes = (unsigned long)file->extents[e].length * vol->cluster_size;
+        if (extent_bytes > file_size - planned)
+            extent_bytes = file_size - planned;
+
+        chunks[count].src_offset = cluster_offset(vol, file->extents[e].start);
+        chunks[count].dst_offset = planned;
+        chunks[count].length = extent_bytes;
+        if (cache_sync_range(&vol->cache, chunks[count].src_offset, extent_bytes) != 0)
+        {
+            free(chunks);
+            return FAT_ERR_IO;
+        }
+        planned += extent_bytes;
+    }
+
+    pthread_mutex_lock(&vol->io_lock);
+    *bytes = ioengine_copy(&vol->io_engine, vol->img.fd, fileno(out), chunks, count, NULL, NULL);
+    pthread_mutex_unlock(&vol->io_lock);
+    stat_add(STAT_BYTES_READ, *bytes);
+    free(chunks);
+    return *bytes == file_size ? FAT_OK : FAT_ERR_IO;
+}
+
+int fat_save(FatFile *file, FILE *out, unsigned long *bytes)
+{
+    if (file->vol->io_engine.kind == IO_ENGINE_URING)
+        return save_engine(file, out, bytes);
+    return fat_stream(file, out, bytes);
+}
+
+// Every extent is handed to the kernel in one go, see image_copy_out()
+int fat_copy_out(FatFile *file, FILE *out, unsigned long *bytes, FatCopyMethod *method)
+{
+    FatVolume *vol = file->vol;
+    unsigned long file_size = file->entry.file_size;
+    ImageCopyMethod used = IMAGE_COPY_FILE_RANGE, slowest = IMAGE_COPY_FILE_RANGE;
+    unsigned long copied = 0;
+
+    fflush(out);
+    for (int e = 0; e < file->extent_count && copied < file_size; e++)
+    {
+        unsigned long offset = cluster_offset(vol, file->extents[e].start);
+        unsigned long extent_bytes = (unsigned long)file->extents[e].length * vol->cluster_size;
+        if (extent_bytes > file_size - copied)
+            extent_bytes = file_size - copied;
+
+        if (cache_sync_range(&vol->cache, offset, extent_bytes) != 0)
+            break;
+        unsigned long n = image_copy_out(&vol->img, offset, extent_bytes, fileno(out), copied, &used);
+        if (used > slowest)
+            slowest = used;
+        copied += n;
+        if (n != extent_bytes)
+            break;
+    }
+
+    *bytes = copied;
+    *method = slowest == IMAGE_COPY_SENDFILE ? FAT_COPY_SENDFILE
+              : slowest == IMAGE_COPY_BUFFERED ? FAT_COPY_BUFFERED
+              : FAT_COPY_FILE_RANGE;
+    return copied == file_size ? FAT_OK : FAT_ERR_IO;
+}
+
+// Let the I/O engine copy the host file into the extents. Returns the
+// number of bytes written.
+static unsigned long write_engine(FatVolume *vol, FILE *source, unsigned long file_size, const Extent *extents,
+                                  int extent_count)
+{
+    IoChunk *chunks = malloc((extent_count ? extent_count : 1) * sizeof(IoChunk));
+    if (chunks == NULL)
+        return 0;
+
+    unsigned long planned = 0;
+    for (int e = 0; e < extent_count; e++) {
+        unsigned long extent_bytes = (unsigned long)extents[e].length * vol->cluster_size;
+        if (extent_bytes > file_size - planned)
+            extent_bytes = file_size - planned;
+
+        chunks[e].src_offset = planned;
+        chunks[e].dst_offset = cluster_offset(vol, extents[e].start);
+        chunks[e].length = extent_bytes;
+        cache_invalidate_range(&vol->cache, chunks[e].dst_offset, (unsigned long)extents[e].length * vol->cluster_size);
+        planned += extent_bytes;
+    }
+
+    pthread_mutex_lock(&vol->io_lock);
+    unsigned long written = ioengine_copy(&vol->io_engine, fileno(source), vol->img.fd, chunks, extent_count, NULL, NULL);
+    pthread_mutex_unlock(&vol->io_lock);
+    stat_add(STAT_BYTES_WRITTEN, written);
+    free(chunks);
+    return written;
+}
+
+// Copy cluster by cluster, padding the last one so whole clusters bypass the cache
+static unsigned long write_sync(FatVolume *vol, FILE *source, const Extent *extents, int extent_count)
+{
+    unsigned char buffer[vol->cluster_size];
+    unsigned long written = 0;
+    size_t bytes_read;
+
+    for (int e = 0; e < extent_count; e++) {
+        for (unsigned int c = 0; c < extents[e].length; c++) {
+            if ((bytes_read = fread(buffer, 1, sizeof(buffer), source)) == 0)
+                return written;
+            memset(buffer + bytes_read, 0, sizeof(buffer) - bytes_read);
+            if (cache_write(&vol->cache, cluster_offset(vol, extents[e].start + c), buffer, sizeof(buffer)) !=
+                sizeof(buffer))
+                return written;
+            written += bytes_read;
+        }
+    }
+    return written;
+}
+
+int fat_write(FatVolume *vol, unsigned int dir, const char *name, FILE *source, FatWriteReport *report)
+{
+    memset(report, 0, sizeof(FatWriteReport));
+    if (!volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    unsigned char key[11];
+    if (!name_to_83(name, key) || key[0] == '.')
+        return FAT_ERR_BAD_NAME;
+
+    // The directory stays locked from the name check to the new entry, so no
+    // other writer takes the name or the slot. The FAT is only held to look,
+    // to allocate and to link, never while the data is copied.
+    pthread_rwlock_wrlock(dir_lock(vol, dir));
+    Extent *extents = NULL;
+    int extent_count = 0;
+    int status = lock_fat(vol, false);
+    if (status != FAT_OK)
+        goto unlock_dir;
+
+    Fat16Entry new_entry;
+    bool exists = find_entry(vol, dir, key, &new_entry, NULL);
+
+    // A directory slot first, nothing is allocated if there is none
+    DirIter it;
+    const Fat16Entry *slot;
+    unsigned long slot_offset = 0;
+    bool have_slot = false;
+    if (!exists && (status = dir_iter_open(&it, vol, dir)) == FAT_OK) {
+        while (!have_slot && (slot = dir_iter_next(&it, &slot_offset)) != NULL) {
+            if (slot->filename[0] == 0x00 || slot->filename[0] == 0xE5)
+                have_slot = true;
+        }
+        dir_iter_close(&it);
+    }
+    unlock_fat(vol);
+    if (status != FAT_OK)
+        goto unlock_dir;
+    if (exists) {
+        status = FAT_ERR_EXISTS;
+        goto unlock_dir;
+    }
+
+    long file_size;
+    if (fseek(source, 0, SEEK_END) != 0 || (file_size = ftell(source)) < 0 || fseek(source, 0, SEEK_SET) != 0) {
+        status = FAT_ERR_IO;
+        goto unlock_dir;
+    }
+    if ((unsigned long)file_size > 0xFFFFFFFFUL) {
+        status = FAT_ERR_NO_SPACE;
+        goto unlock_dir;
+    }
+    if (!have_slot) {
+        status = FAT_ERR_DIR_FULL;
+        goto unlock_dir;
+    }
+
+    // The size is known up front, so the whole file is placed in one go.
+    // Empty files get a directory entry and no clusters.
+    unsigned int needed = (file_size + vol->cluster_size - 1) / vol->cluster_size;
+    if (needed > 0) {
+        if ((status = lock_fat(vol, true)) != FAT_OK)
+            goto unlock_dir;
+        extent_count = freemap_alloc_extents(&vol->free_clusters, needed, &extents);
+        unlock_fat(vol);
+        if (extent_count < 0) {
+            extent_count = 0;
+            status = FAT_ERR_NO_SPACE;
+            goto unlock_dir;
+        }
+    }
+
+    unsigned long written;
+    if (vol->io_engine.kind == IO_ENGINE_URING)
+        written = write_engine(vol, source, file_size, extents, extent_count);
+    else
+        written = write_sync(vol, source, extents, extent_count);
+
+    // Data is in place, then the chain and the entry
+    if ((status = lock_fat(vol, true)) != FAT_OK)
+        goto unlock_dir;
+    if (written != (unsigned long)file_size) {
+        freemap_release_extents(&vol->free_clusters, extents, extent_count);
+        unlock_fat(vol);
+        status = FAT_ERR_IO;
+        goto unlock_dir;
+    }
+    link_extents(vol, extents, extent_count);
+
+    memset(&new_entry, 0, sizeof(Fat16Entry));
+    memcpy(new_entry.filename, key, 8);
+    memcpy(new_entry.ext, key + 8, 3);
+    new_entry.attributes = FAT_ATTR_ARCHIVE;
+    new_entry.file_size = file_size;
+    fat_set_entry_cluster(&new_entry, extent_count > 0 ? extents[0].start : 0);
+
+    stamp_entry(&new_entry);
+
+    if (cache_write(&vol->cache, slot_offset, &new_entry, sizeof(Fat16Entry)) != sizeof(Fat16Entry))
+        status = FAT_ERR_IO;
+
+    // Keep the directory's index in step if it has been built
+    pthread_mutex_lock(&vol->index_lock);
+    DirIndex *index = dirindex_find(&vol->dir_indexes, dir);
+    if (index != NULL && dirindex_insert(index, &new_entry, slot_offset) != 0)
+        dirindex_invalidate(&vol->dir_indexes, dir);
+    pthread_mutex_unlock(&vol->index_lock);
+
+    if (flush_fat(vol) != FAT_OK)
+        status = FAT_ERR_IO;
+    unlock_fat(vol);
+
+    report->first_cluster = extent_count > 0 ? extents[0].start : 0;
+    report->extents = extent_count;
+    report->bytes = written;
+    for (int e = 0; e < extent_count; e++) {
+        report->clusters += extents[e].length;
+        if (extents[e].length > report->largest_extent)
+            report->largest_extent = extents[e].length;
+    }
+
+unlock_dir:
+    pthread_rwlock_unlock(dir_lock(vol, dir));
+    free(extents);
+    return status;
+}
+
+// Delete a file entry and free its chain, with its directory and the FAT
+// locked exclusively
+static int unlink_entry(FatVolume *vol, unsigned int dir_cluster, const Fat16Entry *entry,
+                        unsigned long entry_offset)
+{
+    Extent *extents;
+    int extent_count = build_extents(vol, fat_entry_cluster(&vol->fat, entry), vol->cluster_count, &extents);
+    if (extent_count < 0)
+        return FAT_ERR_NO_MEMORY;
+
+    // Mark file as deleted in directory
+    unsigned char deleted = 0xE5;
+    if (cache_write(&vol->cache, entry_offset, &deleted, 1) != 1) {
+        free(extents);
+        return FAT_ERR_IO;
+    }
+
+    unsigned char key[11];
+    memcpy(key, entry->filename, 8);
+    memcpy(key + 8, entry->ext, 3);
+    pthread_mutex_lock(&vol->index_lock);
+    DirIndex *index = dirindex_find(&vol->dir_indexes, dir_cluster);
+    if (index != NULL)
+        dirindex_remove(index, key);
+    pthread_mutex_unlock(&vol->index_lock);
+
+    for (int e = 0; e < extent_count; e++) {
+        for (unsigned int cluster = extents[e].start; cluster < extents[e].start + extents[e].length; cluster++)
+            set_fat_entry(vol, cluster, 0x0000);  // Mark as free
+    }
+    release_clusters(vol, extents, extent_count);
+    free(extents);
+
+    return flush_fat(vol);
+}
+
+int fat_unlink(FatVolume *vol, unsigned int dir, const char *path)
+{
+    if (!volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    unsigned int dir_cluster;
+    unsigned char key[11];
+    int kind = resolve_parent(vol, dir, path, &dir_cluster, key);
+    if (kind != 0)
+        return kind == 1 ? FAT_ERR_IS_DIR : kind;
+
+    pthread_rwlock_wrlock(dir_lock(vol, dir_cluster));
+    int status = lock_fat(vol, true);
+    if (status == FAT_OK) {
+        Fat16Entry entry;
+        unsigned long entry_offset;
+        if (!find_entry(vol, dir_cluster, key, &entry, &entry_offset))
+            status = FAT_ERR_NOT_FOUND;
+        else if (entry.attributes & FAT_ATTR_DIRECTORY)
+            status = FAT_ERR_IS_DIR;
+        else
+            status = unlink_entry(vol, dir_cluster, &entry, entry_offset);
+        unlock_fat(vol);
+    }
+    pthread_rwlock_unlock(dir_lock(vol, dir_cluster));
+    return status;
+}
+
+// Write back the changed entry of a file, stamped with the current time, and
+// keep the directory's index in step. The FAT is locked exclusively.
+static int update_entry(FatVolume *vol, unsigned int dir, Fat16Entry *entry, unsigned long entry_offset)
+{
+    stamp_entry(entry);
+    if (cache_write(&vol->cache, entry_offset, entry, sizeof(Fat16Entry)) != sizeof(Fat16Entry))
+        return FAT_ERR_IO;
+
+    unsigned char key[11];
+    memcpy(key, entry->filename, 8);
+    memcpy(key + 8, entry->ext, 3);
+    pthread_mutex_lock(&vol->index_lock);
+    DirIndex *index = dirindex_find(&vol->dir_indexes, dir);
+    DirIndexSlot *slot = index != NULL ? (DirIndexSlot *)dirindex_lookup(index, key) : NULL;
+    if (slot != NULL && slot->offset == entry_offset)
+        slot->entry = *entry;
+    pthread_mutex_unlock(&vol->index_lock);
+    return FAT_OK;
+}
+
+// Find the file to resize with its directory locked exclusively and the FAT
+// shared. Also returns the last cluster the file's size covers, 0 if it has
+// none. On error nothing is left locked.
+static int lock_resize(FatVolume *vol, unsigned int dir, const char *path, unsigned int *parent,
+                       Fat16Entry *entry, unsigned long *entry_offset, unsigned int *last)
+{
+    if (!volume_writable(vol))
+        return FAT_ERR_READ_ONLY;
+
+    unsigned char key[11];
+    int kind = resolve_parent(vol, dir, path, parent, key);
+    if (kind != 0)
+        return kind == 1 ? FAT_ERR_IS_DIR : kind;
+
+    pthread_rwlock_wrlock(dir_lock(vol, *parent));
+    int status = lock_fat(vol, false);
+    if (status != FAT_OK) {
+        pthread_rwlock_unlock(dir_lock(vol, *parent));
+        return status;
+    }
+    if (!find_entry(vol, *parent, key, entry, entry_offset))
+        status = FAT_ERR_NOT_FOUND;
+    else if (entry->attributes & FAT_ATTR_DIRECTORY)
+        status = FAT_ERR_IS_DIR;
+
+    // Only the FAT in memory is walked to find the end, no data is read
+    *last = 0;
+    unsigned int clusters = (entry->file_size + vol->cluster_size - 1) / vol->cluster_size;
+    if (status == FAT_OK && clusters > 0) {
+        Extent *chain;
+        int count = build_extents(vol, fat_entry_cluster(&vol->fat, entry), clusters, &chain);
+        unsigned int found = 0;
+        for (int e = 0; e < count; e++)
+            found += chain[e].length;
+        if (count < 0)
+            status = FAT_ERR_NO_MEMORY;
+        else if (found < clusters)
+            status = FAT_ERR_BAD_VOLUME;    // chain shorter than the file, check -r first
+        else
+            *last = chain[count - 1].start + chain[count - 1].length - 1;
+        free(chain);
+    }
+    if (status != FAT_OK) {
+        unlock_fat(vol);
+        pthread_rwlock_unlock(dir_lock(vol, *parent));
+    }
+    return status;
+}
+
+// Fill part of a buffer from source, or with zeros when there is none
+static bool fill_buffer(FILE *source, unsigned char *buffer, unsigned long length)
+{
+    if (source == NULL) {
+        memset(buffer, 0, length);
+        return true;
+    }
+    return fread(buffer, 1, length, source) == length;
+}
+
+// Add length bytes from source (zeros without one) to the end of a file
+// found by lock_resize(). The slack of the last cluster is filled first,
+// then only the clusters still missing are allocated and linked to the
+// chain. Like fat_write, the FAT is not held while the data is copied.
+static int grow_file(FatVolume *vol, unsigned int dir, Fat16Entry *entry, unsigned long entry_offset,
+                     unsigned int last, FILE *source, unsigned long length, FatWriteReport *report)
+{
+    unsigned int cluster_size = vol->cluster_size;
+    unsigned long size = entry->file_size;
+    unsigned long slack = (size + cluster_size - 1) / cluster_size * cluster_size - size;
+    unsigned int needed = length > slack ? (length - slack + cluster_size - 1) / cluster_size : 0;
+    Extent *extents = NULL;
+    int extent_count = 0;
+    unlock_fat(vol);
+
+    if (size + length > 0xFFFFFFFFUL)
+        return FAT_ERR_NO_SPACE;
+    if (needed > 0) {
+        int status = lock_fat(vol, true);
+        if (status != FAT_OK)
+            return status;
+        extent_count = freemap_alloc_extents(&vol->free_clusters, needed, &extents);
+        unlock_fat(vol);
+        if (extent_count < 0)
+            return FAT_ERR_NO_SPACE;
+    }
+
+    // The tail of the last cluster, then whole clusters padded with zeros
+    unsigned char buffer[cluster_size];
+    unsigned long written = 0;
+    bool ok = true;
+    if (slack > 0 && length > 0) {
+        unsigned long n = slack < length ? slack : length;
+        unsigned long at = cluster_offset(vol, last) + size % cluster_size;
+        ok = fill_buffer(source, buffer, n) && cache_write(&vol->cache, at, buffer, n) == n;
+        written += ok ? n : 0;
+    }
+    for (int e = 0; e < extent_count && ok; e++) {
+        for (unsigned int c = 0; c < extents[e].length && ok; c++) {
+            unsigned long n = length - written < cluster_size ? length - written : cluster_size;
+            memset(buffer + n, 0, cluster_size - n);
+            ok = fill_buffer(source, buffer, n) &&
+                 cache_write(&vol->cache, cluster_offset(vol, extents[e].start + c), buffer, cluster_size) ==
+                 cluster_size;
+            written += ok ? n : 0;
+        }
+    }
+
+    // Data is in place, then the chain and the entry
+    int status = lock_fat(vol, true);
+    if (status != FAT_OK || !ok) {
+        if (status == FAT_OK) {
+            freemap_release_extents(&vol->free_clusters, extents, extent_count);
+            unlock_fat(vol);
+        }
+        free(extents);
+        return ok ? status : FAT_ERR_IO;
+    }
+    if (extent_count > 0) {
+        link_extents(vol, extents, extent_count);
+        if (last != 0)
+            set_fat_entry(vol, last, extents[0].start);
+        else
+            fat_set_entry_cluster(entry, extents[0].start);
+    }
+    entry->file_size = size + length;
+    status = update_entry(vol, dir, entry, entry_offset);
+    if (flush_fat(vol) != FAT_OK)
+        status = FAT_ERR_IO;
+    unlock_fat(vol);
+
+    report->first_cluster = extent_count > 0 ? extents[0].start : 0;
+    report->extents = extent_count;
+    report->bytes = written;
+    for (int e = 0; e < extent_count; e++) {
+        report->clusters += extents[e].length;
+        if (extents[e].length > report->largest_extent)
+            report->largest_extent = extents[e].length;
+    }
+    free(extents);
+    return status;
+}
+
+int fat_append(FatVolume *vol, unsigned int dir, const char *path, FILE *source, FatWriteReport *report)
+{
+    memset(report, 0, sizeof(FatWriteReport));
+    long length;
+    if (fseek(source, 0, SEEK_END) != 0 || (length = ftell(source)) < 0 || fseek(source, 0, SEEK_SET) != 0)
+        return FAT_ERR_IO;
+
+    unsigned int parent, last;
+    Fat16Entry entry;
+    unsigned long entry_offset;
+    int status = lock_resize(vol, dir, path, &parent, &entry, &entry_offset, &last);
+    if (status != FAT_OK)
+        return status;
+    status = grow_file(vol, parent, &entry, entry_offset, last, source, length, report);
+    pthread_rwlock_unlock(dir_lock(vol, parent));
+    return status;
+}
+
+int fat_truncate(FatVolume *vol, unsigned int dir, const char *path, unsigned long size)
+{
+    unsigned int parent, last;
+    Fat16Entry entry;
+    unsigned long entry_offset;
+    int status = lock_resize(vol, dir, path, &parent, &entry, &entry_offset, &last);
+    if (status != FAT_OK)
+        return status;
+
+    if (size > entry.file_size) {
+        FatWriteReport report;
+        memset(&report, 0, sizeof(FatWriteReport));
+        status = grow_file(vol, parent, &entry, entry_offset, last, NULL, size - entry.file_size, &report);
+        pthread_rwlock_unlock(dir_lock(vol, parent));
+        return status;
+    }
+
+    // The directory stays locked, so the entry can't change while the FAT
+    // lock is upgraded
+    unlock_fat(vol);
+    if ((status = lock_fat(vol, true)) != FAT_OK) {
+        pthread_rwlock_unlock(dir_lock(vol, parent));
+        return status;
+    }
+
+    // Whole chain, so clusters past the old size are freed as well
+    Extent *chain;
+    int count = build_extents(vol, fat_entry_cluster(&vol->fat, &entry), vol->cluster_count, &chain);
+    if (count < 0) {
+        status = FAT_ERR_NO_MEMORY;
+        goto unlock;
+    }
+
+    // Drop the clusters the new size still covers, what is left gets freed
+    unsigned int keep = (size + vol->cluster_size - 1) / vol->cluster_size;
+    unsigned int new_last = 0;
+    int freed = 0;
+    for (int e = 0; e < count; e++) {
+        Extent run = chain[e];
+        if (keep >= run.length) {
+            keep -= run.length;
+            new_last = run.start + run.length - 1;
+            continue;
+        }
+        if (keep > 0) {
+            new_last = run.start + keep - 1;
+            run.start += keep;
+            run.length -= keep;
+            keep = 0;
+        }
+        chain[freed++] = run;
+    }
+
+    if (freed > 0) {
+        if (size == 0)
+            fat_set_entry_cluster(&entry, 0);
+        else
+            set_fat_entry(vol, new_last, vol->fat.eoc);
+        for (int e = 0; e < freed; e++) {
+            for (unsigned int cluster = chain[e].start; cluster < chain[e].start + chain[e].length; cluster++)
+                set_fat_entry(vol, cluster, 0x0000);
+        }
+        release_clusters(vol, chain, freed);
+    }
+    free(chain);
+
+    entry.file_size = size;
+    status = update_entry(vol, parent, &entry, entry_offset);
+    if (flush_fat(vol) != FAT_OK)
+        status = FAT_ERR_IO;
+
+unlock:
+    unlock_fat(vol);
+    pthread_rwlock_unlock(dir_lock(vol, parent));
+    return status;
+}
+
+int walk_volume(FatVolume *vol, WalkVolume *walk)
+{
+    // Workers read the image directly, make it current first
+    if (cache_flush(&vol->cache) != 0)
+        return FAT_ERR_IO;
+
+    *walk = (WalkVolume){&vol->img, &vol->fat, vol->cluster_size, vol->bs.root_dir_entries, vol->root_cluster,
+                         vol->root_offset, vol->data_offset};
+    return FAT_OK;
+}
+
+WalkNode *fat_walk(FatVolume *vol, unsigned int dir)
+{
+    WalkVolume walk;
+    WalkNode *root = NULL;
+    if (lock_fat(vol, false) != FAT_OK)
+        return NULL;
+    if (walk_volume(vol, &walk) == FAT_OK)
+        root = walk_tree(&walk, dir, pool_default_threads());
+    unlock_fat(vol);
+    return root;
+}
+
+void fat_walk_free(WalkNode *root)
+{
+    walk_free(root);
+}
+
+int fat_extract(FatVolume *vol, unsigned int dir, const char *hostdir, FatExtractReport *report)
+{
+    memset(report, 0, sizeof(FatExtractReport));
+
+    // Writers wait until the workers are done with the FAT and the directories
+    WalkVolume walk;
+    int status = lock_fat(vol, false);
+    if (status != FAT_OK)
+        return status;
+    if ((status = walk_volume(vol, &walk)) != FAT_OK) {
+        unlock_fat(vol);
+        return status;
+    }
+    WalkNode *root = walk_tree(&walk, dir, pool_default_threads());
+    if (root == NULL) {
+        unlock_fat(vol);
+        return FAT_ERR_NO_MEMORY;
+    }
+
+    // Workers mostly wait on the disk, so run more of them than there are CPUs
+    ExtractTotals totals;
+    report->threads = pool_default_threads() * 4;
+    status = extract_tree(&walk, root, hostdir, report->threads, &totals) == 0 ? FAT_OK : FAT_ERR_IO;
+    unlock_fat(vol);
+    walk_free(root);
+
+    report->files = totals.files;
+    report->dirs = totals.dirs;
+    report->bytes = totals.bytes;
+    report->errors = totals.errors;
+    return status;
+}
+
+void fat_cache_info(const FatVolume *vol, FatCacheInfo *info)
+{
+    const Cache *cache = &vol->cache;
+    *info = (FatCacheInfo){cache->used, cache->budget, cache->blocks, cache->hits, cache->misses,
+                           cache->evictions, cache->writebacks};
+}
+
+void fat_cache_set_budget(FatVolume *vol, unsigned long budget)
+{
+    cache_set_budget(&vol->cache, budget);
+}
+
+int fat_use_uring(FatVolume *vol, unsigned int depth)
+{
+    pthread_mutex_lock(&vol->io_lock);
+    int status = ioengine_use_uring(&vol->io_engine, depth ? depth : IO_DEFAULT_DEPTH);
+    pthread_mutex_unlock(&vol->io_lock);
+    return status == 0 ? FAT_OK : FAT_ERR_UNSUPPORTED;
+}
+
+void fat_use_sync(FatVolume *vol)
+{
+    pthread_mutex_lock(&vol->io_lock);
+    ioengine_use_sync(&vol->io_engine);
+    pthread_mutex_unlock(&vol->io_lock);
+}
+
+void fat_io_info(const FatVolume *vol, FatIoInfo *info)
+{
+    info->uring = vol->io_engine.kind == IO_ENGINE_URING;
+    info->depth = vol->io_engine.depth;
+    info->chunk_size = vol->io_engine.chunk_size;
+}
@@ -0,0 +1,321 @@
+#ifndef LIBFAT_H
+#define LIBFAT_H
+
+#include <stdio.h>
+#include <stdbool.h>
+
+// libfat: FAT12/16/32 images behind an opaque volume handle. Everything a
+// mounted image needs (layout, FAT, free map, caches, I/O engine) lives in
+// its FatVolume, so any number of images can be open in one process.
+// Directories are named by their first cluster, 0 always being the root.
+// Calls return FAT_OK (0) or a negative FatError unless noted otherwise.
+//
+// One volume can be shared by several threads: reads of different files run
+// in parallel while writes, deletes and defrag are serialized where they
+// touch the FAT or the same directory. A FatDir or FatFile handle belongs to
+// one thread at a time. Mount, unmount and the tuning calls are not meant
+// to race with anything else on the volume.
+
+typedef struct FatVolume FatVolume;
+typedef struct FatDir FatDir;
+typedef struct FatFile FatFile;
+
+typedef enum {
+    FAT_OK = 0,
+    FAT_ERR_IO = -1,
+    FAT_ERR_NO_MEMORY = -2,
+    FAT_ERR_NOT_FOUND = -3,
+    FAT_ERR_NOT_DIR = -4,
+    FAT_ERR_IS_DIR = -5,
+    FAT_ERR_EXISTS = -6,
+    FAT_ERR_NO_SPACE = -7,
+    FAT_ERR_DIR_FULL = -8,
+    FAT_ERR_READ_ONLY = -9,
+    FAT_ERR_BAD_NAME = -10,
+    FAT_ERR_BAD_VOLUME = -11,
+    FAT_ERR_UNSUPPORTED = -12
+} FatError;
+
+const char *fat_strerror(int error);
+
+// ---------------------------------------------------------------------------
+// Volumes
+
+typedef enum {
+    FAT_MOUNT_READ_WRITE = 0,   // read-write, falling back to read-only
+    FAT_MOUNT_READ_ONLY = 1
+} FatMountFlags;
+
+typedef struct {
+    unsigned char type;
+    unsigned int start_sector;
+    unsigned int length_sectors;
+} FatPartition;
+
+typedef struct {
+    int fat_type;               // 12, 16 or 32
+    char label[12];
+    unsigned int sector_size;
+    unsigned int cluster_size;
+    unsigned int data_clusters;
+    unsigned int root_cluster;  // first cluster of a FAT32 root, 0 otherwise
+    bool read_only;
+    bool mapped;                // image is memory mapped
+    FatPartition partitions[4];
+    unsigned long fat_bytes_flushed;    // FAT bytes written so far, all copies
+} FatVolumeInfo;
+
+int fat_mount(const char *path, FatMountFlags flags, FatVolume **vol);
+
+// Flush and release everything, vol is gone afterwards
+int fat_unmount(FatVolume *vol);
+
+// Write the FAT and every cached block back to the image
+int fat_flush(FatVolume *vol);
+
+void fat_volume_info(const FatVolume *vol, FatVolumeInfo *info);
+
+// Free clusters, loads the FAT on first use
+long fat_free_clusters(FatVolume *vol);
+
+// ---------------------------------------------------------------------------
+// Directories
+
+#define FAT_ATTR_VOLUME_LABEL 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+
+typedef struct {
+    char name[13];              // NAME.EXT, padding removed
+    unsigned char raw_name[11];
+    unsigned char attributes;
+    bool is_dir;
+    unsigned int cluster;       // first cluster, 0 for an empty file or the root
+    unsigned int size;
+    unsigned short modify_time;
+    unsigned short modify_date;
+} FatDirent;
+
+// Raw 8.3 name as NAME.EXT with the padding dropped, name holds 13 bytes
+void fat_format_name(const unsigned char raw[11], char *name);
+
+// Iterate a directory in on-disk order. Deleted entries and volume labels
+// are skipped; "." and ".." are returned like any other entry.
+int fat_dir_open(FatVolume *vol, unsigned int dir, FatDir **it);
+
+// 1 with the next entry filled in, 0 at the end of the directory
+int fat_dir_next(FatDir *it, FatDirent *entry);
+void fat_dir_close(FatDir *it);
+
+// Follow path from dir, or from the root if it starts with '/'. A
+// directory's cluster is reported as 0 when it is the root.
+int fat_lookup(FatVolume *vol, unsigned int dir, const char *path, FatDirent *entry);
+
+// ---------------------------------------------------------------------------
+// Files
+
+// An open file keeps reading the clusters it had at fat_open(), even if the
+// file is deleted or moved by defrag meanwhile. Clusters freed that way are
+// only reused once no file on the volume is open.
+int fat_open(FatVolume *vol, unsigned int dir, const char *path, FatFile **file);
+void fat_close(FatFile *file);
+
+void fat_file_info(const FatFile *file, FatDirent *entry);
+
+// Runs of consecutive clusters the file is stored in
+int fat_file_extents(const FatFile *file);
+
+// Read up to len bytes at offset. Returns bytes read (0 at the end of the
+// file) or a negative FatError. The handle keeps the chain as extents, so
+// any offset is found without walking the FAT and only the clusters the
+// range covers are read.
+long fat_read(FatFile *file, void *buf, unsigned long len, unsigned long offset);
+
+// Copy the whole file to a stdio stream, one sequential pass
+int fat_stream(FatFile *file, FILE *out, unsigned long *bytes);
+
+// Copy the whole file into a regular host file, through the volume's I/O
+// engine when io_uring is selected
+int fat_save(FatFile *file, FILE *out, unsigned long *bytes);
+
+typedef enum {
+    FAT_COPY_FILE_RANGE,
+    FAT_COPY_SENDFILE,
+    FAT_COPY_BUFFERED
+} FatCopyMethod;
+
+// Copy the whole file into a host file keeping the data in the kernel when
+// possible. method reports the slowest mechanism any extent needed.
+int fat_copy_out(FatFile *file, FILE *out, unsigned long *bytes, FatCopyMethod *method);
+
+typedef struct {
+    unsigned int first_cluster;
+    unsigned int clusters;
+    int extents;
+    unsigned int largest_extent;    // clusters
+    unsigned long bytes;
+} FatWriteReport;
+
+// Create name in dir with the contents of source, read to its end. The file
+// is placed best-fit in as few extents as the free space allows.
+int fat_write(FatVolume *vol, unsigned int dir, const char *name, FILE *source, FatWriteReport *report);
+
+int fat_unlink(FatVolume *vol, unsigned int dir, const char *path);
+
+// Add the contents of source, read to its end, to the end of a file. The
+// slack of its last cluster is filled first and only the clusters still
+// missing are allocated; report covers the new clusters.
+int fat_append(FatVolume *vol, unsigned int dir, const char *path, FILE *source, FatWriteReport *report);
+
+// Set a file's size. Clusters past the new end are freed, a larger size
+// appends zeros. Both update the modification time.
+int fat_truncate(FatVolume *vol, unsigned int dir, const char *path, unsigned long size);
+
+// ---------------------------------------------------------------------------
+// Whole trees
+
+typedef struct {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+    unsigned long clusters;
+    unsigned long extents;
+    unsigned long fragmented;   // files stored in more than one extent
+} WalkTotals;
+
+typedef struct WalkNode {
+    unsigned char name[11];     // raw 8.3 name
+    bool is_dir;
+    unsigned int cluster;
+    unsigned int file_size;
+    unsigned int clusters;      // clusters held by this file or directory itself
+    unsigned int extents;
+    struct WalkNode *children;
+    int child_count;
+    WalkTotals totals;          // this node and everything below it
+} WalkNode;
+
+// Everything below dir, read by a pool of threads. NULL if memory runs out.
+// Free the result with fat_walk_free().
+WalkNode *fat_walk(FatVolume *vol, unsigned int dir);
+void fat_walk_free(WalkNode *root);
+
+typedef struct {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long bytes;
+    unsigned long errors;       // files or directories that could not be written
+    int threads;
+} FatExtractReport;
+
+// Recreate the tree below dir under hostdir, one pool task per file
+int fat_extract(FatVolume *vol, unsigned int dir, const char *hostdir, FatExtractReport *report);
+
+typedef struct {
+    int files;
+    int existing;               // names already taken, skipped
+    int bad_names;              // host names without an 8.3 form, skipped
+    int too_large;              // host files of 4 GiB or more, skipped
+    int not_placed;             // out of directory slots or clusters
+    int extents;
+    int fragmented;
+    unsigned long bytes;
+} FatImportReport;
+
+// Copy the regular files of hostdir into dir. Space for all of them is
+// planned first, the data goes out in large writes in disk order and the
+// metadata is committed once at the end. FAT_ERR_DIR_FULL or
+// FAT_ERR_NO_SPACE when some files did not fit; the others are imported.
+int fat_import(FatVolume *vol, unsigned int dir, const char *hostdir, FatImportReport *report);
+
+// Called for every file defrag moves (or would move, on a dry run)
+typedef void (*FatDefragFn)(void *ctx, const char *name, int old_extents, int new_extents,
+                            unsigned int clusters, unsigned int start);
+
+typedef struct {
+    int files;
+    int fragmented;
+    int moved;
+    unsigned long clusters_moved;
+    unsigned long extents_before;
+    unsigned long extents_after;
+} FatDefragReport;
+
+// Move fragmented files below path (a file or a directory, relative to dir)
+// into fewer extents. A dry run plans the same moves without writing.
+int fat_defrag(FatVolume *vol, unsigned int dir, const char *path, bool dry_run, FatDefragFn moved, void *ctx,
+               FatDefragReport *report);
+
+typedef enum {
+    FAT_PROBLEM_CROSS_LINKED,   // chain runs into clusters another chain (or itself) holds
+    FAT_PROBLEM_BROKEN_CHAIN,   // chain reaches a free, bad or out of range cluster
+    FAT_PROBLEM_CHAIN_LONGER,   // more clusters than the file size needs
+    FAT_PROBLEM_CHAIN_SHORTER,  // fewer clusters than the file size needs
+    FAT_PROBLEM_LOST_CLUSTERS,  // in use in the FAT, reached from no entry
+    FAT_PROBLEM_FAT_MISMATCH    // sectors where a FAT copy differs from the first
+} FatProblem;
+
+typedef struct {
+    FatProblem kind;
+    const char *path;           // file or directory, NULL for problems of the FAT itself
+    unsigned int cluster;       // where the chain stopped, the first lost cluster or the FAT copy
+    unsigned long expected;     // clusters the file size needs
+    unsigned long found;        // clusters in the chain, lost clusters or differing sectors
+    bool repaired;
+} FatCheckProblem;
+
+typedef void (*FatCheckFn)(void *ctx, const FatCheckProblem *problem);
+
+typedef struct {
+    unsigned long files;
+    unsigned long dirs;
+    unsigned long clusters;     // reached from the root
+    unsigned long free_clusters;
+    unsigned long bad_clusters;
+    unsigned int fat_copies;
+    unsigned long problems;
+    unsigned long repaired;
+    unsigned long cross_linked;
+    unsigned long broken_chains;
+    unsigned long chains_longer;
+    unsigned long chains_shorter;
+    unsigned long lost_clusters;
+    unsigned long mismatched_sectors;
+} FatCheckReport;
+
+// Check the whole volume in one pass over the tree and the FAT, with a bit
+// per cluster for what the chains reached. With repair, files are cut to
+// what their chain holds (or the chain to what the size needs), lost
+// clusters are freed and the first FAT copy is written over the others.
+// The volume is held against writers for the whole pass.
+int fat_check(FatVolume *vol, bool repair, FatCheckFn problem, void *ctx, FatCheckReport *report);
+
+// ---------------------------------------------------------------------------
+// Tuning
+
+typedef struct {
+    unsigned long used;
+    unsigned long budget;
+    unsigned long blocks;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks;
+} FatCacheInfo;
+
+void fat_cache_info(const FatVolume *vol, FatCacheInfo *info);
+void fat_cache_set_budget(FatVolume *vol, unsigned long budget);
+
+typedef struct {
+    bool uring;
+    unsigned int depth;
+    unsigned int chunk_size;
+} FatIoInfo;
+
+// Move bulk data with io_uring at the given queue depth (0 for the default),
+// FAT_ERR_UNSUPPORTED if the kernel lacks it
+int fat_use_uring(FatVolume *vol, unsigned int depth);
+void fat_use_sync(FatVolume *vol);
+void fat_io_info(const FatVolume *vol, FatIoInfo *info);
+
+#endif
@@ -0,0 +1,263 @@
+#include "pool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+    PoolTask task;
+    void *arg;
+} PoolItem;
+
+typedef struct {
+    pthread_mutex_t lock;
+    PoolItem *items;
+    int top;        // steal end
+    int bottom;     // owner end
+    int capacity;
+} Deque;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Worker;
+
+struct Pool {
+    int threads;
+    pthread_t *tids;
+    Worker *workers;
+    Deque *deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_ready;
+    pthread_cond_t all_done;
+    long queued;        // items sitting in deques
+    long pending;       // submitted and not yet finished
+    bool stopping;
+    unsigned int next_deque;
+};
+
+static __thread Worker *current_worker = NULL;
+
+int pool_default_threads()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+int pool_threads(const Pool *pool)
+{
+    return pool->threads;
+}
+
+static void deque_push(Deque *d, PoolItem item)
+{
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom == d->capacity)
+    {
+        // Compact before growing
+        int live = d->bottom - d->top;
+        if (d->top > 0 && live < d->capacity / 2)
+        {
+            for (int i = 0; i < live; i++)
+                d->items[i] = d->items[d->top + i];
+        }
+        else
+        {
+            d->capacity = d->capacity ? d->capacity * 2 : 64;
+            PoolItem *grown = realloc(d->items, d->capacity * sizeof(PoolItem));
+            if (grown == NULL)
+                abort();
+            d->items = grown;
+            for (int i = 0; i < live; i++)
+                d->items[i] = d->items[d->top + i];
+        }
+        d->top = 0;
+        d->bottom = live;
+    }
+    d->items[d->bottom++] = item;
+    pthread_mutex_unlock(&d->lock);
+}
+
+static bool deque_pop(Deque *d, PoolItem *item)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+    {
+        *item = d->items[--d->bottom];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool deque_steal(Deque *d, PoolItem *item)
+{
+    bool found = false;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom > d->top)
+    {
+        *item = d->items[d->top++];
+        found = true;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+static bool take_work(Pool *pool, int id, PoolItem *item)
+{
+    if (deque_pop(&pool->deques[id], item))
+        return true;
+    for (int i = 1; i < pool->threads; i++)
+    {
+        if (deque_steal(&pool->deques[(id + i) % pool->threads], item))
+            return true;
+    }
+    return false;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *worker = arg;
+    Pool *pool = worker->pool;
+    current_worker = worker;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->work_ready, &pool->lock);
+        if (pool->stopping && pool->queued == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        PoolItem item;
+        if (!take_work(pool, worker->id, &item))
+        {
+            // Someone else got there first
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        item.task(pool, item.arg);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->pending == 0)
+            pthread_cond_broadcast(&pool->all_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+Pool *pool_create(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+
+    Pool *pool = calloc(1, sizeof(Pool));
+    if (pool == NULL)
+        return NULL;
+    pool->threads = threads;
+    pool->tids = calloc(threads, sizeof(pthread_t));
+    pool->workers = calloc(threads, sizeof(Worker));
+    pool->deques = calloc(threads, sizeof(Deque));
+    if (pool->tids == NULL || pool->workers == NULL || pool->deques == NULL)
+    {
+        free(pool->tids);
+        free(pool->workers);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_ready, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->workers[i].pool = pool;
+        pool->workers[i].id = i;
+    }
+
+    int started = 0;
+    for (; started < threads; started++)
+    {
+        if (pthread_create(&pool->tids[started], NULL, worker_main, &pool->workers[started]) != 0)
+            break;
+    }
+    if (started == 0)
+    {
+        pool->threads = 0;
+        pool_destroy(pool);
+        return NULL;
+    }
+    pool->threads = started;
+    return pool;
+}
+
+void pool_submit(Pool *pool, PoolTask task, void *arg)
+{
+    PoolItem item = {task, arg};
+    int id;
+
+    if (current_worker != NULL && current_worker->pool == pool)
+    {
+        id = current_worker->id;
+    }
+    else
+    {
+        pthread_mutex_lock(&pool->lock);
+        id = pool->next_deque++ % pool->threads;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    deque_push(&pool->deques[id], item);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pool->pending++;
+    pthread_cond_signal(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_wait(Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0)
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(Pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threads; i++)
+        pthread_join(pool->tids[i], NULL);
+
+    for (int i = 0; i < pool->threads; i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].items);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_ready);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->tids);
+    free(pool->workers);
+    free(pool->deques);
+    free(pool);
+}
@@ -0,0 +1,25 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Work-stealing thread pool. Every worker owns a deque: tasks it submits go
+// to the bottom of its own deque and it pops from there (newest first),
+// idle workers steal from the top of other deques (oldest first).
+
+typedef struct Pool Pool;
+typedef void (*PoolTask)(Pool *pool, void *arg);
+
+Pool *pool_create(int threads);
+void pool_destroy(Pool *pool);
+
+// Queue a task. Tasks may submit further tasks.
+void pool_submit(Pool *pool, PoolTask task, void *arg);
+
+// Block until every submitted task, including nested ones, has finished
+void pool_wait(Pool *pool);
+
+int pool_threads(const Pool *pool);
+
+// Worker count matching the online CPUs, at least 1
+int pool_default_threads();
+
+#endif
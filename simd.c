@@ -0,0 +1,382 @@
+#include "simd.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+#define WORD_BITS (8 * sizeof(unsigned long))
+
+static int current_level = -1;
+
+static SimdLevel detect_level()
+{
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+#endif
+    return SIMD_SCALAR;
+}
+
+SimdLevel simd_level()
+{
+    if (current_level < 0)
+        current_level = detect_level();
+    return current_level;
+}
+
+const char *simd_level_name(SimdLevel level)
+{
+    static const char *names[] = {"scalar", "sse2", "avx2"};
+    return names[level];
+}
+
+void simd_set_level(SimdLevel level)
+{
+    SimdLevel best = detect_level();
+    current_level = level < best ? level : best;
+}
+
+// ---------------------------------------------------------------------------
+// Zero entries in the FAT. The vector versions turn every WORD_BITS entries
+// into one bitmap word; the scalar loop handles the tail.
+
+static unsigned int zero_bits16_scalar(const unsigned short *entries, unsigned int from, unsigned int count,
+                                       unsigned long *bits)
+{
+    unsigned int found = 0;
+    for (unsigned int i = from; i < count; i++)
+    {
+        if (entries[i] == 0)
+        {
+            bits[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+            found++;
+        }
+    }
+    return found;
+}
+
+static unsigned int zero_bits32_scalar(const unsigned int *entries, unsigned int from, unsigned int count,
+                                       unsigned long *bits)
+{
+    unsigned int found = 0;
+    for (unsigned int i = from; i < count; i++)
+    {
+        if ((entries[i] & 0x0FFFFFFF) == 0)
+        {
+            bits[i / WORD_BITS] |= 1UL << (i % WORD_BITS);
+            found++;
+        }
+    }
+    return found;
+}
+
+#ifdef SIMD_X86
+// 16 entries per step: two compares packed to bytes, one movemask
+__attribute__((target("sse2")))
+static unsigned int zero_bits16_sse2(const unsigned short *entries, unsigned int count, unsigned long *bits)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned int words = count / WORD_BITS, found = 0;
+
+    for (unsigned int w = 0; w < words; w++)
+    {
+        const unsigned short *p = entries + (unsigned long)w * WORD_BITS;
+        unsigned long mask = 0;
+        for (unsigned int k = 0; k < WORD_BITS; k += 16)
+        {
+            __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(p + k)), zero);
+            __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(p + k + 8)), zero);
+            mask |= (unsigned long)(unsigned int)_mm_movemask_epi8(_mm_packs_epi16(a, b)) << k;
+        }
+        bits[w] |= mask;
+        found += __builtin_popcountl(mask);
+    }
+    return found + zero_bits16_scalar(entries, words * WORD_BITS, count, bits);
+}
+
+// 32 entries per step; packing works per 128-bit lane, the permute puts
+// the four quarters back in entry order
+__attribute__((target("avx2")))
+static unsigned int zero_bits16_avx2(const unsigned short *entries, unsigned int count, unsigned long *bits)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned int words = count / WORD_BITS, found = 0;
+
+    for (unsigned int w = 0; w < words; w++)
+    {
+        const unsigned short *p = entries + (unsigned long)w * WORD_BITS;
+        unsigned long mask = 0;
+        for (unsigned int k = 0; k < WORD_BITS; k += 32)
+        {
+            __m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(p + k)), zero);
+            __m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i *)(p + k + 16)), zero);
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+            mask |= (unsigned long)(unsigned int)_mm256_movemask_epi8(packed) << k;
+        }
+        bits[w] |= mask;
+        found += __builtin_popcountl(mask);
+    }
+    return found + zero_bits16_scalar(entries, words * WORD_BITS, count, bits);
+}
+
+// 16 entries per step: four compares narrowed to bytes, one movemask
+__attribute__((target("sse2")))
+static unsigned int zero_bits32_sse2(const unsigned int *entries, unsigned int count, unsigned long *bits)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low28 = _mm_set1_epi32(0x0FFFFFFF);
+    unsigned int words = count / WORD_BITS, found = 0;
+
+    for (unsigned int w = 0; w < words; w++)
+    {
+        const unsigned int *p = entries + (unsigned long)w * WORD_BITS;
+        unsigned long mask = 0;
+        for (unsigned int k = 0; k < WORD_BITS; k += 16)
+        {
+            __m128i a = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + k)), low28), zero);
+            __m128i b = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + k + 4)), low28), zero);
+            __m128i c = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + k + 8)), low28), zero);
+            __m128i d = _mm_cmpeq_epi32(_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + k + 12)), low28), zero);
+            __m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+            mask |= (unsigned long)(unsigned int)_mm_movemask_epi8(packed) << k;
+        }
+        bits[w] |= mask;
+        found += __builtin_popcountl(mask);
+    }
+    return found + zero_bits32_scalar(entries, words * WORD_BITS, count, bits);
+}
+
+// 32 entries per step, eight per compare
+__attribute__((target("avx2")))
+static unsigned int zero_bits32_avx2(const unsigned int *entries, unsigned int count, unsigned long *bits)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i low28 = _mm256_set1_epi32(0x0FFFFFFF);
+    unsigned int words = count / WORD_BITS, found = 0;
+
+    for (unsigned int w = 0; w < words; w++)
+    {
+        const unsigned int *p = entries + (unsigned long)w * WORD_BITS;
+        unsigned long mask = 0;
+        for (unsigned int k = 0; k < WORD_BITS; k += 8)
+        {
+            __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(p + k)), low28);
+            mask |= (unsigned long)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, zero))) << k;
+        }
+        bits[w] |= mask;
+        found += __builtin_popcountl(mask);
+    }
+    return found + zero_bits32_scalar(entries, words * WORD_BITS, count, bits);
+}
+#endif
+
+unsigned int simd_zero_bits16(const unsigned short *entries, unsigned int count, unsigned long *bits)
+{
+    switch (simd_level())
+    {
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        return zero_bits16_avx2(entries, count, bits);
+    case SIMD_SSE2:
+        return zero_bits16_sse2(entries, count, bits);
+#endif
+    default:
+        return zero_bits16_scalar(entries, 0, count, bits);
+    }
+}
+
+unsigned int simd_zero_bits32(const unsigned int *entries, unsigned int count, unsigned long *bits)
+{
+    switch (simd_level())
+    {
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        return zero_bits32_avx2(entries, count, bits);
+    case SIMD_SSE2:
+        return zero_bits32_sse2(entries, count, bits);
+#endif
+    default:
+        return zero_bits32_scalar(entries, 0, count, bits);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Block compare. The vector versions check a whole stretch with one branch
+// and leave finding the exact byte to the scalar loop.
+
+static unsigned long mismatch_scalar(const unsigned char *a, const unsigned char *b, unsigned long from,
+                                     unsigned long length)
+{
+    for (unsigned long i = from; i < length; i++)
+    {
+        if (a[i] != b[i])
+            return i;
+    }
+    return length;
+}
+
+#ifdef SIMD_X86
+// 64 bytes per step, four compares folded into one movemask
+__attribute__((target("sse2")))
+static unsigned long mismatch_sse2(const unsigned char *a, const unsigned char *b, unsigned long length)
+{
+    unsigned long i = 0;
+    for (; i + 64 <= length; i += 64)
+    {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                    _mm_loadu_si128((const __m128i *)(b + i)));
+        for (int k = 16; k < 64; k += 16)
+            eq = _mm_and_si128(eq, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + k)),
+                                                  _mm_loadu_si128((const __m128i *)(b + i + k))));
+        if (_mm_movemask_epi8(eq) != 0xFFFF)
+            return mismatch_scalar(a, b, i, i + 64);
+    }
+    return mismatch_scalar(a, b, i, length);
+}
+
+// 128 bytes per step
+__attribute__((target("avx2")))
+static unsigned long mismatch_avx2(const unsigned char *a, const unsigned char *b, unsigned long length)
+{
+    unsigned long i = 0;
+    for (; i + 128 <= length; i += 128)
+    {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                       _mm256_loadu_si256((const __m256i *)(b + i)));
+        for (int k = 32; k < 128; k += 32)
+            eq = _mm256_and_si256(eq, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + k)),
+                                                        _mm256_loadu_si256((const __m256i *)(b + i + k))));
+        if ((unsigned int)_mm256_movemask_epi8(eq) != 0xFFFFFFFF)
+            return mismatch_scalar(a, b, i, i + 128);
+    }
+    return mismatch_scalar(a, b, i, length);
+}
+#endif
+
+unsigned long simd_mismatch(const void *a, const void *b, unsigned long length)
+{
+    switch (simd_level())
+    {
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        return mismatch_avx2(a, b, length);
+    case SIMD_SSE2:
+        return mismatch_sse2(a, b, length);
+#endif
+    default:
+        return mismatch_scalar(a, b, 0, length);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 8.3 name scan. The name and extension are the first 11 bytes of an entry,
+// so one 16-byte compare per entry checks all of it; the candidate is then
+// confirmed to be neither deleted nor a volume label (or LFN) entry.
+
+static inline bool usable_entry(const Fat16Entry *entry)
+{
+    return entry->filename[0] != 0xE5 && !(entry->attributes & 0x08);
+}
+
+static int find_name_scalar(const Fat16Entry *entries, unsigned int from, unsigned int count,
+                            const unsigned char name[11], bool *end)
+{
+    for (unsigned int i = from; i < count; i++)
+    {
+        if (entries[i].filename[0] == 0x00)
+        {
+            *end = true;
+            return -1;
+        }
+        if (memcmp(entries[i].filename, name, 11) == 0 && usable_entry(&entries[i]))
+            return i;
+    }
+    return -1;
+}
+
+#ifdef SIMD_X86
+// eq holds the byte-compare masks of two entries, one per 16-bit half;
+// true if either half matched all 11 name bytes
+static inline bool name_hit2(unsigned int eq)
+{
+    unsigned int missed = ~eq & 0x07FF07FF;
+    return (missed & 0x7FF) == 0 || (missed & 0x07FF0000) == 0;
+}
+
+// Two entries per step, a branch only when one of them matches or ends the
+// directory; the scalar loop then sorts out which
+__attribute__((target("sse2")))
+static int find_name_sse2(const Fat16Entry *entries, unsigned int count, const unsigned char name[11], bool *end)
+{
+    unsigned char query[16] = {0};
+    memcpy(query, name, 11);
+    const __m128i want = _mm_loadu_si128((const __m128i *)query);
+    unsigned int i = 0;
+
+    for (; i + 2 <= count; i += 2)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)&entries[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&entries[i + 1]);
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, want)) |
+                          _mm_movemask_epi8(_mm_cmpeq_epi8(b, want)) << 16;
+        if (entries[i].filename[0] == 0x00 || entries[i + 1].filename[0] == 0x00 || name_hit2(eq))
+        {
+            int found = find_name_scalar(entries, i, i + 2, name, end);
+            if (found >= 0 || *end)
+                return found;
+        }
+    }
+    return find_name_scalar(entries, i, count, name, end);
+}
+
+// Four entries per step, one in each 128-bit lane of two registers
+__attribute__((target("avx2")))
+static int find_name_avx2(const Fat16Entry *entries, unsigned int count, const unsigned char name[11], bool *end)
+{
+    unsigned char query[16] = {0};
+    memcpy(query, name, 11);
+    const __m256i want = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)query));
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned int i = 0;
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&entries[i])),
+                                            _mm_loadu_si128((const __m128i *)&entries[i + 1]), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&entries[i + 2])),
+                                            _mm_loadu_si128((const __m128i *)&entries[i + 3]), 1);
+        unsigned int eq_a = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, want));
+        unsigned int eq_b = _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, want));
+        unsigned int nul = (_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) |
+                            _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero))) & 0x10001;
+        if (nul || name_hit2(eq_a) || name_hit2(eq_b))
+        {
+            int found = find_name_scalar(entries, i, i + 4, name, end);
+            if (found >= 0 || *end)
+                return found;
+        }
+    }
+    return find_name_scalar(entries, i, count, name, end);
+}
+#endif
+
+int simd_find_name(const Fat16Entry *entries, unsigned int count, const unsigned char name[11], bool *end)
+{
+    *end = false;
+    switch (simd_level())
+    {
+#ifdef SIMD_X86
+    case SIMD_AVX2:
+        return find_name_avx2(entries, count, name, end);
+    case SIMD_SSE2:
+        return find_name_sse2(entries, count, name, end);
+#endif
+    default:
+        return find_name_scalar(entries, 0, count, name, end);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "fat.h"
+#include <stdbool.h>
+
+// Vector kernels for the hot scans: zero entries in the FAT, 8.3 names in
+// directory blocks and the compare of two FAT copies. Each has an SSE2 and an AVX2 version next to the
+// scalar one; the best level the CPU supports is picked on first use.
+
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+} SimdLevel;
+
+SimdLevel simd_level();
+const char *simd_level_name(SimdLevel level);
+
+// Use a lower level, e.g. to compare them. Levels the CPU lacks are clamped.
+void simd_set_level(SimdLevel level);
+
+// Set bit i of bits for every zero entry i below count, returns how many
+// there were. bits must hold count bits and start out cleared. The 32-bit
+// variant ignores the reserved top four bits of FAT32 entries.
+unsigned int simd_zero_bits16(const unsigned short *entries, unsigned int count, unsigned long *bits);
+unsigned int simd_zero_bits32(const unsigned int *entries, unsigned int count, unsigned long *bits);
+
+// Offset of the first byte where a and b differ, length if they are equal.
+// Used to compare the FAT copies.
+unsigned long simd_mismatch(const void *a, const void *b, unsigned long length);
+
+// Index of the first entry named name (11 bytes, padded 8.3) among count
+// entries, skipping deleted entries and volume labels. Returns -1 if there
+// is none; *end is set when the scan ran into the end-of-directory marker.
+int simd_find_name(const Fat16Entry *entries, unsigned int count, const unsigned char name[11], bool *end);
+
+#endif
@@ -0,0 +1,154 @@
+#include "stats.h"
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+unsigned long stat_counters[STAT_COUNTERS];
+
+static const char *counter_names[STAT_COUNTERS] = {
+    "syscalls", "seeks", "bytes_read", "bytes_written", "clusters", "fat_lookups", "fat_flushes"
+};
+
+static CommandStats commands[STATS_MAX_COMMANDS];
+static int command_count = 0;
+
+// Command in progress
+static CommandStats *active = NULL;
+static unsigned long started_counters[STAT_COUNTERS];
+static double started_ms;
+
+static double stats_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static CommandStats *find_command(const char *name)
+{
+    for (int i = 0; i < command_count; i++)
+    {
+        if (strcmp(commands[i].name, name) == 0)
+            return &commands[i];
+    }
+    if (command_count == STATS_MAX_COMMANDS)
+        return NULL;
+
+    CommandStats *command = &commands[command_count++];
+    memset(command, 0, sizeof(*command));
+    snprintf(command->name, sizeof(command->name), "%s", name);
+    return command;
+}
+
+void stats_begin(const char *command)
+{
+    // Only the first word names the command
+    char name[sizeof(commands[0].name)];
+    size_t len = strcspn(command, " ");
+    if (len == 0)
+    {
+        active = NULL;
+        return;
+    }
+    if (len >= sizeof(name))
+        len = sizeof(name) - 1;
+    memcpy(name, command, len);
+    name[len] = '\0';
+
+    active = find_command(name);
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        started_counters[i] = __atomic_load_n(&stat_counters[i], __ATOMIC_RELAXED);
+    started_ms = stats_now_ms();
+}
+
+void stats_end()
+{
+    if (active == NULL)
+        return;
+
+    double elapsed = stats_now_ms() - started_ms;
+    active->calls++;
+    active->total_ms += elapsed;
+    if (elapsed > active->max_ms)
+        active->max_ms = elapsed;
+    for (int i = 0; i < STAT_COUNTERS; i++)
+        active->counters[i] += __atomic_load_n(&stat_counters[i], __ATOMIC_RELAXED) - started_counters[i];
+
+    int bucket = 0;
+    unsigned long us = elapsed * 1000;
+    while (us >= 2 && bucket < STATS_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    active->histogram[bucket]++;
+    active = NULL;
+}
+
+// Drop the command in progress, e.g. one that turned out to be unknown
+void stats_cancel()
+{
+    active = NULL;
+}
+
+void stats_reset()
+{
+    command_count = 0;
+    active = NULL;
+}
+
+void stats_print(FILE *out)
+{
+    fprintf(out, "%-10s %6s %10s %10s %9s %7s %12s %12s %9s %9s %7s\n", "Command", "calls", "mean ms", "max ms",
+            "syscalls", "seeks", "bytes read", "bytes write", "clusters", "FAT get", "flushes");
+    for (int i = 0; i < command_count; i++)
+    {
+        const CommandStats *c = &commands[i];
+        if (c->calls == 0)
+            continue;
+        fprintf(out, "%-10s %6lu %10.3f %10.3f %9lu %7lu %12lu %12lu %9lu %9lu %7lu\n", c->name, c->calls,
+                c->calls ? c->total_ms / c->calls : 0.0, c->max_ms,
+                c->counters[STAT_SYSCALLS], c->counters[STAT_SEEKS],
+                c->counters[STAT_BYTES_READ], c->counters[STAT_BYTES_WRITTEN],
+                c->counters[STAT_CLUSTERS], c->counters[STAT_FAT_LOOKUPS], c->counters[STAT_FAT_FLUSHES]);
+
+        // Latency histogram, "<N us:count" for every bucket in use
+        fprintf(out, "%10s", "");
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            if (c->histogram[b])
+                fprintf(out, " <%luus:%lu", 2UL << b, c->histogram[b]);
+        }
+        fprintf(out, "\n");
+    }
+}
+
+void stats_json(FILE *out)
+{
+    fprintf(out, "{\"commands\":[");
+    bool first_command = true;
+    for (int i = 0; i < command_count; i++)
+    {
+        const CommandStats *c = &commands[i];
+        if (c->calls == 0)
+            continue;
+        fprintf(out, "%s{\"name\":\"%s\",\"calls\":%lu,\"total_ms\":%.4f,\"max_ms\":%.4f",
+                first_command ? "" : ",", c->name, c->calls, c->total_ms, c->max_ms);
+        for (int k = 0; k < STAT_COUNTERS; k++)
+            fprintf(out, ",\"%s\":%lu", counter_names[k], c->counters[k]);
+
+        // Bucket upper bounds in microseconds with their counts
+        fprintf(out, ",\"latency_us\":[");
+        bool first = true;
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            if (!c->histogram[b])
+                continue;
+            fprintf(out, "%s[%lu,%lu]", first ? "" : ",", 2UL << b, c->histogram[b]);
+            first = false;
+        }
+        fprintf(out, "]}");
+        first_command = false;
+    }
+    fprintf(out, "]}\n");
+}
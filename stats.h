@@ -0,0 +1,49 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+// Instrumentation of the image and FAT access paths. The I/O layers bump the
+// global counters; the shell brackets every command with stats_begin() and
+// stats_end(), which charges the difference to that command and files its
+// latency in a power of two histogram.
+
+typedef enum {
+    STAT_SYSCALLS,              // reads, writes, seeks and copies issued to the kernel
+    STAT_SEEKS,                 // explicit file repositioning (lseek)
+    STAT_BYTES_READ,            // bytes moved out of the image
+    STAT_BYTES_WRITTEN,         // bytes moved into the image
+    STAT_CLUSTERS,              // clusters visited while following chains
+    STAT_FAT_LOOKUPS,           // FAT entries read
+    STAT_FAT_FLUSHES,           // flush_fat() calls that wrote something
+    STAT_COUNTERS
+} StatCounter;
+
+#define STATS_BUCKETS 24        // bucket i holds latencies below 2^(i+1) microseconds
+#define STATS_MAX_COMMANDS 32
+
+typedef struct {
+    char name[16];
+    unsigned long calls;
+    unsigned long counters[STAT_COUNTERS];
+    double total_ms;
+    double max_ms;
+    unsigned long histogram[STATS_BUCKETS];
+} CommandStats;
+
+extern unsigned long stat_counters[STAT_COUNTERS];
+
+// Safe from the walker and pool threads
+static inline void stat_add(StatCounter counter, unsigned long n)
+{
+    __atomic_fetch_add(&stat_counters[counter], n, __ATOMIC_RELAXED);
+}
+
+void stats_begin(const char *command);
+void stats_end();
+void stats_cancel();
+void stats_reset();
+void stats_print(FILE *out);
+void stats_json(FILE *out);
+
+#endif
@@ -0,0 +1,179 @@
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "libfat.h"
+#include "fat.h"
+#include "image.h"
+#include "cache.h"
+#include "ioengine.h"
+#include "fattable.h"
+#include "freemap.h"
+#include "dirindex.h"
+#include "walk.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+// Inside of the FatVolume handle, shared by the library sources only. The
+// shell and other clients see nothing but libfat.h.
+//
+// Locking, always taken in this order and never two directory locks at once:
+//  - dir_locks: striped by a directory's first cluster (0 for the root).
+//    Shared to iterate or search a directory, exclusive to change entries.
+//  - fat_lock: the FAT, the free map and the deferred clusters. Shared to
+//    follow chains, exclusive to change them. Entries are only written with
+//    it held exclusively too, so code holding it shared (the tree walkers)
+//    can read directories straight from the image.
+//  - index_lock: the directory name indexes, which lookups also update.
+//  - io_lock: the I/O engine.
+//  - the cache's own mutex.
+// File data is read without any of them, through the extents an open file
+// took at fat_open().
+
+#define DIR_LOCKS 64
+
+struct FatVolume {
+    Image img;
+    Cache cache;
+    IoEngine io_engine;
+    PartitionTable pt[4];
+    Fat16BootSector bs;
+    FatTable fat;                   // entry width and accessors are set by compute_layout()
+    unsigned char *fat_dirty;       // one flag per FAT sector changed since the last flush
+    unsigned long fat_bytes_flushed;    // FAT bytes written to the image, all copies
+    FreeMap free_clusters;
+    DirIndexCache dir_indexes;
+
+    pthread_rwlock_t fat_lock;
+    pthread_rwlock_t dir_locks[DIR_LOCKS];
+    pthread_mutex_t index_lock;
+    pthread_mutex_t io_lock;
+
+    // Clusters freed while files were open. An open file may still read
+    // them through its extents, so they only go back to the free map once
+    // no file is open, a grace period in the RCU sense.
+    unsigned int open_files;
+    Extent *deferred;
+    int deferred_count, deferred_capacity;
+
+    // Byte offsets of the volume regions, part_offset from the partition
+    // table and the rest filled in by compute_layout()
+    unsigned long part_offset;
+    unsigned long fat_offset;
+    unsigned long root_offset;
+    unsigned long data_offset;
+    unsigned int cluster_size;
+    unsigned int cluster_count;     // highest valid cluster + 1
+    unsigned int fat_sectors;       // size of one FAT copy
+    unsigned int fat_copies;        // FAT copies kept in step by flush_fat()
+    unsigned int root_cluster;      // first cluster of a FAT32 root, 0 for a fixed root region
+    unsigned long fsinfo_offset;    // FAT32 FSInfo sector, 0 once its free count is invalidated
+    const char *volume_label;
+};
+
+// Directory iterator. Subdirectories are followed through the FAT chain,
+// each cluster (or the whole fixed root region) is fetched with one I/O and
+// entries are handed out from that block.
+typedef struct {
+    FatVolume *vol;
+    unsigned int cluster;           // cluster held in entries, 0 for the root region
+    const Fat16Entry *entries;
+    unsigned int count;
+    unsigned int pos;
+    unsigned int clusters_left;     // guards against cycles in a damaged chain
+} DirIter;
+
+struct FatDir {
+    DirIter it;
+    unsigned int dir;
+};
+
+struct FatFile {
+    FatVolume *vol;
+    Fat16Entry entry;
+    unsigned int dir_cluster;
+    unsigned long entry_offset;
+    Extent *extents;
+    unsigned long *extent_offsets;  // file offset each extent starts at
+    int extent_count;
+};
+
+unsigned long cluster_offset(const FatVolume *vol, unsigned int cluster);
+unsigned long dir_offset(const FatVolume *vol, unsigned int cluster);
+
+// Set an entry's modification time and date to now, local time
+void stamp_entry(Fat16Entry *entry);
+
+// Root clusters are 0 at the API, whatever the FAT type
+static inline unsigned int entry_dir_cluster(const FatVolume *vol, const Fat16Entry *entry)
+{
+    unsigned int cluster = fat_entry_cluster(&vol->fat, entry);
+    return cluster == vol->root_cluster ? 0 : cluster;
+}
+
+static inline bool volume_writable(const FatVolume *vol)
+{
+    return vol->img.mode == IMAGE_READ_WRITE;
+}
+
+static inline pthread_rwlock_t *dir_lock(FatVolume *vol, unsigned int dir)
+{
+    return &vol->dir_locks[dir % DIR_LOCKS];
+}
+
+// Take fat_lock shared or exclusive, reading the FAT and indexing its free
+// clusters first if this mount hasn't yet. Nothing is held on failure. The
+// FAT stays loaded until unmount, so only the first call can fail.
+int lock_fat(FatVolume *vol, bool exclusive);
+void unlock_fat(FatVolume *vol);
+
+// A directory's lock and fat_lock, both shared, for reading the directory.
+// A fixed root region needs no FAT.
+int lock_dir_shared(FatVolume *vol, unsigned int dir);
+void unlock_dir_shared(FatVolume *vol, unsigned int dir);
+
+// The rest expect fat_lock held, exclusively for anything that changes the
+// FAT or the free map
+unsigned int get_fat_entry(FatVolume *vol, unsigned int cluster);
+void set_fat_entry(FatVolume *vol, unsigned int cluster, unsigned int value);
+int flush_fat(FatVolume *vol);
+
+// Hand clusters that left the FAT back to the free map, or defer them while
+// files are open
+void release_clusters(FatVolume *vol, const Extent *extents, int extent_count);
+
+// Directory access expects the directory's lock and fat_lock held
+int dir_iter_open(DirIter *it, FatVolume *vol, unsigned int cluster);
+const Fat16Entry *dir_iter_next(DirIter *it, unsigned long *entry_offset);
+const Fat16Entry *dir_iter_next_block(DirIter *it, unsigned int *count, unsigned long *first_offset);
+void dir_iter_close(DirIter *it);
+
+// Look an 8.3 key up in a directory. Fills in the entry and, if
+// entry_offset isn't NULL, the image offset of the entry.
+bool find_entry(FatVolume *vol, unsigned int dir_cluster, const unsigned char key[11], Fat16Entry *entry,
+                unsigned long *entry_offset);
+
+// Follow every component of a path but the last. Returns 0 with the
+// directory holding the last component in *parent and its 8.3 key, 1 when
+// the path has no last component and names *parent itself, negative
+// FatError otherwise. Takes and drops the locks of one directory at a time,
+// call it holding none.
+int resolve_parent(FatVolume *vol, unsigned int dir, const char *path, unsigned int *parent, unsigned char key[11]);
+
+// Follow a path from dir. Returns 1 for a directory, with its cluster in
+// *cluster, and 0 for a file, with its entry and the cluster of the
+// directory holding it. Negative FatError if the path does not exist.
+// Locks like resolve_parent(); the entry may be stale once the locks are
+// dropped, so callers that change it look it up again under them.
+int resolve_path(FatVolume *vol, unsigned int dir, const char *path, unsigned int *cluster, Fat16Entry *entry,
+                 unsigned long *entry_offset);
+
+// Chain walk merged into extents, at most max_clusters long. Caller frees
+// *extents. Returns the extent count or -1 if memory runs out.
+int build_extents(FatVolume *vol, unsigned int start, unsigned int max_clusters, Extent **extents);
+void link_extents(FatVolume *vol, const Extent *extents, int extent_count);
+
+// Describe the volume to code that reads the image from worker threads.
+// The caller holds fat_lock shared for as long as the workers run.
+int walk_volume(FatVolume *vol, WalkVolume *walk);
+
+#endif
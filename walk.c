@@ -0,0 +1,191 @@
+#include "walk.h"
+#include "fat.h"
+#include "pool.h"
+#include "stats.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WALK_MAX_DEPTH 64
+
+typedef struct {
+    const WalkVolume *vol;
+    WalkNode *node;
+    int depth;
+} WalkJob;
+
+static void count_run(void *ctx, unsigned int start, unsigned int length)
+{
+    (void)start;
+    (void)length;
+    (*(unsigned int *)ctx)++;
+}
+
+// Count the clusters and extents of a chain, bounded against loops
+static void measure_chain(const WalkVolume *vol, unsigned int cluster, unsigned int *clusters, unsigned int *extents)
+{
+    *extents = 0;
+    *clusters = vol->fat->ops->walk(vol->fat, cluster, vol->fat->clusters, count_run, extents);
+}
+
+static int add_child(const WalkVolume *vol, WalkNode *node, int *capacity, const Fat16Entry *entry)
+{
+    if (node->child_count == *capacity)
+    {
+        int grown_capacity = *capacity ? *capacity * 2 : 16;
+        WalkNode *grown = realloc(node->children, grown_capacity * sizeof(WalkNode));
+        if (grown == NULL)
+            return -1;
+        node->children = grown;
+        *capacity = grown_capacity;
+    }
+
+    WalkNode *child = &node->children[node->child_count++];
+    memset(child, 0, sizeof(WalkNode));
+    memcpy(child->name, entry->filename, 8);
+    memcpy(child->name + 8, entry->ext, 3);
+    child->is_dir = (entry->attributes & 0x10) != 0;
+    child->cluster = fat_entry_cluster(vol->fat, entry);
+    child->file_size = entry->file_size;
+    return 0;
+}
+
+static void walk_dir(Pool *pool, void *arg)
+{
+    WalkJob *job = arg;
+    const WalkVolume *vol = job->vol;
+    WalkNode *node = job->node;
+    int capacity = 0;
+
+    // A FAT32 root is an ordinary chain starting at root_cluster
+    unsigned int cluster = node->cluster == 0 ? vol->root_cluster : node->cluster;
+    unsigned int block_entries = cluster == 0 ? vol->root_entries : vol->cluster_size / sizeof(Fat16Entry);
+    Fat16Entry *block = malloc(block_entries * sizeof(Fat16Entry));
+    unsigned int visited = 0;
+    bool done = block == NULL;
+
+    while (!done)
+    {
+        // One positional read per cluster, or for the whole fixed root region
+        unsigned long offset = cluster == 0 ? vol->root_offset
+                               : fat_cluster_offset(vol->data_offset, vol->cluster_size, cluster);
+        if (image_read(vol->img, offset, block, block_entries * sizeof(Fat16Entry)) != block_entries * sizeof(Fat16Entry))
+            break;
+        if (cluster != 0)
+            node->clusters++;
+
+        for (unsigned int i = 0; i < block_entries && !done; i++)
+        {
+            const Fat16Entry *entry = &block[i];
+
+            if (entry->filename[0] == 0x00) { done = true; break; }
+            if (entry->filename[0] == 0xE5) continue;
+            if (entry->attributes & 0x08) continue;
+            if (entry->filename[0] == '.') continue;
+
+            if (add_child(vol, node, &capacity, entry) != 0)
+                done = true;
+        }
+
+        if (cluster == 0 || ++visited >= vol->fat->clusters)
+            break;
+        stat_add(STAT_CLUSTERS, 1);
+        stat_add(STAT_FAT_LOOKUPS, 1);
+        cluster = vol->fat->ops->get(vol->fat, cluster);
+        if (!fat_is_next(vol->fat, cluster))
+            break;
+    }
+    free(block);
+
+    // The child array is final now, hand subdirectories to the pool
+    for (int i = 0; i < node->child_count; i++)
+    {
+        WalkNode *child = &node->children[i];
+        if (!child->is_dir)
+        {
+            measure_chain(vol, child->cluster, &child->clusters, &child->extents);
+            continue;
+        }
+        if (child->cluster == node->cluster || child->cluster == 0 || job->depth >= WALK_MAX_DEPTH)
+            continue;
+
+        WalkJob *sub = malloc(sizeof(WalkJob));
+        if (sub == NULL)
+            continue;
+        sub->vol = vol;
+        sub->node = child;
+        sub->depth = job->depth + 1;
+        pool_submit(pool, walk_dir, sub);
+    }
+    free(job);
+}
+
+static void sum_totals(WalkNode *node)
+{
+    WalkTotals *t = &node->totals;
+    memset(t, 0, sizeof(WalkTotals));
+    t->clusters = node->clusters;
+
+    if (!node->is_dir)
+    {
+        t->files = 1;
+        t->bytes = node->file_size;
+        t->extents = node->extents;
+        t->fragmented = node->extents > 1;
+        return;
+    }
+
+    for (int i = 0; i < node->child_count; i++)
+    {
+        WalkNode *child = &node->children[i];
+        sum_totals(child);
+        t->files += child->totals.files;
+        t->dirs += child->totals.dirs + (child->is_dir ? 1 : 0);
+        t->bytes += child->totals.bytes;
+        t->clusters += child->totals.clusters;
+        t->extents += child->totals.extents;
+        t->fragmented += child->totals.fragmented;
+    }
+}
+
+WalkNode *walk_tree(const WalkVolume *vol, unsigned int cluster, int threads)
+{
+    WalkNode *root = calloc(1, sizeof(WalkNode));
+    WalkJob *job = malloc(sizeof(WalkJob));
+    Pool *pool = pool_create(threads);
+    if (root == NULL || job == NULL || pool == NULL)
+    {
+        free(root);
+        free(job);
+        if (pool != NULL)
+            pool_destroy(pool);
+        return NULL;
+    }
+
+    root->is_dir = true;
+    root->cluster = cluster;
+    job->vol = vol;
+    job->node = root;
+    job->depth = 0;
+
+    pool_submit(pool, walk_dir, job);
+    pool_wait(pool);
+    pool_destroy(pool);
+
+    sum_totals(root);
+    return root;
+}
+
+static void free_children(WalkNode *node)
+{
+    for (int i = 0; i < node->child_count; i++)
+        free_children(&node->children[i]);
+    free(node->children);
+}
+
+void walk_free(WalkNode *root)
+{
+    if (root == NULL)
+        return;
+    free_children(root);
+    free(root);
+}
@@ -0,0 +1,31 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "libfat.h"
+#include "image.h"
+#include "fattable.h"
+#include <stdbool.h>
+
+// Parallel directory tree walker. Every directory is scanned by a task on a
+// work-stealing pool using positional reads, so no stream position is shared
+// between threads. Children keep their on-disk order, so printing the
+// result gives the same output as a serial walk.
+
+typedef struct {
+    Image *img;
+    const FatTable *fat;
+    unsigned int cluster_size;
+    unsigned int root_entries;  // entries of the fixed root region, 0 on FAT32
+    unsigned int root_cluster;  // first cluster of a FAT32 root, 0 otherwise
+    unsigned long root_offset;
+    unsigned long data_offset;
+} WalkVolume;
+
+// WalkNode and WalkTotals are part of the library interface, see libfat.h
+
+// Walk everything below the directory at cluster (0 for the root).
+// Returns NULL if memory runs out. Free the result with walk_free().
+WalkNode *walk_tree(const WalkVolume *vol, unsigned int cluster, int threads);
+void walk_free(WalkNode *root);
+
+#endif